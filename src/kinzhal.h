@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 #include <assert.h>
 
 typedef uint8_t kz_byte_t;
@@ -13,14 +14,74 @@ typedef double  kz_float_t;
 typedef int64_t kz_int_t;
 typedef size_t  kz_size_t;
 
-#define KZ_MAX_FOREIGN_REQUESTS  16
-#define KZ_MAX_LOCAL_REQUESTS    16
-#define KZ_MAX_CHANNELS          32
+#define KZ_MAX_LOCAL_REQUESTS    16  /* size of the tables most endpoints are given, see */
+#define KZ_MAX_CHANNELS          32  /* kz_endpointdef_t */
+#define KZ_TASK_LOCALS            2
+#define KZ_PRIORITY_LEVELS        4
+#define KZ_PRIORITY_DEFAULT       1
+#define KZ_MAX_RETRANSMITS        3
+#define KZ_CACHE_ENTRY_SIZE      16
+#define KZ_CALL_CONTEXT_SIZE      8   /* bytes of context carried by each call, see kz_callcopy() */
+
+/* tables kept in each endpoint, which may be sized when building. 0 leaves a table out, and with it
+ * what it is for: kz_defer(), subscriptions from the peer, kz_spawn(), kz_cache() (but for a TTL
+ * of 0) and kz_route() then always fail. */
+#ifndef KZ_MAX_FOREIGN_REQUESTS
+#define KZ_MAX_FOREIGN_REQUESTS  16  /* deferred replies */
+#endif
+#ifndef KZ_MAX_SUBSCRIPTIONS
+#define KZ_MAX_SUBSCRIPTIONS      4
+#endif
+#ifndef KZ_MAX_TASKS
+#define KZ_MAX_TASKS              4
+#endif
+#ifndef KZ_MAX_CACHE_ENTRIES
+#define KZ_MAX_CACHE_ENTRIES      4
+#endif
+#ifndef KZ_MAX_ROUTES
+#define KZ_MAX_ROUTES             2   /* ranges of channels forwarded elsewhere, see kz_route() */
+#endif
+#define KZ_MAX_TX_BUFFERS         4   /* the transmit buffer may be split into this many */
+#define KZ_CREDIT_QUERY_TICKS    16   /* ticks without credit before the peer's is queried again */
+
+/* smaller endpoints for small devices: tick counts are kept in 16 bits (so timeouts, TTLs and
+ * subscription periods are limited to 32767 ticks, and longer ones are refused, while task sleeps
+ * are cut short), and channels share a table of KZ_MAX_HANDLER_USERDATA distinct handler userdata
+ * pointers (NULL aside), rather than each having its own */
+#ifndef KZ_COMPACT
+#define KZ_COMPACT                0
+#endif
+#define KZ_MAX_HANDLER_USERDATA   4
 
 #define KZ_ASSERT            assert
 
+/* storage class of the library's own per-thread state, for endpoints used on several threads
+ * (which may each run their own) */
+#ifndef KZ_THREAD_LOCAL
+#if defined(__AVR__)
+#define KZ_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define KZ_THREAD_LOCAL      _Thread_local
+#elif defined(__GNUC__)
+#define KZ_THREAD_LOCAL      __thread
+#else
+#define KZ_THREAD_LOCAL
+#endif
+#endif
+
 /* end configuration */
 
+#if KZ_COMPACT
+typedef int16_t kz_ticks_t;
+#define KZ_MAX_TICKS  INT16_MAX
+#else
+typedef int     kz_ticks_t;
+#define KZ_MAX_TICKS  INT_MAX
+#endif
+
+/* the given tick count, cut short to KZ_MAX_TICKS (evaluates ticks twice) */
+#define KZ_CLAMP_TICKS(ticks)  ((ticks) > KZ_MAX_TICKS ? KZ_MAX_TICKS : (kz_ticks_t)(ticks))
+
 
 #define KZ_MIN_BUFFER_SIZE        16
 #define KZ_MAX_BUFFER_SIZE       256
@@ -35,16 +96,22 @@ typedef enum kz_request_status {
   KZ_IGNORE,
   KZ_INVALID,
   KZ_BUSY,
-  KZ_OK
+  KZ_OK,
+  KZ_DEFER, /* returned by a handler which will reply later via kz_reply() */
+  KZ_MORE   /* given to a reply handler for each part of a streamed reply */
 } kz_request_status_t;
 
 
 struct kz_endpoint;
 
-/* blocking transmit function */
+/* blocking transmit function (its endpoint's userdata is returned by kz_userdata()) */
 typedef void (* kz_txhandlerfn_t) (const kz_byte_t * bytes, size_t size);
 
-/* non-blocking receive function */
+/* takes (enable nonzero) and releases a half-duplex bus around each frame sent; must not return
+ * from releasing it until the last byte has left the transmitter */
+typedef void (* kz_txenablefn_t) (struct kz_endpoint * K, int enable);
+
+/* non-blocking receive function (its endpoint's userdata is returned by kz_userdata()) */
 typedef int  (* kz_rxhandlerfn_t) (kz_byte_t * byte);
 
 /* foreign call handler */
@@ -57,22 +124,109 @@ typedef void (* kz_reply_handler_fn_t)(struct kz_endpoint * K,
                                        kz_request_status_t status);
 
 
+typedef enum kz_task_status {
+  KZ_TASK_WAITING,
+  KZ_TASK_DONE
+} kz_task_status_t;
+
+struct kz_task;
+
+/* task body, stepped from kz_tick() until it returns KZ_TASK_DONE */
+typedef kz_task_status_t (* kz_task_fn_t)(struct kz_endpoint * K,
+                                          struct kz_task * T);
+
+
 typedef struct kz_request {
   kz_byte_t foreign_id;
+  kz_byte_t priority;
   char active;
 } kz_request_t;
 
+/* subscriptions */
+#define KZ_SUBSCRIBE_PERIODIC  1  /* send results every period */
+#define KZ_SUBSCRIBE_ONCHANGE  2  /* check every period, send results if they have changed */
+
+typedef struct kz_subscription {
+  kz_byte_t foreign_id;
+  kz_byte_t channelid;
+  kz_byte_t mode;             /* 0 if unused */
+  char sent;                  /* nonzero once results have been sent */
+  kz_ticks_t period_ticks;
+  kz_ticks_t countdown;       /* ticks until the handler is next called */
+  uint32_t checksum;          /* of the results last sent */
+} kz_subscription_t;
+
+/* reply to an earlier call, kept to answer identical calls without a request */
+typedef struct kz_cache_entry {
+  kz_ticks_t ttl_ticks;       /* ticks until the entry expires, 0 if unused */
+  char pending;               /* nonzero while waiting for the reply to reqid */
+  kz_byte_t reqid;
+  kz_byte_t channelid;
+  kz_byte_t args_size;
+  kz_byte_t results_size;
+  kz_byte_t data[KZ_CACHE_ENTRY_SIZE]; /* arguments, followed by results */
+} kz_cache_entry_t;
+
+typedef struct kz_task {
+  kz_task_fn_t fn;
+  void * userdata;
+  kz_request_t * request;           /* deferred request the task will reply to, if any */
+  kz_int_t locals[KZ_TASK_LOCALS];  /* state which persists between steps */
+  unsigned int resume;              /* where to resume the task body, 0 if not started */
+  kz_ticks_t wait_ticks;            /* ticks until the task is stepped again */
+  char wait_frame;                  /* nonzero if an incoming frame also wakes the task */
+} kz_task_t;
+
+/* context copied into a call, aligned for any of the types it is likely to hold */
+typedef union kz_call_context {
+  kz_byte_t bytes[KZ_CALL_CONTEXT_SIZE];
+  kz_int_t i;
+  kz_float_t f;
+  void * p;
+} kz_call_context_t;
+
 typedef struct kz_local_request {
   kz_reply_handler_fn_t callback;
   void * userdata;
-  int timeout_ticks;
+  struct kz_local_request * leader; /* call whose reply this one waits for, instead of its own */
+  kz_call_context_t context;   /* given to the reply handler as its userdata, see kz_callcopy() */
+  uint32_t key;                /* hash of the channel and arguments, if shared */
+  kz_ticks_t timeout_ticks;
+  kz_ticks_t timeout_period;
+  kz_ticks_t retransmit_ticks;  /* ticks until the request is sent again */
+  kz_ticks_t retransmit_period; /* doubles with each retransmission */
+  kz_byte_t retransmits_left;  /* 0 unless the request is idempotent */
+  kz_byte_t reqid;             /* index into the pool, plus a generation count */
+  char shared;                 /* nonzero if identical calls may wait for this one's reply */
 } kz_local_request_t;
 
+/* range of channels whose requests are forwarded to another endpoint's peer */
+typedef struct kz_route {
+  struct kz_endpoint * downstream;  /* NULL if unused */
+  kz_ticks_t timeout_ticks;         /* of each forwarded request */
+  kz_byte_t first_channel;
+  kz_byte_t last_channel;
+  kz_byte_t downstream_channel;     /* first_channel becomes this one downstream */
+} kz_route_t;
+
 typedef struct kz_request_handler {
   kz_request_handler_fn_t callback;
   void * userdata;
 } kz_request_handler_t;
 
+/* what an endpoint keeps for each of its channels */
+typedef struct kz_channel {
+#if KZ_COMPACT
+  kz_request_handler_fn_t handler;
+  kz_ticks_t cache_ttl;
+  kz_byte_t  userdata_index; /* into the endpoint's userdata_table, 0 for NULL */
+#else
+  kz_request_handler_t handler;
+  kz_ticks_t cache_ttl;
+#endif
+  kz_byte_t  priority;
+} kz_channel_t;
+
 /* Possible states when decoding COBS */
 typedef enum {
   KZ_RX_IDLE,
@@ -84,32 +238,155 @@ typedef struct kz_endpointdef {
   kz_byte_t * rx_buffer;     /* Receive buffer to be used by the endpoint */
   kz_byte_t * tx_buffer;     /* Transmit buffer to be used by the endpoint */
 
-  kz_rxhandlerfn_t rx;       /* Receive callback */
+  kz_rxhandlerfn_t rx;       /* Receive callback (may be NULL, see kz_receive()) */
   kz_txhandlerfn_t tx;       /* Transmit callback */
+  void * userdata;           /* For use by the receive and transmit callbacks, see kz_userdata() */
 
   kz_size_t rx_buffer_size;  /* Size of given receive buffer in bytes */
   kz_size_t tx_buffer_size;  /* Size of given transmit buffer in bytes */
+
+  kz_channel_t * channels;   /* Table of the channels which may be handled, called or cached */
+  unsigned int channel_count; /* # of entries in it (at most 256, usually KZ_MAX_CHANNELS) */
+
+  kz_local_request_t * local_requests; /* Pool of the calls which may be in flight at once */
+  unsigned int local_request_count;    /* # of entries in it (at most 255, usually
+                                          KZ_MAX_LOCAL_REQUESTS) */
+
+  unsigned int rx_window;    /* # of requests which may arrive per tick, advertised to
+                                the peer as flow control credit (0 to not advertise) */
+
+  kz_size_t tx_budget;       /* # of bytes the link can carry per tick, beyond which
+                                frames are queued by priority (0 if unlimited) */
+
+  kz_byte_t * queue_buffer;  /* Holds requests waiting for credit from the peer (optional) */
+  kz_size_t queue_buffer_size; /* Size of given queue buffer in bytes */
+
+  int retransmit_ticks;      /* # of ticks without a reply before an idempotent call is
+                                first sent again (0 to never retransmit) */
+
+  char datagram;             /* nonzero if the transport keeps frames apart by itself, in which
+                                case they are sent and received as they are, without COBS (see
+                                kz_receiveframe(), rx must be NULL) */
+
+  kz_byte_t address;         /* KZ_NODE_ADDRESS() of a node on a multi-drop bus, or the
+                                KZ_CONTROLLER_ADDRESS() of the controller's endpoint for one
+                                (0 if the link has only two peers) */
+  kz_txenablefn_t tx_enable; /* Called around each frame sent on a half-duplex bus (optional) */
+
+  unsigned int tx_buffer_count; /* # of equal parts (at most KZ_MAX_TX_BUFFERS) the transmit buffer
+                                   is split into, so that one frame can be built while another is
+                                   being sent (0 or 1 for one buffer, see kz_txdone()) */
+  char tx_async;             /* nonzero if tx only starts sending the bytes it is given, which are
+                                then held until kz_txdone() is called (needs 2 or more buffers,
+                                and a queue buffer) */
 } kz_endpointdef_t;
 
+/* Multi-drop buses:
+ *
+ * Any number of nodes (1 to 127) share a bus with one controller, which has an endpoint for each
+ * node. Every frame carries the id of the node it is from or to, so each endpoint receives all of
+ * the bus's traffic but only handles frames meant for it, and stops decoding any other as soon as
+ * its header has been read. A node only speaks when spoken to: it doesn't query the controller's
+ * credit, and should have no rx_window (which would be returned unasked).
+ */
+#define KZ_NODE_ADDRESS(id)        ((id) & 0x7F)
+#define KZ_CONTROLLER_ADDRESS(id)  (((id) & 0x7F) | 0x80)
+
 typedef struct kz_endpoint {
   kz_byte_t * rx_buffer;     /* Beginning of receive buffer */
   kz_byte_t * rx_buffer_pos; /* Past-end pointer of received frame */
   kz_byte_t * rx_buffer_end; /* Past-end pointer of receive buffer */
+  kz_size_t   rx_buffer_size; /* of the buffer given in the def, while a datagram stands in for it */
 
   kz_byte_t * tx_buffer;     /* Beginning of transmit buffer */
   kz_byte_t * tx_buffer_end; /* Past-end pointer of transmit buffer */
 
+  /* transmit buffers, of which tx_buffer is the one being built */
+  kz_byte_t * tx_pool;
+  kz_size_t   tx_pool_stride;  /* size of each */
+  kz_byte_t   tx_pool_count;
+  kz_byte_t   tx_pool_index;   /* of tx_buffer */
+  char        tx_async;
+  volatile char tx_held[KZ_MAX_TX_BUFFERS]; /* nonzero while held by the transport */
+  kz_byte_t * aside_putptr;    /* of the frame set aside by kz_putaside(), NULL if none */
+  kz_byte_t   aside_index;
+  unsigned int tx_dropped;     /* # of replies dropped, with no transmit buffer nor room in the queue */
+
+  kz_byte_t * getbegin;      /* Pointer to first byte which may be decoded */
   kz_byte_t * getptr;        /* Pointer to next byte to decode */
+  kz_byte_t * getend;        /* Past-end pointer of bytes which may be decoded */
   kz_byte_t * putptr;        /* Pointer to next byte to encode */
 
+  kz_byte_t * batch_getptr;  /* Pointer to next entry of a batch reply, NULL if at the first */
+  kz_byte_t * batch_getend;  /* Past-end pointer of a batch reply */
+  kz_byte_t * batch_putptr;  /* Pointer to batch entry being built, if any */
+  kz_byte_t   batch_count;   /* # of entries in the batch being built */
+  kz_byte_t   batch_priority;
+
   kz_rxhandlerfn_t rx;
   kz_txhandlerfn_t tx;
+  void * userdata;
 
-  /* indexed by channel id */
-  kz_request_handler_t handlers[KZ_MAX_CHANNELS];
+  /* flow control */
+  kz_byte_t * queue_buffer;     /* Beginning of queue of requests waiting for credit */
+  kz_byte_t * queue_pos;        /* Past-end pointer of queued requests */
+  kz_byte_t * queue_buffer_end; /* Past-end pointer of queue buffer */
+
+  kz_size_t    tx_budget;       /* # of bytes which may be sent per tick, 0 if unlimited */
+  kz_size_t    tx_budget_left;  /* # of bytes which may still be sent this tick */
+  int          tx_credits;      /* # of requests the peer will accept, negative if unlimited */
+  kz_size_t    tx_payload_max;  /* largest request payload the peer will accept */
+  unsigned int rx_window;       /* # of requests we accept per tick */
+  unsigned int rx_credit_owed;  /* # of requests received since credit was last returned */
+  kz_byte_t    credit_query;    /* flags of a credit frame to send on the next tick, 0 if none */
+  kz_ticks_t   credit_dry_ticks; /* # of ticks the peer's credit has been used up */
+  kz_ticks_t   retransmit_ticks; /* initial retransmission timeout of idempotent calls */
+  char         datagram;        /* frames aren't COBS encoded, see kz_endpointdef_t */
+  kz_byte_t    address;         /* carried by frames to this endpoint, 0 if not on a bus */
+  kz_txenablefn_t tx_enable;
+
+  /* indexed by channel id, given in the def */
+  kz_channel_t * channels;
+  unsigned int   channel_count;
+#if KZ_COMPACT
+  void *         userdata_table[KZ_MAX_HANDLER_USERDATA + 1];
+#endif
 
-  /* pool for current local requests */
-  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+#if KZ_MAX_ROUTES
+  /* channels which aren't handled here, see kz_route() */
+  kz_route_t routes[KZ_MAX_ROUTES];
+#endif
+
+#if KZ_MAX_CACHE_ENTRIES
+  /* replies to calls which may be answered from the cache */
+  kz_cache_entry_t cache[KZ_MAX_CACHE_ENTRIES];
+#endif
+
+  /* pool for current local requests, given in the def */
+  kz_local_request_t * local_requests;
+  unsigned int         local_request_count;
+
+#if KZ_MAX_FOREIGN_REQUESTS
+  /* pool for foreign requests whose reply has been deferred */
+  kz_request_t foreign_requests[KZ_MAX_FOREIGN_REQUESTS];
+#endif
+
+#if KZ_MAX_SUBSCRIPTIONS
+  /* table of the peer's subscriptions to our channels */
+  kz_subscription_t subscriptions[KZ_MAX_SUBSCRIPTIONS];
+#endif
+
+#if KZ_MAX_TASKS
+  /* pool for running tasks */
+  kz_task_t tasks[KZ_MAX_TASKS];
+#endif
+  char      frame_received;
+
+  /* foreign request currently being handled, if any */
+  kz_request_t * deferred;
+  kz_byte_t      handling_id;
+  kz_byte_t      handling_priority;
+  char           handling;
 
   kz_cobs_rx_state_t rx_state;
   unsigned int       rx_count;
@@ -119,6 +396,8 @@ typedef struct kz_endpoint {
 void kz_init_static(kz_endpoint_t * K,
                     const kz_endpointdef_t * def);
 
+/* handle the peer's requests on the given channel (NULL to stop). Fails if KZ_COMPACT and
+ * KZ_MAX_HANDLER_USERDATA other userdata pointers are already in use. */
 int kz_handle(kz_endpoint_t * K,
               unsigned int channelid,
               kz_request_handler_fn_t fn,
@@ -126,16 +405,241 @@ int kz_handle(kz_endpoint_t * K,
 
 void kz_tick(kz_endpoint_t * K);
 
+/* the userdata of the endpoint whose rx or tx callback is being called (on this thread), or NULL
+ * outside of them */
+void * kz_userdata(void);
+
+/* decode bytes which have been received by other means than the rx callback, and handle any
+ * frames they complete */
+void kz_receive(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size);
+
+/* handle a whole frame received by a datagram endpoint (e.g. one datagram), which is read in place
+ * rather than copied to the receive buffer, and is only used until this returns */
+void kz_receiveframe(kz_endpoint_t * K, kz_byte_t * frame, kz_size_t size);
+
 int kz_call(kz_endpoint_t * K, unsigned int channelid,
             kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks);
 
+/* kz_call() with any of the following flags */
+int kz_callf(kz_endpoint_t * K, unsigned int channelid,
+             kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks,
+             unsigned int flags);
+
+/* send the request with the given priority, rather than that of its channel */
+#define KZ_CALL_PRIORITY(p)      (((p) + 1) & KZ_CALL_PRIORITY_MASK)
+#define KZ_CALL_PRIORITY_MASK    0x07
+
+/* the request may safely be handled more than once, so if its reply is late it is sent again, up to
+ * KZ_MAX_RETRANSMITS times, waiting twice as long each time. Requires a queue buffer, which keeps
+ * a copy of the request until it is answered. Also, if an identical call (same channel and
+ * arguments) is already waiting for its reply, no request is made and both share that reply. */
+#define KZ_CALL_IDEMPOTENT       0x08
+
+/* make the request even if the reply is cached, and cache the new reply (see kz_cache()) */
+#define KZ_CALL_NOCACHE          0x10
+
+/* kz_callf() which copies context_size bytes of context (at most KZ_CALL_CONTEXT_SIZE) into the
+ * call itself, so that nothing need be allocated to tell one call from another. The reply
+ * handler's userdata points to that copy, which it may use until it returns. */
+int kz_callcopy(kz_endpoint_t * K, unsigned int channelid,
+                kz_reply_handler_fn_t fn, const void * context, kz_size_t context_size,
+                int timeout_ticks, unsigned int flags);
+
 void kz_send(kz_endpoint_t * K, unsigned int channelid);
 
+/* a call with this timeout waits for its reply indefinitely. Calls with a timeout beyond
+ * KZ_MAX_TICKS fail, as do routes, subscriptions and cached channels given one, and subscriptions
+ * given such a period. */
+#define KZ_NO_TIMEOUT (-1)
+
+/* subscribe to a channel of the peer, whose results are then pushed with the given mode and period
+ * (in the peer's ticks, at most KZ_MAX_TICKS). The reply handler is called with KZ_MORE for each update, and with a final
+ * status once the subscription has ended. Its timeout starts over with each update.
+ * Returns a subscription id, or -1 on failure. */
+int kz_subscribe(kz_endpoint_t * K, unsigned int channelid, unsigned int mode, unsigned int period_ticks,
+                 kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks);
+
+/* end a subscription, the reply handler is called a final time when the peer confirms */
+int kz_unsubscribe(kz_endpoint_t * K, int subscription, int timeout_ticks);
+
+/* set the priority of requests made on, and replies sent for, the given channel (0 is highest) */
+int kz_priority(kz_endpoint_t * K, unsigned int channelid, unsigned int priority);
+
+/* keep successful replies to calls on the given channel for ttl_ticks (0 to not cache). Until it
+ * expires, a call with the same arguments is answered from the cache: its reply handler is called
+ * before kz_call() returns, and no request is made. Replies which are already cached are dropped. */
+int kz_cache(kz_endpoint_t * K, unsigned int channelid, int ttl_ticks);
+
+/* forward the peer's requests on count channels starting at first_channel to the peer of the
+ * downstream endpoint, on the channels starting at downstream_channel, rather than handling them.
+ * Each frame is copied from the receive buffer into the downstream transmit buffer as it is, with
+ * only its reqid and channel rewritten, and the replies (and reply parts) are relayed back the same
+ * way as they arrive. A forwarded request takes one of the downstream endpoint's local request
+ * objects for up to timeout_ticks; if none is free, it is answered with KZ_BUSY. A forwarded
+ * request which times out (or is answered with KZ_IGNORE) isn't answered, the caller's own
+ * timeout ends it. Batches and subscriptions aren't forwarded.
+ * Nothing is forwarded into a frame being built on either endpoint (e.g. by an interrupt which
+ * receives while the main loop places a call's arguments): such a request is answered with
+ * KZ_BUSY, and such a reply is lost, as if on the line.
+ * A NULL downstream endpoint removes the route starting at first_channel. Returns 1 on success,
+ * 0 if there is no room for another route. */
+int kz_route(kz_endpoint_t * K, unsigned int first_channel, unsigned int count,
+             kz_endpoint_t * downstream, unsigned int downstream_channel, int timeout_ticks);
+
+/* Transmit buffers:
+ *
+ * A transport which sends in the background (e.g. by DMA) sets tx_async, and calls kz_txdone()
+ * once it is done with each frame it was given. Until then the next frame is built in another of
+ * the buffers the transmit buffer is split into. A frame is only given to the transport if that
+ * leaves a buffer which is neither held nor set aside; otherwise it is queued as one over tx_budget
+ * is, and sent with the next frame or on the next tick, once a buffer has been released. Only if
+ * the queue is full is a request refused, or a reply dropped (and counted in tx_dropped). Credit is
+ * sent on a later tick.
+ *
+ * A request handler which makes a call sets its reply aside first:
+ *
+ * kz_putint(K, 1);            (part of the reply)
+ * kz_putaside(K);
+ * kz_putint(K, 42);           (the call's arguments)
+ * kz_call(K, 3, fn, NULL, 10);
+ * kz_putint(K, 2);            (more of the reply)
+ *
+ * A frame set aside holds a buffer of its own, so an asynchronous transport needs three for the
+ * call to go out at once.
+ */
+
+/* release a frame given to an asynchronous tx callback, by the bytes it was given (may be called
+ * from an interrupt) */
+void kz_txdone(kz_endpoint_t * K, const kz_byte_t * bytes);
+
+/* set the frame being built aside, and build the next one in another transmit buffer. The frame
+ * is resumed by the next kz_callf(), kz_callcopy(), kz_send() or kz_batchcall(), whether or not
+ * the call could be made, by kz_putrestore(), or once the request handler returns. Returns 0 if
+ * there is only one transmit buffer, a frame is already set aside, or no other buffer is free. */
+int kz_putaside(kz_endpoint_t * K);
+
+/* go back to the frame set aside, if any, discarding what has been built since */
+void kz_putrestore(kz_endpoint_t * K);
+
+/* Batches: several calls made using a single request and reply
+ *
+ * kz_batchbegin(K);
+ * kz_batchadd(K, 1);
+ * kz_batchadd(K, 2);
+ * kz_putint(K, 42);
+ * kz_batchcall(K, fn, userdata, timeout_ticks);
+ *
+ * The reply handler is then called once, and reads each call's status and results in order
+ * using kz_getbatchentry(). Handlers can't defer their replies when called as part of a batch.
+ */
+void kz_batchbegin(kz_endpoint_t * K);
+/* begin the next call in the batch, its arguments are placed using kz_put*() */
+int  kz_batchadd(kz_endpoint_t * K, unsigned int channelid);
+/* send the batch */
+int  kz_batchcall(kz_endpoint_t * K, kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks);
+
+/* Fan-out: the same call made to several peers at once, with one completion
+ *
+ * kz_endpoint_t * devices[3] = { &A, &B, &C };
+ * kz_fanout_t F;
+ *
+ * kz_fanoutinit(&F, devices, 3, fn, done, userdata);
+ * kz_putint(&A, 42);
+ * kz_fanoutcall(&F, 1, timeout_ticks);
+ *
+ * The arguments are placed once, using the first endpoint, and copied to the others. The reply
+ * handler (which may be NULL) is called with each endpoint's reply as it arrives, and done is
+ * called once every one of them has replied or timed out, with the totals in F. On a multi-drop
+ * bus, the controller's endpoints each send their own request, so that the nodes' replies don't
+ * collide. An endpoint (other than the first) with a frame of its own being built isn't called,
+ * and is counted as failed. F must be kept until done has been called.
+ */
+struct kz_fanout;
+
+typedef void (* kz_fanout_done_fn_t)(struct kz_fanout * F, void * userdata);
+
+typedef struct kz_fanout {
+  kz_endpoint_t ** endpoints;
+  unsigned int count;
+  kz_reply_handler_fn_t reply;
+  kz_fanout_done_fn_t done;
+  void * userdata;
+  unsigned int pending;   /* # of replies still expected */
+  unsigned int replied;   /* # of endpoints which replied with KZ_OK */
+  unsigned int failed;    /* # which replied otherwise, timed out, or couldn't make the call */
+  char calling;           /* nonzero while kz_fanoutcall() is making the calls */
+} kz_fanout_t;
+
+void kz_fanoutinit(kz_fanout_t * F, kz_endpoint_t ** endpoints, unsigned int count,
+                   kz_reply_handler_fn_t fn, kz_fanout_done_fn_t done, void * userdata);
+/* make the call on every endpoint. Returns the # of calls made, 0 if none could be (in which case
+ * done isn't called), or if the previous fan-out through F hasn't completed yet. */
+int  kz_fanoutcall(kz_fanout_t * F, unsigned int channelid, int timeout_ticks);
+
+/* reserve a slot to reply to the request currently being handled at a later time
+ * (only valid from within a request handler, which must then return KZ_DEFER) */
+kz_request_t * kz_defer(kz_endpoint_t * K);
+
+/* send the contents of the put buffer as the reply to a deferred request */
+void kz_reply(kz_endpoint_t * K, kz_request_t * req, kz_request_status_t status);
+
+/* send the contents of the put buffer as one part of a streamed reply to a deferred request,
+ * which is ended by kz_reply() (or by returning from the handler, if still handling it) */
+void kz_replypart(kz_endpoint_t * K, kz_request_t * req);
+
+/* start a task, which is first stepped during this or the next kz_tick() */
+kz_task_t * kz_spawn(kz_endpoint_t * K, kz_task_fn_t fn, void * userdata);
+
+/* Stackless coroutine helpers for task bodies. Local variables do not persist
+ * across waits, use T->locals or T->userdata instead.
+ *
+ * kz_task_status_t my_task(kz_endpoint_t * K, kz_task_t * T) {
+ *   KZ_TASK_BEGIN(T);
+ *   ...
+ *   KZ_TASK_SLEEP(T, 10);
+ *   ...
+ *   KZ_TASK_END(T);
+ * }
+ */
+#define KZ_TASK_BEGIN(T)  switch((T)->resume) { case 0:
+
+#define KZ_TASK_END(T)    } (T)->resume = 0; return KZ_TASK_DONE
+
+/* resume after the given number of ticks (at most KZ_MAX_TICKS) */
+#define KZ_TASK_SLEEP(T, ticks) \
+  do { \
+    (T)->resume = __LINE__; \
+    (T)->wait_ticks = KZ_CLAMP_TICKS(ticks); \
+    (T)->wait_frame = 0; \
+    return KZ_TASK_WAITING; \
+    case __LINE__:; \
+  } while(0)
+
+/* resume when a frame arrives, or after the given number of ticks (at most KZ_MAX_TICKS, forever
+ * if negative) */
+#define KZ_TASK_WAIT_FRAME(T, ticks) \
+  do { \
+    (T)->resume = __LINE__; \
+    (T)->wait_ticks = KZ_CLAMP_TICKS(ticks); \
+    (T)->wait_frame = 1; \
+    return KZ_TASK_WAITING; \
+    case __LINE__:; \
+  } while(0)
+
+/* resume during the next tick */
+#define KZ_TASK_YIELD(T) KZ_TASK_SLEEP(T, 1)
+
 /* receive data from the rx buffer */
 int  kz_getint(kz_endpoint_t * K, kz_int_t * i);
 int  kz_getfloat(kz_endpoint_t * K, kz_float_t * f);
 int  kz_getnumber(kz_endpoint_t * K, kz_float_t * f);
+/* advance to the status and results of the next call in a batch reply */
+int  kz_getbatchentry(kz_endpoint_t * K, kz_request_status_t * status);
 void kz_getreset(kz_endpoint_t * K);
+/* decode the given bytes, rather than those received, e.g. results kept from an earlier reply */
+void kz_getraw(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size);
+/* bytes which may be decoded, in their encoded form */
+const kz_byte_t * kz_getdata(kz_endpoint_t * K, kz_size_t * size);
 
 /* place data in the put buffer */
 int  kz_putint(kz_endpoint_t * K, kz_int_t i);
@@ -144,6 +648,10 @@ int  kz_putstring(kz_endpoint_t * K, const kz_string_t * v);
 int  kz_putlistopen(kz_endpoint_t * K);
 int  kz_putlistclose(kz_endpoint_t * K);
 int  kz_putnil(kz_endpoint_t * K);
+/* place data which has already been encoded, e.g. by another endpoint */
+int  kz_putraw(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size);
+/* contents of the put buffer, in their encoded form */
+const kz_byte_t * kz_putdata(kz_endpoint_t * K, kz_size_t * size);
 /* clear put buffer */
 void kz_putclear(kz_endpoint_t * K);
 
@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "kinzhal_mt.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* Calls:
+ *
+ * The call queue is a bounded MPSC queue in which every slot carries a sequence number. A client
+ * claims position p by advancing calls_head with a compare-and-swap, once the slot's sequence
+ * reads p. It fills the slot, and publishes it by setting the sequence to p + 1. The I/O thread
+ * takes the slot once its sequence reads p + 1, and frees it for position p + KZ_MT_MAX_CALLS.
+ * Clients only contend on calls_head, and never wait for each other.
+ *
+ * Before waiting, the I/O thread sets `sleeping` and looks at the queue once more. A client which
+ * finds `sleeping` set after publishing a call clears it and writes to the eventfd, so that the
+ * kernel is only involved when the I/O thread actually needs waking.
+ */
+
+/* Completions:
+ *
+ * Each client's completions form an SPSC ring. `reserved` counts the completions in the ring, plus
+ * a slot held for the final reply of every call which hasn't queued one yet, and never exceeds the
+ * ring's size. A call takes its slot when it is made, and is refused if there is none, so there is
+ * always room for a final reply. A part of a streamed reply takes a slot as it is queued, and is
+ * dropped and counted if there is none. The client gives each slot back once it has taken the
+ * completion out of the ring. Both sides only change `reserved` with atomic read-modify-writes, so
+ * neither can take a slot the other has just taken.
+ */
+
+static void null_tx(const kz_byte_t * bytes, size_t size) {
+}
+
+static void fd_tx(const kz_byte_t * bytes, size_t size) {
+  kz_mt_endpoint_t * M = kz_userdata();
+  struct pollfd pfd;
+  ssize_t ret;
+
+  if(atomic_load_explicit(&M->closed, memory_order_relaxed)) {
+    /* nobody to send it to */
+    return;
+  }
+
+  while(size > 0) {
+    ret = write(M->fd, bytes, size);
+
+    if(ret > 0) {
+      bytes += ret;
+      size -= ret;
+    } else if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* transmission is blocking, wait for room */
+      pfd.fd = M->fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+    } else if(ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      /* nothing more can be done, the frame is lost */
+      return;
+    }
+  }
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* Queues a completion for the client, returns 0 if a reply part had to be dropped */
+static int complete(kz_mt_client_t * C, kz_reply_handler_fn_t fn, void * userdata, kz_request_status_t status, const kz_byte_t * results, kz_size_t results_size) {
+  const size_t head = atomic_load_explicit(&C->completions_head, memory_order_relaxed);
+
+  kz_mt_completion_t * completion;
+
+  if(status == KZ_MORE &&
+     atomic_fetch_add_explicit(&C->reserved, 1, memory_order_acq_rel) >= KZ_MT_MAX_COMPLETIONS) {
+    /* the remaining slots are held for final replies */
+    atomic_fetch_sub_explicit(&C->reserved, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&C->dropped, 1, memory_order_relaxed);
+    return 0;
+  }
+
+  /* a final reply uses the slot its call took */
+
+  completion = C->completions + head % KZ_MT_MAX_COMPLETIONS;
+
+  completion->fn           = fn;
+  completion->userdata     = userdata;
+  completion->status       = status;
+  completion->results_size = results_size;
+  if(results_size) {
+    memcpy(completion->results, results, results_size);
+  }
+
+  atomic_store_explicit(&C->completions_head, head + 1, memory_order_release);
+
+  return 1;
+}
+
+/* Reply handler of calls made by the I/O thread, passes the reply on to the client */
+static void forward_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_mt_pending_t * pending = userdata;
+  const kz_byte_t * results;
+  kz_size_t results_size;
+
+  results = kz_getdata(K, &results_size);
+
+  complete(pending->client, pending->fn, pending->userdata, status, results, results_size);
+
+  if(status != KZ_MORE) {
+    pending->client = NULL;
+  }
+}
+
+static kz_mt_pending_t * alloc_pending(kz_mt_endpoint_t * M) {
+  const unsigned int max_pending = sizeof(M->pending)/sizeof(M->pending[0]);
+
+  unsigned int i;
+
+  for(i = 0 ; i < max_pending ; i ++) {
+    if(!M->pending[i].client) {
+      return M->pending + i;
+    }
+  }
+
+  return NULL;
+}
+
+/* Takes the next call from the queue, if any, and makes it. Returns 1 if one was taken, 0 if
+ * there was none, or if it has to wait for an earlier call to finish. */
+static int take_call(kz_mt_endpoint_t * M) {
+  kz_mt_call_t * const call = M->calls + M->calls_tail % KZ_MT_MAX_CALLS;
+  kz_endpoint_t * const K = &M->endpoint;
+
+  kz_mt_pending_t * pending;
+
+  if(atomic_load_explicit(&call->sequence, memory_order_seq_cst) != M->calls_tail + 1) {
+    /* not published yet */
+    return 0;
+  }
+
+  pending = alloc_pending(M);
+
+  if(!pending) {
+    /* leave it queued until a reply frees a local request */
+    return 0;
+  }
+
+  pending->client   = call->client;
+  pending->fn       = call->fn;
+  pending->userdata = call->userdata;
+
+  kz_putclear(K);
+  kz_putraw(K, call->args, call->args_size);
+
+  if(!kz_callf(K, call->channelid, forward_reply, pending, call->timeout_ticks, call->flags)) {
+    /* the peer can't take this one */
+    pending->client = NULL;
+
+    complete(call->client, call->fn, call->userdata, KZ_BUSY, NULL, 0);
+  }
+
+  /* this slot may be used again on the next lap */
+  atomic_store_explicit(&call->sequence, M->calls_tail + KZ_MT_MAX_CALLS, memory_order_release);
+  M->calls_tail ++;
+
+  return 1;
+}
+
+static void * io_thread(void * arg) {
+  kz_mt_endpoint_t * M = arg;
+  kz_endpoint_t * const K = &M->endpoint;
+
+  kz_byte_t bytes[KZ_MAX_BUFFER_SIZE];
+  struct pollfd pfds[2];
+  uint64_t wakes;
+  long next_tick;
+  long wait_ms;
+  ssize_t ret;
+
+  next_tick = now_ms() + M->tick_ms;
+
+  pfds[0].fd     = M->fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd     = M->wake_fd;
+  pfds[1].events = POLLIN;
+
+  while(atomic_load_explicit(&M->running, memory_order_acquire)) {
+    /* make every call which has been submitted */
+    while(take_call(M));
+
+    wait_ms = next_tick - now_ms();
+
+    if(wait_ms > 0) {
+      atomic_store_explicit(&M->sleeping, 1, memory_order_seq_cst);
+
+      /* a call may have been published before we said we'd sleep */
+      if(take_call(M)) {
+        atomic_store_explicit(&M->sleeping, 0, memory_order_relaxed);
+        continue;
+      }
+
+      ret = poll(pfds, 2, wait_ms);
+
+      atomic_store_explicit(&M->sleeping, 0, memory_order_relaxed);
+
+      if(ret > 0 && (pfds[1].revents & POLLIN)) {
+        if(read(M->wake_fd, &wakes, sizeof(wakes)) < 0) {
+          /* nothing to do, it will be read next time */
+        }
+      }
+
+      if(ret > 0 && (pfds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+        ret = read(M->fd, bytes, sizeof(bytes));
+
+        if(ret > 0) {
+          kz_receive(K, bytes, ret);
+        } else if(ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+          /* the peer has gone, and the descriptor would be readable from now on: stop watching it,
+           * and keep ticking so that the calls still waiting time out */
+          atomic_store_explicit(&M->closed, 1, memory_order_release);
+          pfds[0].fd = -1;
+        }
+      }
+    }
+
+    if(now_ms() >= next_tick) {
+      /* timeouts, flow control, tasks */
+      kz_tick(K);
+
+      next_tick += M->tick_ms;
+    }
+  }
+
+  return NULL;
+}
+
+int kz_mt_init(kz_mt_endpoint_t * M, int fd, int tick_ms) {
+  size_t i;
+
+  if(tick_ms <= 0) {
+    return 0;
+  }
+
+  M->fd      = fd;
+  M->tick_ms = tick_ms;
+  M->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if(M->wake_fd < 0) {
+    return 0;
+  }
+
+  atomic_init(&M->running, 0);
+  atomic_init(&M->sleeping, 0);
+  atomic_init(&M->closed, 0);
+
+  for(i = 0 ; i < KZ_MT_MAX_CALLS ; i ++) {
+    atomic_init(&M->calls[i].sequence, i);
+  }
+  atomic_init(&M->calls_head, 0);
+  M->calls_tail = 0;
+
+  memset(M->pending, 0, sizeof(M->pending));
+
+  M->def.rx_buffer      = M->rx_buffer;
+  M->def.rx_buffer_size = sizeof(M->rx_buffer);
+  M->def.tx_buffer      = M->tx_buffer;
+  M->def.tx_buffer_size = sizeof(M->tx_buffer);
+  M->def.channels            = M->channels;
+  M->def.channel_count       = KZ_MAX_CHANNELS;
+  M->def.local_requests      = M->local_requests;
+  M->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  M->def.rx_window         = 0;
+  M->def.tx_budget         = 0;
+  M->def.queue_buffer      = NULL;
+  M->def.queue_buffer_size = 0;
+  M->def.retransmit_ticks  = 0;
+  M->def.datagram          = 0;
+  M->def.address           = 0;
+  M->def.tx_enable         = NULL;
+  M->def.tx_buffer_count   = 0;
+  M->def.tx_async          = 0;
+  /* bytes are read in bulk by the I/O thread */
+  M->def.rx       = NULL;
+  M->def.tx       = fd_tx;
+  M->def.userdata = M;
+
+  kz_init_static(&M->endpoint, &M->def);
+
+  return 1;
+}
+
+int kz_mt_start(kz_mt_endpoint_t * M) {
+  atomic_store(&M->running, 1);
+
+  if(pthread_create(&M->thread, NULL, io_thread, M) != 0) {
+    atomic_store(&M->running, 0);
+    return 0;
+  }
+
+  return 1;
+}
+
+void kz_mt_stop(kz_mt_endpoint_t * M) {
+  const uint64_t wake = 1;
+
+  atomic_store(&M->running, 0);
+
+  if(write(M->wake_fd, &wake, sizeof(wake)) < 0) {
+    /* it will notice by its next tick */
+  }
+
+  pthread_join(M->thread, NULL);
+
+  close(M->wake_fd);
+}
+
+void kz_mt_client_init(kz_mt_client_t * C, kz_mt_endpoint_t * M) {
+  C->M = M;
+
+  C->codec_def.rx_buffer      = C->codec_rx_buffer;
+  C->codec_def.rx_buffer_size = sizeof(C->codec_rx_buffer);
+  C->codec_def.tx_buffer      = C->codec_tx_buffer;
+  C->codec_def.tx_buffer_size = sizeof(C->codec_tx_buffer);
+  /* only encodes and decodes, so it needs no tables */
+  C->codec_def.channels            = NULL;
+  C->codec_def.channel_count       = 0;
+  C->codec_def.local_requests      = NULL;
+  C->codec_def.local_request_count = 0;
+  C->codec_def.rx_window         = 0;
+  C->codec_def.tx_budget         = 0;
+  C->codec_def.queue_buffer      = NULL;
+  C->codec_def.queue_buffer_size = 0;
+  C->codec_def.retransmit_ticks  = 0;
+  C->codec_def.datagram          = 0;
+  C->codec_def.address           = 0;
+  C->codec_def.tx_enable         = NULL;
+  C->codec_def.tx_buffer_count   = 0;
+  C->codec_def.tx_async          = 0;
+  /* never connected to anything */
+  C->codec_def.rx       = NULL;
+  C->codec_def.tx       = null_tx;
+  C->codec_def.userdata = C;
+
+  kz_init_static(&C->codec, &C->codec_def);
+
+  atomic_init(&C->completions_head, 0);
+  atomic_init(&C->completions_tail, 0);
+  atomic_init(&C->in_flight, 0);
+  atomic_init(&C->reserved, 0);
+  atomic_init(&C->dropped, 0);
+}
+
+kz_endpoint_t * kz_mt_args(kz_mt_client_t * C) {
+  return &C->codec;
+}
+
+int kz_mt_call(kz_mt_client_t * C, unsigned int channelid, kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks, unsigned int flags) {
+  kz_mt_endpoint_t * const M = C->M;
+
+  kz_mt_call_t * call;
+  const kz_byte_t * args;
+  kz_size_t args_size;
+  size_t pos;
+  size_t sequence;
+
+  if(atomic_fetch_add_explicit(&C->reserved, 1, memory_order_acq_rel) >= KZ_MT_MAX_COMPLETIONS) {
+    /* no room for the reply, what with the replies and parts already waiting */
+    atomic_fetch_sub_explicit(&C->reserved, 1, memory_order_relaxed);
+    kz_putclear(&C->codec);
+    return 0;
+  }
+
+  /* claim a position */
+  pos = atomic_load_explicit(&M->calls_head, memory_order_relaxed);
+
+  for(;;) {
+    call = M->calls + pos % KZ_MT_MAX_CALLS;
+    sequence = atomic_load_explicit(&call->sequence, memory_order_acquire);
+
+    if(sequence == pos) {
+      if(atomic_compare_exchange_weak_explicit(&M->calls_head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+      /* pos has been reloaded */
+    } else if((ptrdiff_t)(sequence - pos) < 0) {
+      /* queue is full */
+      atomic_fetch_sub_explicit(&C->reserved, 1, memory_order_relaxed);
+      kz_putclear(&C->codec);
+      return 0;
+    } else {
+      /* another client got here first */
+      pos = atomic_load_explicit(&M->calls_head, memory_order_relaxed);
+    }
+  }
+
+  args = kz_putdata(&C->codec, &args_size);
+
+  call->client        = C;
+  call->fn            = fn;
+  call->userdata      = userdata;
+  call->timeout_ticks = timeout_ticks;
+  call->flags         = flags;
+  call->channelid     = channelid;
+  call->args_size     = args_size;
+  memcpy(call->args, args, args_size);
+
+  kz_putclear(&C->codec);
+
+  atomic_fetch_add_explicit(&C->in_flight, 1, memory_order_relaxed);
+
+  /* publish */
+  atomic_store_explicit(&call->sequence, pos + 1, memory_order_seq_cst);
+
+  if(atomic_exchange_explicit(&M->sleeping, 0, memory_order_seq_cst)) {
+    const uint64_t wake = 1;
+
+    if(write(M->wake_fd, &wake, sizeof(wake)) < 0) {
+      /* it will notice by its next tick */
+    }
+  }
+
+  return 1;
+}
+
+int kz_mt_poll(kz_mt_client_t * C) {
+  kz_mt_completion_t * completion;
+  size_t tail;
+  int count = 0;
+
+  tail = atomic_load_explicit(&C->completions_tail, memory_order_relaxed);
+
+  while(tail != atomic_load_explicit(&C->completions_head, memory_order_acquire)) {
+    completion = C->completions + tail % KZ_MT_MAX_COMPLETIONS;
+
+    kz_getraw(&C->codec, completion->results, completion->results_size);
+
+    completion->fn(&C->codec, completion->userdata, completion->status);
+
+    if(completion->status != KZ_MORE) {
+      atomic_fetch_sub_explicit(&C->in_flight, 1, memory_order_relaxed);
+    }
+
+    tail ++;
+    atomic_store_explicit(&C->completions_tail, tail, memory_order_release);
+
+    /* only once it is free may the slot be taken again */
+    atomic_fetch_sub_explicit(&C->reserved, 1, memory_order_release);
+
+    count ++;
+  }
+
+  return count;
+}
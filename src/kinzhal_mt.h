@@ -0,0 +1,139 @@
+#ifndef KINZHAL_MT_H
+#define KINZHAL_MT_H
+
+/* Host-side endpoint shared by many threads (requires C11 atomics and POSIX threads)
+ *
+ * One I/O thread owns the file descriptor and the kz_endpoint_t which speaks to it. Application
+ * threads each own a client, which encodes a call's arguments, submits the call to the I/O thread
+ * through a lock-free queue shared by all clients, and receives the reply through a lock-free
+ * queue of its own. Reply handlers are called on the client's thread, from kz_mt_poll().
+ *
+ * kz_mt_endpoint_t M;
+ * kz_mt_client_t C;
+ *
+ * kz_mt_init(&M, fd, 10);
+ * kz_mt_start(&M);
+ *
+ * kz_mt_client_init(&C, &M);            (on each application thread)
+ * kz_putint(kz_mt_args(&C), 42);
+ * kz_mt_call(&C, 1, fn, userdata, 100, 0);
+ * ...
+ * kz_mt_poll(&C);                       (calls fn)
+ *
+ * kz_mt_stop(&M);
+ */
+
+#include "kinzhal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+/* begin configuration */
+
+#define KZ_MT_MAX_CALLS        64  /* calls waiting for the I/O thread, a power of two */
+#define KZ_MT_MAX_COMPLETIONS  16  /* replies waiting for each client, a power of two */
+
+/* end configuration */
+
+
+/* a call on its way to the I/O thread */
+typedef struct kz_mt_call {
+  atomic_size_t sequence;       /* position in the queue at which this slot may next be used */
+  struct kz_mt_client * client;
+  kz_reply_handler_fn_t fn;
+  void * userdata;
+  int timeout_ticks;
+  unsigned int flags;
+  unsigned int channelid;
+  kz_size_t args_size;
+  kz_byte_t args[KZ_MAX_BUFFER_SIZE];
+} kz_mt_call_t;
+
+/* a reply, or a part of one, on its way to a client */
+typedef struct kz_mt_completion {
+  kz_reply_handler_fn_t fn;
+  void * userdata;
+  kz_request_status_t status;
+  kz_size_t results_size;
+  kz_byte_t results[KZ_MAX_BUFFER_SIZE];
+} kz_mt_completion_t;
+
+/* a call made by the I/O thread on behalf of a client */
+typedef struct kz_mt_pending {
+  struct kz_mt_client * client;
+  kz_reply_handler_fn_t fn;
+  void * userdata;
+} kz_mt_pending_t;
+
+typedef struct kz_mt_endpoint {
+  /* owned by the I/O thread once started */
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+  kz_mt_pending_t pending[KZ_MAX_LOCAL_REQUESTS];
+
+  int fd;          /* serial port, or anything else which carries frames */
+  int wake_fd;     /* eventfd which wakes the I/O thread if it is waiting */
+  int tick_ms;     /* interval between calls to kz_tick() */
+
+  pthread_t thread;
+  atomic_int running;
+  atomic_int sleeping;  /* nonzero while the I/O thread may be waiting in poll() */
+  atomic_int closed;    /* nonzero once fd has reached its end or failed, and is no longer used */
+
+  /* bounded MPSC queue of calls, see kz_mt_call() */
+  kz_mt_call_t calls[KZ_MT_MAX_CALLS];
+  atomic_size_t calls_head;  /* next position to be claimed by a client */
+  size_t calls_tail;         /* next position to be taken by the I/O thread */
+} kz_mt_endpoint_t;
+
+typedef struct kz_mt_client {
+  kz_mt_endpoint_t * M;
+
+  /* encodes arguments and decodes results on the client's thread */
+  kz_endpoint_t codec;
+  kz_endpointdef_t codec_def;
+  kz_byte_t codec_rx_buffer[KZ_MIN_BUFFER_SIZE];
+  kz_byte_t codec_tx_buffer[KZ_MAX_BUFFER_SIZE];
+
+  /* SPSC queue of completions, filled by the I/O thread */
+  kz_mt_completion_t completions[KZ_MT_MAX_COMPLETIONS];
+  atomic_size_t completions_head;  /* written by the I/O thread */
+  atomic_size_t completions_tail;  /* written by the client */
+
+  atomic_uint in_flight;  /* # of calls made whose final reply hasn't been taken */
+  atomic_uint reserved;   /* # of completions queued, plus a slot for each call not yet answered */
+  atomic_uint dropped;    /* # of reply parts discarded for lack of room */
+} kz_mt_client_t;
+
+
+/* prepare an endpoint which speaks over the given descriptor, ticking every tick_ms. Handlers
+ * for requests made by the peer may then be set on M->endpoint, and are called on the I/O thread.
+ * Once the descriptor reaches its end or fails, it is set closed and left alone, and calls time
+ * out. Returns 1 on success, 0 on failure. */
+int  kz_mt_init(kz_mt_endpoint_t * M, int fd, int tick_ms);
+/* start the I/O thread, returns 1 on success, 0 on failure */
+int  kz_mt_start(kz_mt_endpoint_t * M);
+/* stop the I/O thread, and wait for it to finish */
+void kz_mt_stop(kz_mt_endpoint_t * M);
+
+void kz_mt_client_init(kz_mt_client_t * C, kz_mt_endpoint_t * M);
+
+/* the endpoint with which a client places its arguments (see kz_put*()) */
+kz_endpoint_t * kz_mt_args(kz_mt_client_t * C);
+
+/* kz_callf() on behalf of the client. The reply handler is called from kz_mt_poll(), with an
+ * endpoint from which the results may be read. Fails if the queue is full, or if the client's
+ * completions, together with a final reply for each of its calls in flight, would fill its ring. */
+int  kz_mt_call(kz_mt_client_t * C, unsigned int channelid,
+                kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks,
+                unsigned int flags);
+
+/* call the reply handlers of completed calls, returns the # called */
+int  kz_mt_poll(kz_mt_client_t * C);
+
+#endif
@@ -0,0 +1,139 @@
+
+#include "kinzhal_pipe.h"
+
+#include <string.h>
+
+/* Each end's bytes are kept from `begin` to `end`, and are moved back to the start of the buffer
+ * when a frame wouldn't otherwise fit. kz_pipe_pump() hands the endpoint the waiting bytes in place,
+ * so while it does, frames sent towards the same end are only appended, never moved.
+ *
+ * Frames sent towards a datagram endpoint are each preceded by their size, in two bytes, so that
+ * they can be received whole. */
+
+#define KZ_PIPE_FRAME_HEADER  2
+
+static void pipe_tx(const kz_byte_t * bytes, size_t size) {
+  kz_pipe_end_t * E = ((kz_pipe_end_t *)kz_userdata())->peer;
+
+  const kz_size_t header_size = E->datagram ? KZ_PIPE_FRAME_HEADER : 0;
+
+  if(E->end + header_size + size > sizeof(E->bytes) && !E->delivering) {
+    memmove(E->bytes, E->bytes + E->begin, E->end - E->begin);
+    E->end  -= E->begin;
+    E->begin = 0;
+  }
+
+  if(E->end + header_size + size > sizeof(E->bytes)) {
+    E->frames_dropped ++;
+    return;
+  }
+
+  if(header_size) {
+    E->bytes[E->end ++] = size & 0xFF;
+    E->bytes[E->end ++] = size >> 8;
+  }
+
+  memcpy(E->bytes + E->end, bytes, size);
+  E->end += size;
+
+  E->frames ++;
+  E->bytes_sent += size;
+}
+
+static int pipe_rx(kz_byte_t * byte) {
+  kz_pipe_end_t * E = kz_userdata();
+
+  if(E->begin == E->end) {
+    return 0;
+  }
+
+  *byte = E->bytes[E->begin ++];
+
+  return 1;
+}
+
+static void end_init(kz_pipe_end_t * E, kz_pipe_end_t * peer, kz_endpoint_t * K, const kz_endpointdef_t * def) {
+  E->endpoint   = K;
+  E->peer       = peer;
+  E->datagram   = def->datagram;
+  E->begin      = 0;
+  E->end        = 0;
+  E->delivering = 0;
+
+  E->frames         = 0;
+  E->bytes_sent     = 0;
+  E->frames_dropped = 0;
+}
+
+/* returns the # of bytes delivered */
+static kz_size_t deliver(kz_pipe_end_t * E) {
+  const kz_size_t begin = E->begin;
+  const kz_size_t end   = E->end;
+
+  kz_size_t pos;
+  kz_size_t size;
+
+  if(begin == end) {
+    return 0;
+  }
+
+  E->begin = end;
+  E->delivering = 1;
+
+  if(E->datagram) {
+    for(pos = begin ; pos < end ; pos += KZ_PIPE_FRAME_HEADER + size) {
+      size = E->bytes[pos] | (E->bytes[pos + 1] << 8);
+      kz_receiveframe(E->endpoint, E->bytes + pos + KZ_PIPE_FRAME_HEADER, size);
+    }
+  } else {
+    kz_receive(E->endpoint, E->bytes + begin, end - begin);
+  }
+
+  E->delivering = 0;
+
+  if(E->begin == E->end) {
+    E->begin = 0;
+    E->end   = 0;
+  }
+
+  return end - begin;
+}
+
+void kz_pipe_connect(kz_pipe_t * P,
+                     kz_endpoint_t * A, kz_endpointdef_t * A_def,
+                     kz_endpoint_t * B, kz_endpointdef_t * B_def) {
+  end_init(P->ends + 0, P->ends + 1, A, A_def);
+  end_init(P->ends + 1, P->ends + 0, B, B_def);
+
+  A_def->rx       = A_def->datagram ? NULL : pipe_rx;
+  A_def->tx       = pipe_tx;
+  A_def->userdata = P->ends + 0;
+
+  B_def->rx       = B_def->datagram ? NULL : pipe_rx;
+  B_def->tx       = pipe_tx;
+  B_def->userdata = P->ends + 1;
+
+  /* both ends are ready before either transmits */
+  kz_init_static(A, A_def);
+  kz_init_static(B, B_def);
+}
+
+kz_size_t kz_pipe_pump(kz_pipe_t * P) {
+  kz_size_t total = 0;
+  kz_size_t delivered;
+
+  do {
+    delivered  = deliver(P->ends + 0);
+    delivered += deliver(P->ends + 1);
+
+    total += delivered;
+  } while(delivered);
+
+  return total;
+}
+
+kz_size_t kz_pipe_waiting(const kz_pipe_t * P, const kz_endpoint_t * K) {
+  const kz_pipe_end_t * E = P->ends[0].endpoint == K ? P->ends + 0 : P->ends + 1;
+
+  return E->end - E->begin;
+}
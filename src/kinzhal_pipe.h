@@ -0,0 +1,68 @@
+#ifndef KINZHAL_PIPE_H
+#define KINZHAL_PIPE_H
+
+/* In-memory duplex pipe between two endpoints
+ *
+ * Each endpoint transmits into a buffer which its peer receives from, so that frames are encoded,
+ * framed, decoded and handled just as they would be over a serial line, without a device or any
+ * system calls. Useful for tests, and for measuring the library on its own.
+ *
+ * kz_pipe_t P;
+ *
+ * (set the buffers and options of A_def and B_def)
+ * kz_pipe_connect(&P, &A, &A_def, &B, &B_def);
+ *
+ * kz_putint(&A, 42);
+ * kz_call(&A, 1, fn, userdata, 100);
+ * kz_pipe_pump(&P);                     (B handles the request, A the reply, fn is called)
+ *
+ * Bytes are delivered by kz_pipe_pump(), or one at a time by the rx callback during kz_tick().
+ * If both endpoints are datagram endpoints, frames are delivered whole, and by kz_pipe_pump() only.
+ * A frame which doesn't fit in its direction's buffer is dropped, as if lost on the line.
+ * kz_pipe_pump() must not be called from within a handler of either endpoint.
+ */
+
+#include "kinzhal.h"
+
+
+/* begin configuration */
+
+#define KZ_PIPE_BUFFER_SIZE  (4*KZ_MAX_BUFFER_SIZE)  /* bytes waiting in each direction */
+
+/* end configuration */
+
+
+/* bytes sent by one endpoint, waiting to be received by the other */
+typedef struct kz_pipe_end {
+  kz_endpoint_t * endpoint;     /* receives the bytes */
+  struct kz_pipe_end * peer;    /* buffer this end's endpoint transmits into */
+  char datagram;                /* nonzero if frames are delivered whole, see kz_receiveframe() */
+  kz_byte_t bytes[KZ_PIPE_BUFFER_SIZE];
+  kz_size_t begin;              /* first byte not yet received */
+  kz_size_t end;                /* past-end of bytes waiting */
+  char delivering;              /* nonzero while kz_pipe_pump() is delivering them */
+
+  unsigned long frames;         /* # of frames sent towards this end */
+  unsigned long bytes_sent;     /* # of bytes sent towards this end */
+  unsigned long frames_dropped; /* # of frames which didn't fit */
+} kz_pipe_end_t;
+
+typedef struct kz_pipe {
+  kz_pipe_end_t ends[2];
+} kz_pipe_t;
+
+
+/* set the rx and tx callbacks and userdata of both definitions, and initialize each endpoint with
+ * its own, so that each transmits to the other */
+void kz_pipe_connect(kz_pipe_t * P,
+                     kz_endpoint_t * A, kz_endpointdef_t * A_def,
+                     kz_endpoint_t * B, kz_endpointdef_t * B_def);
+
+/* deliver waiting bytes in both directions, and whatever is sent in response, until nothing more
+ * is waiting. Returns the # of bytes delivered. */
+kz_size_t kz_pipe_pump(kz_pipe_t * P);
+
+/* # of bytes waiting to be received by the given endpoint */
+kz_size_t kz_pipe_waiting(const kz_pipe_t * P, const kz_endpoint_t * K);
+
+#endif
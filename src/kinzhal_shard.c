@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+
+#include "kinzhal_shard.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Ownership:
+ *
+ * An endpoint belongs to the shard whose `endpoints` list it is on, and only that shard's thread
+ * touches it. To hand it over, the owner takes it off its epoll set and its list, and puts it on
+ * the new owner's `incoming` list under that shard's lock. The new owner adopts it the next time
+ * it wakes. The lock orders everything the old owner did before everything the new owner does.
+ *
+ * kz_shard_move() only records where the endpoint is to go, and tells its owner. It stores
+ * move_to before reading `shard`, and adopting stores `shard` before reading move_to, so an
+ * endpoint which changes hands meanwhile is still moved by whichever shard ends up with it.
+ */
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void wake(kz_shard_t * S) {
+  const uint64_t one = 1;
+
+  if(write(S->wake_fd, &one, sizeof(one)) < 0) {
+    /* the counter is full, it is awake anyway */
+  }
+}
+
+static void give(kz_shard_t * S, kz_shard_endpoint_t * E) {
+  atomic_fetch_add(&S->endpoint_count, 1);
+
+  pthread_mutex_lock(&S->lock);
+  E->next = S->incoming;
+  S->incoming = E;
+  pthread_mutex_unlock(&S->lock);
+
+  wake(S);
+}
+
+static void adopt(kz_shard_t * S) {
+  kz_shard_endpoint_t * E;
+  kz_shard_endpoint_t * next;
+  struct epoll_event ev;
+
+  pthread_mutex_lock(&S->lock);
+  E = S->incoming;
+  S->incoming = NULL;
+  pthread_mutex_unlock(&S->lock);
+
+  for( ; E ; E = next) {
+    next = E->next;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = E;
+    epoll_ctl(S->epoll_fd, EPOLL_CTL_ADD, E->fd, &ev);
+
+    E->next = S->endpoints;
+    S->endpoints = E;
+
+    atomic_store(&E->shard, S->index);
+
+    if(atomic_load(&E->move_to) >= 0) {
+      /* asked to move again while on its way here */
+      atomic_store(&S->moves_pending, 1);
+    }
+  }
+}
+
+static void hand_over(kz_shard_t * S) {
+  kz_shard_runtime_t * const R = S->R;
+
+  kz_shard_endpoint_t ** link;
+  kz_shard_endpoint_t * E;
+  int to;
+
+  atomic_store(&S->moves_pending, 0);
+
+  link = &S->endpoints;
+
+  while(*link) {
+    E = *link;
+    to = atomic_exchange(&E->move_to, -1);
+
+    if(to < 0 || to == S->index) {
+      link = &E->next;
+      continue;
+    }
+
+    *link = E->next;
+    epoll_ctl(S->epoll_fd, EPOLL_CTL_DEL, E->fd, NULL);
+    atomic_fetch_sub(&S->endpoint_count, 1);
+
+    give(R->shards + to, E);
+
+    atomic_fetch_add_explicit(&R->moves, 1, memory_order_relaxed);
+  }
+}
+
+static void receive(kz_shard_t * S, kz_shard_endpoint_t * E) {
+  kz_byte_t bytes[4096];
+  ssize_t ret;
+
+  ret = read(E->fd, bytes, sizeof(bytes));
+
+  if(ret > 0) {
+    kz_receive(E->endpoint, bytes, ret);
+    atomic_fetch_add_explicit(&E->load, ret, memory_order_relaxed);
+  } else if(ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    /* nothing more will come, it is still ticked */
+    epoll_ctl(S->epoll_fd, EPOLL_CTL_DEL, E->fd, NULL);
+  }
+}
+
+static void * shard_thread(void * arg) {
+  kz_shard_t * S = arg;
+  kz_shard_runtime_t * const R = S->R;
+
+  struct epoll_event events[64];
+  kz_shard_endpoint_t * E;
+  cpu_set_t cpus;
+  uint64_t wakes;
+  long next_tick;
+  long next_balance;
+  long wait_ms;
+  int count;
+  int i;
+
+  if(S->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(S->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  next_tick    = now_ms() + R->tick_ms;
+  next_balance = now_ms() + R->balance_ms;
+
+  adopt(S);
+
+  while(atomic_load_explicit(&R->running, memory_order_acquire)) {
+    wait_ms = next_tick - now_ms();
+
+    count = epoll_wait(S->epoll_fd, events, sizeof(events)/sizeof(events[0]), wait_ms > 0 ? wait_ms : 0);
+
+    for(i = 0 ; i < count ; i ++) {
+      if(events[i].data.ptr) {
+        receive(S, events[i].data.ptr);
+      } else if(read(S->wake_fd, &wakes, sizeof(wakes)) < 0) {
+        /* nothing to do, it will be read next time */
+      }
+    }
+
+    adopt(S);
+
+    if(atomic_load(&S->moves_pending)) {
+      hand_over(S);
+    }
+
+    if(now_ms() >= next_tick) {
+      for(E = S->endpoints ; E ; E = E->next) {
+        kz_tick(E->endpoint);
+
+        if(E->on_tick) {
+          E->on_tick(E, E->userdata);
+        }
+      }
+
+      next_tick += R->tick_ms;
+    }
+
+    if(S->index == 0 && R->balance && now_ms() >= next_balance) {
+      R->balance(R, R->balance_userdata);
+
+      next_balance = now_ms() + R->balance_ms;
+    }
+  }
+
+  return NULL;
+}
+
+/* Releases what kz_shard_init() has set up for the first count shards, which haven't started */
+static void release_shards(kz_shard_runtime_t * R, int count) {
+  kz_shard_t * S;
+  int i;
+
+  for(i = 0 ; i < count ; i ++) {
+    S = R->shards + i;
+
+    if(S->epoll_fd >= 0) {
+      close(S->epoll_fd);
+    }
+
+    if(S->wake_fd >= 0) {
+      close(S->wake_fd);
+    }
+
+    pthread_mutex_destroy(&S->lock);
+  }
+
+  pthread_mutex_destroy(&R->registry_lock);
+  R->shard_count = 0;
+}
+
+int kz_shard_init(kz_shard_runtime_t * R, int shard_count, int tick_ms, int pin) {
+  struct epoll_event ev;
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int cpu_count = 0;
+  kz_shard_t * S;
+  int i;
+
+  if(shard_count <= 0 || shard_count > KZ_SHARD_MAX_SHARDS || tick_ms <= 0) {
+    return 0;
+  }
+
+  if(pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for(i = 0 ; i < CPU_SETSIZE ; i ++) {
+      if(CPU_ISSET(i, &allowed)) {
+        cpus[cpu_count ++] = i;
+      }
+    }
+  }
+
+  R->shard_count = shard_count;
+  R->started     = 0;
+  R->tick_ms     = tick_ms;
+
+  atomic_init(&R->running, 0);
+  atomic_init(&R->moves, 0);
+
+  pthread_mutex_init(&R->registry_lock, NULL);
+  R->registry = NULL;
+
+  R->balance          = NULL;
+  R->balance_userdata = NULL;
+  R->balance_ms       = 0;
+
+  for(i = 0 ; i < shard_count ; i ++) {
+    S = R->shards + i;
+
+    S->R     = R;
+    S->index = i;
+    /* more shards than cores share them in turn */
+    S->cpu   = cpu_count ? cpus[i % cpu_count] : -1;
+
+    S->endpoints = NULL;
+    S->incoming  = NULL;
+    pthread_mutex_init(&S->lock, NULL);
+
+    atomic_init(&S->moves_pending, 0);
+    atomic_init(&S->endpoint_count, 0);
+
+    S->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    S->wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    /* endpoints are told apart by their pointer, the eventfd has none */
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if(S->epoll_fd < 0 || S->wake_fd < 0 ||
+       epoll_ctl(S->epoll_fd, EPOLL_CTL_ADD, S->wake_fd, &ev) < 0) {
+      /* none of the shards have started, this one included */
+      release_shards(R, i + 1);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int kz_shard_start(kz_shard_runtime_t * R) {
+  int i;
+
+  atomic_store(&R->running, 1);
+
+  for(i = 0 ; i < R->shard_count ; i ++) {
+    if(pthread_create(&R->shards[i].thread, NULL, shard_thread, R->shards + i) != 0) {
+      kz_shard_stop(R);
+      return 0;
+    }
+
+    R->started ++;
+  }
+
+  return 1;
+}
+
+void kz_shard_stop(kz_shard_runtime_t * R) {
+  int i;
+
+  atomic_store(&R->running, 0);
+
+  for(i = 0 ; i < R->shard_count ; i ++) {
+    wake(R->shards + i);
+  }
+
+  for(i = 0 ; i < R->shard_count ; i ++) {
+    if(i < R->started) {
+      pthread_join(R->shards[i].thread, NULL);
+    }
+
+    close(R->shards[i].epoll_fd);
+    close(R->shards[i].wake_fd);
+  }
+}
+
+void kz_shard_add(kz_shard_runtime_t * R, kz_shard_endpoint_t * E, kz_endpoint_t * K, int fd, int shard) {
+  int i;
+
+  if(shard < 0 || shard >= R->shard_count) {
+    /* the one with fewest endpoints */
+    shard = 0;
+    for(i = 1 ; i < R->shard_count ; i ++) {
+      if(atomic_load(&R->shards[i].endpoint_count) < atomic_load(&R->shards[shard].endpoint_count)) {
+        shard = i;
+      }
+    }
+  }
+
+  E->endpoint  = K;
+  E->fd        = fd;
+  E->last_load = 0;
+
+  atomic_init(&E->shard, shard);
+  atomic_init(&E->move_to, -1);
+  atomic_init(&E->load, 0);
+
+  pthread_mutex_lock(&R->registry_lock);
+  E->registry_next = R->registry;
+  R->registry = E;
+  pthread_mutex_unlock(&R->registry_lock);
+
+  give(R->shards + shard, E);
+}
+
+void kz_shard_move(kz_shard_runtime_t * R, kz_shard_endpoint_t * E, int shard) {
+  kz_shard_t * owner;
+
+  if(shard < 0 || shard >= R->shard_count) {
+    return;
+  }
+
+  atomic_store(&E->move_to, shard);
+
+  owner = R->shards + atomic_load(&E->shard);
+  atomic_store(&owner->moves_pending, 1);
+  wake(owner);
+}
+
+void kz_shard_set_balancer(kz_shard_runtime_t * R, kz_shard_balancefn_t balance, void * userdata, int interval_ms) {
+  R->balance          = balance;
+  R->balance_userdata = userdata;
+  R->balance_ms       = interval_ms;
+}
+
+void kz_shard_balance(kz_shard_runtime_t * R, void * userdata) {
+  unsigned long loads[KZ_SHARD_MAX_SHARDS];
+  kz_shard_endpoint_t * E;
+  kz_shard_endpoint_t * best = NULL;
+  unsigned long gap;
+  int busiest = 0;
+  int idlest = 0;
+  int i;
+
+  memset(loads, 0, sizeof(loads));
+
+  pthread_mutex_lock(&R->registry_lock);
+
+  for(E = R->registry ; E ; E = E->registry_next) {
+    E->last_load = atomic_exchange_explicit(&E->load, 0, memory_order_relaxed);
+    loads[atomic_load(&E->shard)] += E->last_load;
+  }
+
+  for(i = 1 ; i < R->shard_count ; i ++) {
+    if(loads[i] > loads[busiest]) {
+      busiest = i;
+    }
+    if(loads[i] < loads[idlest]) {
+      idlest = i;
+    }
+  }
+
+  gap = loads[busiest] - loads[idlest];
+
+  /* the busiest endpoint which still leaves its new shard less busy than the old one was */
+  for(E = R->registry ; E ; E = E->registry_next) {
+    if(atomic_load(&E->shard) == busiest && atomic_load(&E->move_to) < 0 &&
+       E->last_load > 0 && E->last_load < gap &&
+       (!best || E->last_load > best->last_load)) {
+      best = E;
+    }
+  }
+
+  pthread_mutex_unlock(&R->registry_lock);
+
+  if(best) {
+    kz_shard_move(R, best, idlest);
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef KINZHAL_SHARD_H
+#define KINZHAL_SHARD_H
+
+/* Host-side runtime which spreads many endpoints over many cores (requires C11 atomics, POSIX
+ * threads and Linux)
+ *
+ * Each shard is a thread, optionally pinned to a core of its own, which waits on the descriptors
+ * of the endpoints it owns with epoll. An endpoint is owned by exactly one shard at a time, and
+ * is only ever used from that shard's thread, so kz_endpoint_t needs no locks. Endpoints may be
+ * moved between shards while running, by hand or by a balancer which is called periodically
+ * with the load each endpoint has seen.
+ *
+ * kz_shard_runtime_t R;
+ * kz_shard_endpoint_t E;
+ *
+ * kz_shard_init(&R, 4, 10, 1);
+ * kz_init_static(&K, &def);              (def.rx is NULL, bytes are read by the runtime)
+ * kz_shard_add(&R, &E, &K, fd, -1);
+ * kz_shard_start(&R);
+ * ...
+ * kz_shard_stop(&R);
+ */
+
+#include "kinzhal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+/* begin configuration */
+
+#define KZ_SHARD_MAX_SHARDS  64
+
+/* end configuration */
+
+
+struct kz_shard_runtime;
+struct kz_shard_endpoint;
+
+/* called on the owning shard's thread after every tick of the endpoint */
+typedef void (*kz_shard_tickfn_t)(struct kz_shard_endpoint * E, void * userdata);
+
+/* called periodically on the thread of shard 0, may move endpoints with kz_shard_move() */
+typedef void (*kz_shard_balancefn_t)(struct kz_shard_runtime * R, void * userdata);
+
+typedef struct kz_shard_endpoint {
+  kz_endpoint_t * endpoint;
+  int fd;
+
+  /* set by the caller before kz_shard_add() */
+  kz_shard_tickfn_t on_tick;  /* may be NULL */
+  void * userdata;
+
+  atomic_int shard;           /* index of the owning shard */
+  atomic_int move_to;         /* index of the shard it is to be handed to, or -1 */
+  atomic_ulong load;          /* # of bytes received since the balancer last looked */
+  unsigned long last_load;    /* used by kz_shard_balance() */
+
+  struct kz_shard_endpoint * next;           /* in the owning shard's list, or its incoming list */
+  struct kz_shard_endpoint * registry_next;  /* in the runtime's list of every endpoint */
+} kz_shard_endpoint_t;
+
+typedef struct kz_shard {
+  struct kz_shard_runtime * R;
+  int index;
+  int cpu;                    /* core the thread is pinned to, or -1 */
+
+  pthread_t thread;
+  int epoll_fd;
+  int wake_fd;                /* eventfd, for handovers and for stopping */
+
+  /* owned by the shard's thread */
+  kz_shard_endpoint_t * endpoints;
+
+  /* handed over by other threads */
+  pthread_mutex_t lock;
+  kz_shard_endpoint_t * incoming;
+
+  atomic_int moves_pending;   /* nonzero if one of its endpoints is to be moved */
+  atomic_int endpoint_count;  /* # owned, or on their way to it */
+} kz_shard_t;
+
+typedef struct kz_shard_runtime {
+  kz_shard_t shards[KZ_SHARD_MAX_SHARDS];
+  int shard_count;
+  int started;                /* # of shards whose thread is running */
+  int tick_ms;
+
+  atomic_int running;
+
+  /* every endpoint ever added */
+  pthread_mutex_t registry_lock;
+  kz_shard_endpoint_t * registry;
+
+  kz_shard_balancefn_t balance;
+  void * balance_userdata;
+  int balance_ms;
+
+  atomic_uint moves;          /* # of endpoints handed from one shard to another */
+} kz_shard_runtime_t;
+
+
+/* prepare a runtime of shard_count shards, ticking every endpoint every tick_ms. If pin is
+ * nonzero, each shard is pinned to one of the cores the process may run on, in turn. Returns 1 on
+ * success, 0 on failure, in which case nothing is left open. */
+int  kz_shard_init(kz_shard_runtime_t * R, int shard_count, int tick_ms, int pin);
+/* start the shards, returns 1 on success, 0 on failure */
+int  kz_shard_start(kz_shard_runtime_t * R);
+/* stop the shards and wait for them to finish. The endpoints and their descriptors are left to
+ * the caller. */
+void kz_shard_stop(kz_shard_runtime_t * R);
+
+/* hand an initialised endpoint, which reads from fd, to a shard (or to the least loaded, if shard
+ * is negative). May be called from any thread, before or after the runtime is started. From then
+ * on the endpoint may only be used from kz_shard_tickfn_t callbacks and its own handlers. */
+void kz_shard_add(kz_shard_runtime_t * R, kz_shard_endpoint_t * E, kz_endpoint_t * K, int fd, int shard);
+
+/* ask for an endpoint to be handed to another shard, from any thread */
+void kz_shard_move(kz_shard_runtime_t * R, kz_shard_endpoint_t * E, int shard);
+
+/* call balance every interval_ms with its userdata, set before the runtime is started */
+void kz_shard_set_balancer(kz_shard_runtime_t * R, kz_shard_balancefn_t balance, void * userdata, int interval_ms);
+
+/* balancer which moves an endpoint from the busiest shard to the least busy one, if that evens
+ * out their load */
+void kz_shard_balance(kz_shard_runtime_t * R, void * userdata);
+
+#endif
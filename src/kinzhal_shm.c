@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include "kinzhal_shm.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* Rings:
+ *
+ * head and tail count bytes, and wrap around at 2^32, a multiple of the ring's size. Each frame is
+ * written as [ size (2 bytes, little endian) ] followed by the frame, padded to an even length. A
+ * frame is never split at the end of the ring: if it wouldn't fit, a size of 0xFFFF marks the rest
+ * as padding, and the frame is written at the start. The consumer handles a frame where it lies,
+ * and only then advances tail past it, so the producer can't overwrite it meanwhile. A frame for
+ * which there is no room is dropped, and counted, as if lost on the line.
+ *
+ * Wakeups:
+ *
+ * A consumer which finds the ring empty looks at it again a few times, in case the other process is
+ * about to write to it from another core. It then sets `waiting`, looks at head once more, and
+ * waits on the futex at head for it to change. A producer which finds `waiting` set after advancing
+ * head clears it and wakes the consumer. Both are sequentially consistent, so either the consumer
+ * sees the new head, or the producer sees that it is waiting.
+ */
+
+#define KZ_SHM_FRAME_HEADER  2
+#define KZ_SHM_PADDING       0xFFFF
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* # of bytes taken by a frame of the given size, including its header and padding */
+static uint32_t record_size(kz_size_t size) {
+  return (KZ_SHM_FRAME_HEADER + size + 1) & ~(uint32_t)1;
+}
+
+static void shm_tx(const kz_byte_t * bytes, size_t size) {
+  kz_shm_t * S = kz_userdata();
+  kz_shm_ring_t * const R = S->tx_ring;
+
+  const uint32_t record = record_size(size);
+
+  uint32_t head;
+  uint32_t tail;
+  uint32_t index;
+  uint32_t padding;
+
+  head = atomic_load_explicit(&R->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&R->tail, memory_order_acquire);
+
+  index   = head & (KZ_SHM_RING_SIZE - 1);
+  padding = index + record > KZ_SHM_RING_SIZE ? KZ_SHM_RING_SIZE - index : 0;
+
+  if((head - tail) + padding + record > KZ_SHM_RING_SIZE) {
+    atomic_fetch_add_explicit(&R->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  if(padding) {
+    R->bytes[index]     = KZ_SHM_PADDING & 0xFF;
+    R->bytes[index + 1] = KZ_SHM_PADDING >> 8;
+    head += padding;
+    index = 0;
+  }
+
+  R->bytes[index]     = size & 0xFF;
+  R->bytes[index + 1] = size >> 8;
+  memcpy(R->bytes + index + KZ_SHM_FRAME_HEADER, bytes, size);
+
+  /* publish */
+  atomic_store_explicit(&R->head, head + record, memory_order_seq_cst);
+
+  if(atomic_load_explicit(&R->waiting, memory_order_seq_cst) &&
+     atomic_exchange_explicit(&R->waiting, 0, memory_order_seq_cst)) {
+    syscall(SYS_futex, &R->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+/* handles every frame in the receive ring, returns the # handled */
+static int receive(kz_shm_t * S) {
+  kz_shm_ring_t * const R = S->rx_ring;
+
+  uint32_t head;
+  uint32_t tail;
+  uint32_t index;
+  kz_size_t size;
+  int count = 0;
+
+  tail = atomic_load_explicit(&R->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&R->head, memory_order_acquire);
+
+  while(tail != head) {
+    index = tail & (KZ_SHM_RING_SIZE - 1);
+    size  = R->bytes[index] | (R->bytes[index + 1] << 8);
+
+    if(size == KZ_SHM_PADDING) {
+      tail += KZ_SHM_RING_SIZE - index;
+    } else if(index + record_size(size) > KZ_SHM_RING_SIZE) {
+      /* not written by shm_tx(), nothing more can be trusted */
+      tail = head;
+    } else {
+      kz_receiveframe(&S->endpoint, R->bytes + index + KZ_SHM_FRAME_HEADER, size);
+      tail += record_size(size);
+      count ++;
+    }
+
+    atomic_store_explicit(&R->tail, tail, memory_order_release);
+
+    if(tail == head) {
+      /* anything sent meanwhile */
+      head = atomic_load_explicit(&R->head, memory_order_acquire);
+    }
+  }
+
+  return count;
+}
+
+/* waits for the receive ring to be written to, for up to timeout_ms (forever if negative) */
+static void wait_rx(kz_shm_t * S, int timeout_ms) {
+  kz_shm_ring_t * const R = S->rx_ring;
+
+  struct timespec ts;
+  uint32_t tail;
+  int spin;
+
+  tail = atomic_load_explicit(&R->tail, memory_order_relaxed);
+
+  /* a reply is often only a moment away, on another core */
+  for(spin = 0 ; spin < KZ_SHM_SPIN ; spin ++) {
+    if(atomic_load_explicit(&R->head, memory_order_relaxed) != tail) {
+      return;
+    }
+  }
+
+  atomic_store_explicit(&R->waiting, 1, memory_order_seq_cst);
+
+  if(atomic_load_explicit(&R->head, memory_order_seq_cst) == tail) {
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    /* returns at once if head has changed since */
+    syscall(SYS_futex, &R->head, FUTEX_WAIT, tail, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+  }
+
+  atomic_store_explicit(&R->waiting, 0, memory_order_relaxed);
+}
+
+static int map(kz_shm_t * S, int fd, int creator, int tick_ms) {
+  struct stat st;
+
+  S->segment = NULL;
+  S->fd      = fd;
+  S->tick_ms = tick_ms;
+  S->next_tick_ms = now_ms() + tick_ms;
+
+  if(creator && ftruncate(fd, sizeof(kz_shm_segment_t)) != 0) {
+    return 0;
+  }
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(kz_shm_segment_t)) {
+    return 0;
+  }
+
+  S->segment = mmap(NULL, sizeof(kz_shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if(S->segment == MAP_FAILED) {
+    S->segment = NULL;
+    return 0;
+  }
+
+  if(creator) {
+    /* freshly truncated, so the rings are already empty */
+    S->segment->magic     = KZ_SHM_MAGIC;
+    S->segment->ring_size = KZ_SHM_RING_SIZE;
+  } else if(S->segment->magic != KZ_SHM_MAGIC || S->segment->ring_size != KZ_SHM_RING_SIZE) {
+    munmap(S->segment, sizeof(kz_shm_segment_t));
+    S->segment = NULL;
+    return 0;
+  }
+
+  S->tx_ring = S->segment->rings + (creator ? 0 : 1);
+  S->rx_ring = S->segment->rings + (creator ? 1 : 0);
+
+  S->def.rx_buffer      = S->rx_buffer;
+  S->def.rx_buffer_size = sizeof(S->rx_buffer);
+  S->def.tx_buffer      = S->tx_buffer;
+  S->def.tx_buffer_size = sizeof(S->tx_buffer);
+  S->def.channels            = S->channels;
+  S->def.channel_count       = KZ_MAX_CHANNELS;
+  S->def.local_requests      = S->local_requests;
+  S->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  S->def.rx_window         = 0;
+  S->def.tx_budget         = 0;
+  S->def.queue_buffer      = NULL;
+  S->def.queue_buffer_size = 0;
+  S->def.retransmit_ticks  = 0;
+  /* frames are received whole, from the ring */
+  S->def.datagram          = 1;
+  S->def.address           = 0;
+  S->def.tx_enable         = NULL;
+  S->def.tx_buffer_count   = 0;
+  S->def.tx_async          = 0;
+  S->def.rx       = NULL;
+  S->def.tx       = shm_tx;
+  S->def.userdata = S;
+
+  kz_init_static(&S->endpoint, &S->def);
+
+  return 1;
+}
+
+int kz_shm_create(kz_shm_t * S, const char * name, int tick_ms) {
+  int fd;
+
+  S->name[0] = '\0';
+
+  if(name) {
+    if(strlen(name) >= sizeof(S->name)) {
+      return 0;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if(fd >= 0) {
+      strcpy(S->name, name);
+    }
+  } else {
+    fd = memfd_create("kinzhal", 0);
+  }
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  if(!map(S, fd, 1, tick_ms)) {
+    kz_shm_close(S);
+    return 0;
+  }
+
+  return 1;
+}
+
+int kz_shm_open(kz_shm_t * S, const char * name, int tick_ms) {
+  int fd;
+
+  fd = shm_open(name, O_RDWR, 0);
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  if(!kz_shm_attach(S, fd, tick_ms)) {
+    close(fd);
+    return 0;
+  }
+
+  return 1;
+}
+
+int kz_shm_attach(kz_shm_t * S, int fd, int tick_ms) {
+  S->name[0] = '\0';
+
+  return map(S, fd, 0, tick_ms);
+}
+
+void kz_shm_close(kz_shm_t * S) {
+  if(S->segment) {
+    munmap(S->segment, sizeof(kz_shm_segment_t));
+    S->segment = NULL;
+  }
+
+  close(S->fd);
+
+  if(S->name[0]) {
+    shm_unlink(S->name);
+    S->name[0] = '\0';
+  }
+}
+
+int kz_shm_poll(kz_shm_t * S, int timeout_ms) {
+  long now;
+  int count;
+
+  count = receive(S);
+
+  if(!count && timeout_ms != 0) {
+    if(S->tick_ms) {
+      /* wake for the next tick */
+      now = now_ms();
+      if(timeout_ms < 0 || timeout_ms > S->next_tick_ms - now) {
+        timeout_ms = S->next_tick_ms > now ? S->next_tick_ms - now : 0;
+      }
+    }
+
+    if(timeout_ms != 0) {
+      wait_rx(S, timeout_ms);
+    }
+
+    count = receive(S);
+  }
+
+  if(S->tick_ms && now_ms() >= S->next_tick_ms) {
+    kz_tick(&S->endpoint);
+
+    S->next_tick_ms += S->tick_ms;
+
+    if(S->next_tick_ms <= now_ms()) {
+      /* fallen behind, don't try to catch up */
+      S->next_tick_ms = now_ms() + S->tick_ms;
+    }
+  }
+
+  return count;
+}
@@ -0,0 +1,97 @@
+#ifndef KINZHAL_SHM_H
+#define KINZHAL_SHM_H
+
+/* Endpoints in two processes on the same host, connected by shared memory (requires C11 atomics
+ * and Linux)
+ *
+ * A segment holds a ring for each direction, each with a single producer and a single consumer.
+ * Frames are written to the ring whole, as by a datagram endpoint, and are handled in place by the
+ * receiving endpoint, so no byte is copied but from the transmit buffer into the ring. A process
+ * which has nothing to do waits on a futex in its receive ring, and is only woken through the
+ * kernel if it is actually waiting.
+ *
+ * kz_shm_t S;
+ *
+ * kz_shm_create(&S, "/rig", 10);         (in one process)
+ * kz_shm_open(&S, "/rig", 10);           (in the other)
+ * kz_handle(&S.endpoint, 1, fn, NULL);
+ *
+ * for(;;) {
+ *   kz_shm_poll(&S, 10);                 (handles frames, waiting for up to 10 ms)
+ *   ...
+ * }
+ *
+ * kz_shm_close(&S);
+ */
+
+#include "kinzhal.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+
+/* begin configuration */
+
+#define KZ_SHM_RING_SIZE  65536  /* bytes in each direction, a power of two */
+#define KZ_SHM_SPIN         200  /* times an empty ring is looked at again before waiting on it */
+
+/* end configuration */
+
+
+#define KZ_SHM_MAGIC      0x4B5A5348UL  /* "KZSH" */
+
+/* frames on their way from one process to the other */
+typedef struct kz_shm_ring {
+  /* written by the producer */
+  _Alignas(64) atomic_uint_least32_t head;  /* # of bytes written, also the futex word */
+  atomic_uint_least32_t dropped;            /* # of frames which didn't fit */
+
+  /* written by the consumer */
+  _Alignas(64) atomic_uint_least32_t tail;  /* # of bytes consumed */
+  atomic_uint_least32_t waiting;            /* nonzero while the consumer may be waiting on head */
+
+  _Alignas(64) kz_byte_t bytes[KZ_SHM_RING_SIZE];
+} kz_shm_ring_t;
+
+/* mapped by both processes */
+typedef struct kz_shm_segment {
+  uint32_t magic;
+  uint32_t ring_size;
+  kz_shm_ring_t rings[2];  /* from the creator, and to it */
+} kz_shm_segment_t;
+
+typedef struct kz_shm {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+
+  kz_shm_segment_t * segment;
+  kz_shm_ring_t * tx_ring;
+  kz_shm_ring_t * rx_ring;
+
+  int fd;
+  int tick_ms;        /* interval between calls to kz_tick() from kz_shm_poll() */
+  long next_tick_ms;
+  char name[64];      /* of a segment which is unlinked once closed, if created by name */
+} kz_shm_t;
+
+
+/* create a segment, and an endpoint on one side of it. The segment is named (see shm_open()), or
+ * anonymous if name is NULL, in which case S->fd may be handed to the other process. The endpoint
+ * is ticked every tick_ms by kz_shm_poll(), or never if 0. Returns 1 on success, 0 on failure. */
+int  kz_shm_create(kz_shm_t * S, const char * name, int tick_ms);
+/* open a segment created by name in another process, and an endpoint on the other side of it */
+int  kz_shm_open(kz_shm_t * S, const char * name, int tick_ms);
+/* kz_shm_open(), given a descriptor of the segment rather than its name */
+int  kz_shm_attach(kz_shm_t * S, int fd, int tick_ms);
+void kz_shm_close(kz_shm_t * S);
+
+/* handle the frames which have arrived, waiting up to timeout_ms for one if none has (0 to not
+ * wait, -1 to wait until one does), and tick the endpoint if it is due. Returns the # of frames
+ * handled. */
+int  kz_shm_poll(kz_shm_t * S, int timeout_ms);
+
+#endif
@@ -15,6 +15,14 @@ int rx_Serial(kz_byte_t * b) {
 
 int loop_count = 0;
 
+kz_byte_t rx_buffer[16];
+// room for the replies to a few batched calls
+kz_byte_t tx_buffer[32];
+// channels 0 to 6 are handled, and no calls are made
+kz_channel_t channels[7];
+kz_endpoint_t endpoint;
+kz_endpoint_t * const K = &endpoint;
+
 // Pi!
 static kz_request_status_t get_pi(kz_endpoint_t * K, void * _) {
   kz_putfloat(K, 3.14159f);
@@ -40,59 +48,79 @@ static kz_request_status_t get_numloops(kz_endpoint_t * K, void * _) {
   return KZ_OK;
 }
 
-// Blink n times!
+// Blink n times! Runs as a task so that other calls are serviced meanwhile.
+// Each tick is roughly 10 ms, see loop().
+static char blinking = 0;
+
+static kz_task_status_t blink_task(kz_endpoint_t * K, kz_task_t * T) {
+  KZ_TASK_BEGIN(T);
+  for(T->locals[1] = 0 ; T->locals[1] < T->locals[0] ; T->locals[1] ++) {
+    digitalWrite(13, HIGH);
+    KZ_TASK_SLEEP(T, 10);
+    digitalWrite(13, LOW);
+    KZ_TASK_SLEEP(T, 10);
+  }
+  KZ_TASK_SLEEP(T, 50);
+  kz_reply(K, T->request, KZ_OK);
+  blinking = 0;
+  KZ_TASK_END(T);
+}
+
 static kz_request_status_t handle_blink(kz_endpoint_t * K, void * _) {
   kz_int_t n;
+  kz_task_t * T;
+  if(blinking) {
+    // still blinking for someone else
+    return KZ_BUSY;
+  }
   if(kz_getint(K, &n)) {
-    for(int i = 0 ; i < n ; i ++) {
-      digitalWrite(13, HIGH);
-      delay(100);
-      digitalWrite(13, LOW);
-      delay(100);
+    T = kz_spawn(K, blink_task, NULL);
+    if(!T) {
+      return KZ_BUSY;
     }
-    delay(500);
-    return KZ_OK;
+    T->request = kz_defer(K);
+    if(!T->request) {
+      // nothing to reply to, cancel the task before it runs
+      T->fn = NULL;
+      return KZ_BUSY;
+    }
+    T->locals[0] = n;
+    blinking = 1;
+    return KZ_DEFER;
   } else {
     return KZ_INVALID;
   }
 }
 
-/*
-static const char * const channel_info[] = {
-        "pi () (float)"         ,
-    "eulers () (float)"         ,
-     "three () ((int int int))" ,
-  "numloops () (int)"           ,
-     "blink (int) ()"           ,
+// Channel info, one reply part per channel: channel, # of arguments, # of results
+static const kz_int_t channel_info[][3] = {
+  { 1, 0, 1 }, // pi () (float)
+  { 2, 0, 1 }, // eulers () (float)
+  { 3, 0, 1 }, // three () ((int int int))
+  { 4, 0, 1 }, // numloops () (int)
+  { 5, 1, 0 }, // blink (int) ()
+  { 6, 0, 0 }, // info () ()
 };
 
-void send_info(kze_request_t req) {
-  kz_writer_t W;
-  kz_string_t infostr;
-
-  W = kz_writerb(byte_train);
+static kz_request_status_t send_info(kz_endpoint_t * K, void * _) {
+  kz_request_t * req = kz_defer(K);
+  if(!req) {
+    return KZ_BUSY;
+  }
 
   // send info for each channel
   for(unsigned int i = 0 ; i < sizeof(channel_info)/sizeof(channel_info[0]) ; i ++) {
-    infostr.bytes = (const kz_byte_t *)channel_info[i];
-    infostr.length = strlen(channel_info[i]);
-
-    kz_writeint(&W, i);
-    kz_writestring(&W, infostr);
+    kz_putint(K, channel_info[i][0]);
+    kz_putint(K, channel_info[i][1]);
+    kz_putint(K, channel_info[i][2]);
 
-    kze_sendreply(req, kz_stringw(&W));
+    kz_replypart(K, req);
   }
 
-  infostr.bytes = NULL;
-  infostr.length = 0;
-  kze_sendreply(req, infostr);
+  // an empty reply ends the stream
+  return KZ_OK;
 }
-*/
 
-kz_byte_t rx_buffer[16];
-kz_byte_t tx_buffer[16];
-kz_endpoint_t endpoint;
-kz_endpoint_t * const K = &endpoint;
 
 void setup() {
   Serial.begin(115200);
@@ -104,8 +132,24 @@ void setup() {
   def.rx_buffer_size = sizeof(rx_buffer);
   def.tx_buffer = tx_buffer;
   def.tx_buffer_size = sizeof(tx_buffer);
+  def.channels = channels;
+  def.channel_count = sizeof(channels)/sizeof(channels[0]);
+  def.local_requests = NULL;
+  def.local_request_count = 0;
+  // at most a couple of frames fit in the UART's FIFO between ticks
+  def.rx_window = 2;
+  def.tx_budget = 0;
+  def.queue_buffer = NULL;
+  def.queue_buffer_size = 0;
+  def.retransmit_ticks = 0;
+  def.datagram = 0;
+  def.address = 0;
+  def.tx_enable = NULL;
+  def.tx_buffer_count = 0;
+  def.tx_async = 0;
   def.rx = rx_Serial;
   def.tx = tx_Serial;
+  def.userdata = NULL;
 
   kz_init_static(K, &def);
 
@@ -114,6 +158,7 @@ void setup() {
   kz_handle(K, 3, get_three, NULL);
   kz_handle(K, 4, get_numloops, NULL);
   kz_handle(K, 5, handle_blink, NULL);
+  kz_handle(K, 6, send_info, NULL);
 }
 
 void loop() {
@@ -7,6 +7,27 @@
 
 #define KZ_HEADER_REQUEST   0x50
 #define KZ_HEADER_REPLY     0x51
+#define KZ_HEADER_REPLYPART 0x52
+#define KZ_HEADER_CREDIT    0x53
+#define KZ_HEADER_BATCH     0x54
+#define KZ_HEADER_SUBSCRIBE   0x55
+#define KZ_HEADER_UNSUBSCRIBE 0x56
+
+#define KZ_HASH_INIT 2166136261UL
+
+/* Approximate # of bytes added to a frame by COBS encoding and the delimiter */
+#define KZ_COBS_OVERHEAD       2
+
+/* [ size ] [ priority ] preceding each frame in the outgoing queue */
+#define KZ_QUEUE_ENTRY_HEADER  2
+
+/* flags carried in the priority byte of a queue entry */
+#define KZ_QUEUE_PRIORITY_MASK 0x3F
+#define KZ_QUEUE_RETAIN        0x40 /* entry is kept once sent, so that it may be sent again */
+#define KZ_QUEUE_SENT          0x80 /* retained entry has been sent, and isn't waiting */
+
+#define KZ_CREDIT_RESET     0x01
+#define KZ_CREDIT_QUERY     0x02
 
 #define KZ_HEADER_SIZE         4
 
@@ -41,9 +62,98 @@
 #define KZ_RX_HEADER_START      0
 #define KZ_RX_PAYLOAD_START     (KZ_RX_HEADER_START + KZ_HEADER_SIZE)
 
-/* [ 0x50 ] [ REQID ] [  CHANID  ] [ reserved ]
- * [ 0x51 ] [ REQID ] [ reserved ] [ reserved ]
- * [ 0x52 ] [ REQID ] [ reserved ] [ reserved ]
+/* [ 0x50 ] [ REQID ] [  CHANID  ] [ ADDRESS ]
+ * [ 0x51 ] [ REQID ] [  STATUS  ] [ ADDRESS ]
+ * [ 0x52 ] [ REQID ] [  STATUS  ] [ ADDRESS ]
+ * [ 0x53 ] [ GRANT ] [  FLAGS   ] [ ADDRESS ] ( max payload )
+ * [ 0x54 ] [ REQID ] [  COUNT   ] [ ADDRESS ]
+ * [ 0x55 ] [ REQID ] [  CHANID  ] [ ADDRESS ] ( mode ) ( period )
+ * [ 0x56 ] [ REQID ] [ reserved ] [ ADDRESS ]
+ */
+
+/* Addressing:
+ *
+ * ADDRESS is 0 between two peers. On a multi-drop bus, it is the id of the node a frame is to, or
+ * that id with the high bit set if the frame is from the node, so that it is never taken for a
+ * frame to another node. It is filled in as each frame is encoded, and checked as soon as it has
+ * been decoded: the rest of a frame with another address is skipped like a corrupted one.
+ */
+
+/* index of ADDRESS in the header */
+#define KZ_HEADER_ADDRESS       3
+
+/* Subscriptions:
+ *
+ * A subscription is a request whose reply is streamed for as long as it lasts. The subscribed
+ * endpoint calls the channel's handler (without arguments) every `period` ticks, and sends its
+ * results as a reply part, or, in KZ_SUBSCRIBE_ONCHANGE mode, only when they differ from the last
+ * results sent. An unsubscribe request ends the stream with an ordinary reply.
+ */
+
+/* Batches:
+ *
+ * A batch request carries COUNT calls, each as [ CHANID ] [ LEN ] followed by LEN bytes of
+ * arguments. The handlers are called in order, and their results are returned in a single reply
+ * with the status KZ_OK, each as [ STATUS ] [ LEN ] followed by LEN bytes of results. If the reply
+ * runs out of room, the remaining calls are not made and have no entry in the reply.
+ */
+
+/* Streaming:
+ *
+ * A reply may be sent in several parts: any number of 0x52 frames, followed by an ordinary 0x51
+ * reply which ends the stream. The caller's reply handler is called once per part with KZ_MORE,
+ * and the call's timeout starts over whenever a part arrives.
+ */
+
+/* Flow control:
+ *
+ * An endpoint with a nonzero rx_window grants its peer that many request frames. Credit is
+ * returned at the end of each tick for every request frame received during it. A credit frame
+ * with the RESET flag sets the peer's credit to GRANT, rather than adding to it, and carries the
+ * largest request payload which will be accepted. The QUERY flag asks the peer to send such a
+ * frame, if it has a window.
+ *
+ * Requests which are made while there is no credit are copied to the queue buffer, and sent
+ * once credit has been returned. Until a RESET is received, the peer's credit is unlimited.
+ *
+ * Each endpoint advertises its window and queries the peer's on its first tick, so that tx needn't
+ * work before then. A request or credit frame lost on the way uses up credit for good, so the
+ * peer's credit is queried again whenever a request times out, and every KZ_CREDIT_QUERY_TICKS
+ * ticks for as long as it stays used up.
+ */
+
+/* Priorities:
+ *
+ * Every outgoing request and reply has a priority, 0 being the highest. Unless given for a
+ * particular call, it is that of the channel, see kz_priority(). Frames are queued when they
+ * have to wait for credit, or when the endpoint's tx_budget (bytes per tick) has been used up.
+ * Queued frames are sent in order of priority, so that an urgent reply goes out ahead of a
+ * bulk transfer which has been split across several frames.
+ */
+
+/* Caching:
+ *
+ * When a call is made on a channel with a TTL, its arguments are copied to a cache entry which
+ * is pending until the reply arrives. A final KZ_OK reply is then kept along with them for that
+ * many ticks, provided both fit in KZ_CACHE_ENTRY_SIZE bytes. If no entry is free, the one closest
+ * to expiry is reused. Any other reply, or a timeout, frees the entry.
+ */
+
+/* Coalescing:
+ *
+ * Idempotent calls, and calls on cached channels, are keyed by a hash of their channel and
+ * arguments. While such a call waits for its reply, an identical call takes a local request
+ * object but makes no request; it is given every part of the first call's reply, or its timeout,
+ * in turn. Each call still times out on its own.
+ */
+
+/* Retransmission:
+ *
+ * A REQID is the index of a local request object plus a multiple of the size of the pool, which
+ * advances each time the object is freed, so that a late or duplicated reply is never taken for
+ * that of a newer request. An idempotent call keeps its frame in the queue buffer once it has
+ * been sent. If no reply has arrived after retransmit_ticks, the frame is queued again, and the
+ * wait is doubled, until KZ_MAX_RETRANSMITS retransmissions have been made or the call times out.
  */
 
 /* Decodes a byte into the endpoint's receive (RX) buffer.
@@ -86,6 +196,12 @@ static char rx_decode(kz_endpoint_t * K, kz_byte_t byte) {
             *K->rx_buffer_pos++ = byte;
           }
           K->rx_count --;
+
+          if(K->address && K->rx_buffer_pos == K->rx_buffer + KZ_RX_HEADER_START + KZ_HEADER_SIZE &&
+             K->rx_buffer[KZ_RX_HEADER_START + KZ_HEADER_ADDRESS] != K->address) {
+            /* for another node, skip the rest */
+            K->rx_state = KZ_RX_ABORT;
+          }
         }
         return 0;
       }
@@ -95,12 +211,89 @@ static char rx_decode(kz_endpoint_t * K, kz_byte_t byte) {
   }
 }
 
+/* Makes the transmit buffer with the given index the one frames are built in */
+static void select_tx_buffer(kz_endpoint_t * K, unsigned int index) {
+  K->tx_pool_index = index;
+  K->tx_buffer     = K->tx_pool + index * K->tx_pool_stride;
+  K->tx_buffer_end = K->tx_buffer + K->tx_pool_stride;
+}
+
+/* Returns 1 if the transmit buffer with the given index isn't held by the transport, nor set aside */
+static int tx_buffer_free(kz_endpoint_t * K, unsigned int index) {
+  return !K->tx_held[index] && !(K->aside_putptr && index == K->aside_index);
+}
+
+/* Returns 1 if the frame being built may be given to the transport, which leaves another free
+ * transmit buffer to build the next one in */
+static int tx_buffer_ready(kz_endpoint_t * K) {
+  unsigned int index;
+
+  if(!K->tx_async) {
+    /* done with as soon as tx returns */
+    return 1;
+  }
+
+  for(index = 0 ; index < K->tx_pool_count ; index ++) {
+    if(index != K->tx_pool_index && tx_buffer_free(K, index)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Moves on to the next free transmit buffer, of which there must be one (see tx_buffer_ready()) */
+static void next_tx_buffer(kz_endpoint_t * K) {
+  unsigned int index = K->tx_pool_index;
+  unsigned int i;
+
+  for(i = 1 ; i < K->tx_pool_count ; i ++) {
+    index = (K->tx_pool_index + i) % K->tx_pool_count;
+
+    if(tx_buffer_free(K, index)) {
+      break;
+    }
+  }
+
+  KZ_ASSERT(index != K->tx_pool_index && tx_buffer_free(K, index));
+  select_tx_buffer(K, index);
+}
+
+/* endpoint whose rx or tx callback is being called on this thread, see kz_userdata() */
+static KZ_THREAD_LOCAL kz_endpoint_t * calling_endpoint = NULL;
+
+void * kz_userdata(void) {
+  return calling_endpoint ? calling_endpoint->userdata : NULL;
+}
+
+/* Calls the tx callback on behalf of K. It may in turn have another endpoint send or receive, so
+ * whichever endpoint was calling before is restored afterwards. */
+static void call_tx(kz_endpoint_t * K, const kz_byte_t * bytes, size_t size) {
+  kz_endpoint_t * const outer = calling_endpoint;
+
+  calling_endpoint = K;
+  K->tx(bytes, size);
+  calling_endpoint = outer;
+}
+
+static int call_rx(kz_endpoint_t * K, kz_byte_t * byte) {
+  kz_endpoint_t * const outer = calling_endpoint;
+  int ret;
+
+  calling_endpoint = K;
+  ret = K->rx(byte);
+  calling_endpoint = outer;
+
+  return ret;
+}
+
 /* Encodes the transmit (TX) buffer in-place, and sends the resulting string via the tx handler
  * In order to encode in-place, the first and last bytes of the tx_buffer are reserved for byte stuffing.
  *
  * [ reserved ] [ d1 ] [ d2 ] [ d3 ] ... [ dN ] [ reserved ]
  *
  * It is not possible to perform in-place COBS encoding of frames larger than 254 bytes.
+ * A datagram endpoint sends the frame as it is, and leaves the reserved bytes alone.
  */
 static void tx_encode_and_send(kz_endpoint_t * K) {
   const kz_byte_t * data_end;
@@ -110,6 +303,35 @@ static void tx_encode_and_send(kz_endpoint_t * K) {
 
   /* TX function must be initialized */
   KZ_ASSERT(K->tx);
+
+  if(K->address) {
+    /* from us, to the peer */
+    K->tx_buffer[KZ_TX_HEADER_START + KZ_HEADER_ADDRESS] = K->address ^ 0x80;
+  }
+
+  if(K->tx_enable) {
+    K->tx_enable(K, 1);
+  }
+
+  if(K->tx_async) {
+    /* before it is given away, it may be released at once */
+    K->tx_held[K->tx_pool_index] = 1;
+  }
+
+  if(K->datagram) {
+    call_tx(K, K->tx_buffer + KZ_TX_HEADER_START, K->putptr - (K->tx_buffer + KZ_TX_HEADER_START));
+
+    if(K->tx_async) {
+      next_tx_buffer(K);
+    }
+
+    K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START;
+
+    if(K->tx_enable) {
+      K->tx_enable(K, 0);
+    }
+    return;
+  }
   /* The frame's data is assumed to be present in [K->tx_buffer + 1, K->putptr)
    * The # of bytes in this range must be less than the MTU
    */
@@ -119,253 +341,2074 @@ static void tx_encode_and_send(kz_endpoint_t * K) {
    */
   KZ_ASSERT(K->putptr <= K->tx_buffer_end - 1);
 
-  /* Searches for the next zero byte contained within the data */
-  search_ptr = K->tx_buffer + KZ_TX_HEADER_START;
-  /* Stores location of last COBS subheader (number of bytes until next zero byte) */
-  len_ptr = K->tx_buffer;
+  /* Searches for the next zero byte contained within the data */
+  search_ptr = K->tx_buffer + KZ_TX_HEADER_START;
+  /* Stores location of last COBS subheader (number of bytes until next zero byte) */
+  len_ptr = K->tx_buffer;
+
+  /* Past-end pointer of TX data */
+  data_end = K->putptr;
+
+  len = 1;
+
+  while(search_ptr != data_end) {
+    if(*search_ptr == 0x00) {
+      *len_ptr = len;
+      len_ptr = search_ptr;
+      len = 1;
+    } else {
+      len ++;
+    }
+    search_ptr ++;
+  }
+
+  *len_ptr = len;
+  *search_ptr = 0x00;
+  search_ptr ++;
+
+  /* send all bytes in the newly encoded buffer */
+  call_tx(K, K->tx_buffer, search_ptr - K->tx_buffer);
+
+  if(K->tx_async) {
+    /* build the next frame elsewhere while this one is sent */
+    next_tx_buffer(K);
+  }
+
+  /* reset write pointer */
+  K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START;
+
+  if(K->tx_enable) {
+    /* let the other side answer */
+    K->tx_enable(K, 0);
+  }
+}
+
+/* Returns 1 if the given header is that of a request, which needs credit to be sent */
+static int is_request(kz_byte_t header) {
+  return header == KZ_HEADER_REQUEST   ||
+         header == KZ_HEADER_BATCH     ||
+         header == KZ_HEADER_SUBSCRIBE ||
+         header == KZ_HEADER_UNSUBSCRIBE;
+}
+
+/* FNV-1a, continuing from the given hash (start with KZ_HASH_INIT) */
+static uint32_t hash_bytes(uint32_t hash, const kz_byte_t * bytes, kz_size_t size) {
+  while(size --) {
+    hash ^= *bytes++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* Sets the range of bytes read by kz_get*() */
+static void set_getrange(kz_endpoint_t * K, kz_byte_t * begin, kz_byte_t * end) {
+  K->getbegin = begin;
+  K->getptr   = begin;
+  K->getend   = end;
+
+  /* kz_getbatchentry() starts from the beginning */
+  K->batch_getptr = NULL;
+  K->batch_getend = end;
+}
+
+/* Returns 1 if a frame of the given size has to wait for the next tick's budget, or for the
+ * transport to release a transmit buffer */
+static int link_full(kz_endpoint_t * K, kz_size_t size) {
+  /* a frame larger than the budget may always go first */
+  if(K->tx_budget && K->tx_budget_left != K->tx_budget && size + KZ_COBS_OVERHEAD > K->tx_budget_left) {
+    return 1;
+  }
+
+  return !tx_buffer_ready(K);
+}
+
+/* Returns 1 if the frame may be sent right away, 0 if it has to wait for credit or room on the link */
+static int may_send(kz_endpoint_t * K, const kz_byte_t * frame, kz_size_t size) {
+  if(is_request(frame[0]) && K->tx_credits == 0) {
+    /* peer can't accept any more requests yet */
+    return 0;
+  }
+
+  return !link_full(K, size);
+}
+
+/* Sends the frame in the tx buffer, charging it against the peer's credit and the tick's budget */
+static void send_frame(kz_endpoint_t * K) {
+  const kz_size_t size = K->putptr - (K->tx_buffer + KZ_TX_HEADER_START) + KZ_COBS_OVERHEAD;
+
+  if(is_request(K->tx_buffer[KZ_TX_HEADER_START]) && K->tx_credits > 0) {
+    K->tx_credits --;
+  }
+
+  if(K->tx_budget) {
+    K->tx_budget_left = size < K->tx_budget_left ? K->tx_budget_left - size : 0;
+  }
+
+  tx_encode_and_send(K);
+}
+
+/* Copies the frame in the tx buffer to the back of the outgoing queue
+ * Returns 1 on success, 0 if there was no room.
+ */
+static int store_frame(kz_endpoint_t * K, kz_byte_t tag) {
+  kz_byte_t * const frame = K->tx_buffer + KZ_TX_HEADER_START;
+  const kz_size_t size = K->putptr - frame;
+
+  if((kz_size_t)(K->queue_buffer_end - K->queue_pos) < size + KZ_QUEUE_ENTRY_HEADER) {
+    /* no room */
+    return 0;
+  }
+
+  /* [ size ] [ priority ] [ h0 ] [ h1 ] [ h2 ] [ h3 ] [ p0 ] ... */
+  *K->queue_pos++ = size;
+  *K->queue_pos++ = tag;
+  memcpy(K->queue_pos, frame, size);
+  K->queue_pos += size;
+
+  return 1;
+}
+
+/* Moves the frame in the tx buffer to the back of the outgoing queue
+ * Returns 1 on success, 0 if there was no room, in which case the frame is left in the tx buffer.
+ */
+static int enqueue_frame(kz_endpoint_t * K, kz_byte_t tag) {
+  if(!store_frame(K, tag)) {
+    return 0;
+  }
+
+  kz_putclear(K);
+
+  return 1;
+}
+
+/* Returns 1 if any queued frame is waiting to be sent */
+static int queue_waiting(kz_endpoint_t * K) {
+  kz_byte_t * entry;
+
+  for(entry = K->queue_buffer ;
+      entry != K->queue_pos ;
+      entry += KZ_QUEUE_ENTRY_HEADER + entry[0]) {
+    if(!(entry[1] & KZ_QUEUE_SENT)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Removes the entry at the given position from the outgoing queue */
+static void dequeue_entry(kz_endpoint_t * K, kz_byte_t * entry) {
+  kz_byte_t * const next = entry + KZ_QUEUE_ENTRY_HEADER + entry[0];
+
+  memmove(entry, next, K->queue_pos - next);
+  K->queue_pos -= next - entry;
+}
+
+/* Removes a local request's frame from the queue, if it hasn't been sent yet or was retained */
+static void dequeue_request(kz_endpoint_t * K, kz_byte_t reqid) {
+  kz_byte_t * entry;
+  kz_byte_t * frame;
+
+  for(entry = K->queue_buffer ;
+      entry != K->queue_pos ;
+      entry += KZ_QUEUE_ENTRY_HEADER + entry[0]) {
+    frame = entry + KZ_QUEUE_ENTRY_HEADER;
+
+    if(is_request(frame[0]) && frame[1] == reqid) {
+      dequeue_entry(K, entry);
+      return;
+    }
+  }
+}
+
+/* Queues a retained request frame to be sent again, if it has already been sent */
+static void requeue_request(kz_endpoint_t * K, kz_byte_t reqid) {
+  kz_byte_t * entry;
+  kz_byte_t * frame;
+
+  for(entry = K->queue_buffer ;
+      entry != K->queue_pos ;
+      entry += KZ_QUEUE_ENTRY_HEADER + entry[0]) {
+    frame = entry + KZ_QUEUE_ENTRY_HEADER;
+
+    if(is_request(frame[0]) && frame[1] == reqid) {
+      entry[1] &= ~KZ_QUEUE_SENT;
+      return;
+    }
+  }
+}
+
+/* Sends queued frames, highest priority first, for as long as credit and the tick's budget allow.
+ * Within a priority, frames are sent in the order they were queued. Requests which are waiting for
+ * credit don't hold up replies.
+ */
+static void drain_queue(kz_endpoint_t * K) {
+  kz_byte_t * frame;
+  kz_byte_t * entry;
+  unsigned int priority;
+
+  for(priority = 0 ; priority < KZ_PRIORITY_LEVELS ; priority ++) {
+    entry = K->queue_buffer;
+
+    while(entry != K->queue_pos) {
+      if((entry[1] & (KZ_QUEUE_SENT | KZ_QUEUE_PRIORITY_MASK)) == priority) {
+        if(link_full(K, entry[0])) {
+          /* nothing else goes ahead of it this tick */
+          return;
+        }
+
+        if(may_send(K, entry + KZ_QUEUE_ENTRY_HEADER, entry[0])) {
+          /* sending the last frame may have moved on to another buffer */
+          frame = K->tx_buffer + KZ_TX_HEADER_START;
+          memcpy(frame, entry + KZ_QUEUE_ENTRY_HEADER, entry[0]);
+          K->putptr = frame + entry[0];
+
+          if(entry[1] & KZ_QUEUE_RETAIN) {
+            /* keep it until it has been answered */
+            entry[1] |= KZ_QUEUE_SENT;
+            entry += KZ_QUEUE_ENTRY_HEADER + entry[0];
+          } else {
+            /* the next entry moves into this position */
+            dequeue_entry(K, entry);
+          }
+
+          send_frame(K);
+          continue;
+        }
+      }
+
+      entry += KZ_QUEUE_ENTRY_HEADER + entry[0];
+    }
+  }
+}
+
+/* Sends the frame in the tx buffer, unless it has to wait behind queued frames of the same or a
+ * higher priority, for credit, or for room on the link. If tagged with KZ_QUEUE_RETAIN, a copy is
+ * kept in the queue (room permitting) so that it may be sent again.
+ * Returns 1 if the frame was sent or queued, 0 if it had to wait but there was no room in the
+ * queue, in which case the frame is left in the tx buffer.
+ */
+static int transmit(kz_endpoint_t * K, kz_byte_t tag) {
+  kz_byte_t * const frame = K->tx_buffer + KZ_TX_HEADER_START;
+
+  if(!queue_waiting(K) && may_send(K, frame, K->putptr - frame)) {
+    /* nothing in the way */
+    if(tag & KZ_QUEUE_RETAIN) {
+      /* if there's no room, it simply won't be sent again */
+      store_frame(K, tag | KZ_QUEUE_SENT);
+    }
+
+    send_frame(K);
+    return 1;
+  }
+
+  if(!enqueue_frame(K, tag)) {
+    return 0;
+  }
+
+  /* this frame may still be able to go ahead of others */
+  drain_queue(K);
+
+  return 1;
+}
+
+static void send_reply(kz_endpoint_t * K, kz_byte_t header, kz_byte_t reqid, kz_request_status_t stat, kz_byte_t priority) {
+  /* these bytes are reserved for the header */
+  K->tx_buffer[1] = header;
+  K->tx_buffer[2] = reqid;
+  K->tx_buffer[3] = stat;
+  K->tx_buffer[4] = 0x00;
+
+  if(!transmit(K, priority)) {
+    if(tx_buffer_ready(K)) {
+      /* replies aren't worth dropping, send it regardless */
+      send_frame(K);
+    } else {
+      /* but it can't be given to the transport without a buffer to move on to, nor queued */
+      K->tx_dropped ++;
+      kz_putclear(K);
+    }
+  }
+}
+
+/* Sends a credit frame at once
+ * Returns 1 if it was sent, 0 if there was no transmit buffer to move on to, in which case it is
+ * to be sent on a later tick.
+ */
+static int send_credit(kz_endpoint_t * K, unsigned int grant, kz_byte_t flags) {
+  if(!tx_buffer_ready(K)) {
+    return 0;
+  }
+
+  /* nothing may be built at this point, but make sure none of it goes out with the credit */
+  K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START;
+
+  if(flags & KZ_CREDIT_RESET) {
+    /* advertise the largest request payload we can receive */
+    kz_putint(K, K->rx_buffer_size - KZ_HEADER_SIZE);
+  }
+
+  /* these bytes are reserved for the header */
+  K->tx_buffer[1] = KZ_HEADER_CREDIT;
+  K->tx_buffer[2] = grant > 0xFF ? 0xFF : grant;
+  K->tx_buffer[3] = flags;
+  K->tx_buffer[4] = 0x00;
+
+  /* credit is always sent immediately */
+  tx_encode_and_send(K);
+
+  return 1;
+}
+
+/* Sends the request in the tx buffer, or queues it if it has to wait (see transmit())
+ * Returns 1 if the request was sent or queued, 0 if it had to be discarded.
+ */
+static int send_request(kz_endpoint_t * K, kz_byte_t header, kz_byte_t reqid, kz_byte_t channelid, kz_byte_t tag) {
+  const kz_size_t payload_size = K->putptr - (K->tx_buffer + KZ_TX_PAYLOAD_START);
+
+  if(payload_size > K->tx_payload_max) {
+    /* the peer would never be able to receive this */
+    kz_putclear(K);
+    return 0;
+  }
+
+  /* these bytes are reserved for the header */
+  K->tx_buffer[1] = header;
+  K->tx_buffer[2] = reqid;
+  K->tx_buffer[3] = channelid;
+  K->tx_buffer[4] = 0x00;
+
+  if(!transmit(K, tag)) {
+    kz_putclear(K);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Returns the handler of the given channel, whose callback is NULL if it has none */
+static kz_request_handler_t channel_handler(kz_endpoint_t * K, unsigned int channelid) {
+  kz_request_handler_t handler;
+
+#if KZ_COMPACT
+  handler.callback = K->channels[channelid].handler;
+  handler.userdata = K->userdata_table[K->channels[channelid].userdata_index];
+#else
+  handler = K->channels[channelid].handler;
+#endif
+
+  return handler;
+}
+
+static void handle_request(kz_endpoint_t * K, unsigned int reqid, unsigned int channelid) {
+  const unsigned int max_channels = K->channel_count;
+
+  kz_request_handler_t  handler;
+  kz_request_status_t   status;
+
+  if(channelid < max_channels) {
+    /* find a associated handler for this request */
+    handler = channel_handler(K, channelid);
+
+    if(handler.callback) {
+      /* get ready to read */
+      set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer_pos);
+
+      /* allow the handler to defer its reply */
+      K->deferred          = NULL;
+      K->handling_id       = reqid;
+      K->handling_priority = K->channels[channelid].priority;
+      K->handling          = 1;
+
+      /* call the handler */
+      status = handler.callback(K, handler.userdata);
+
+      K->handling = 0;
+
+      /* a reply set aside, and left there, is the one to send */
+      kz_putrestore(K);
+
+      if(status == KZ_DEFER) {
+        /* handler will reply via kz_reply(), if it reserved a slot using kz_defer() */
+        kz_putclear(K);
+      } else {
+        if(K->deferred) {
+          /* handler replied immediately after all, release its slot */
+          K->deferred->active = 0;
+        }
+
+        if(status != KZ_IGNORE) {
+          send_reply(K, KZ_HEADER_REPLY, reqid, status, K->handling_priority);
+        }
+      }
+
+      K->deferred = NULL;
+    }
+  }
+
+  /* ignore this request, its channelid has no handler */
+}
+
+static void handle_batch(kz_endpoint_t * K, unsigned int reqid, unsigned int count) {
+  const unsigned int max_channels = K->channel_count;
+
+  kz_byte_t * const payload_end = K->rx_buffer_pos;
+  kz_byte_t * const putend = K->tx_buffer_end - 1;
+
+  kz_request_handler_t  handler;
+  kz_request_status_t   status;
+  kz_byte_t *           entry;
+  kz_byte_t *           args_end;
+  kz_byte_t *           results;
+  kz_byte_t             priority;
+  unsigned int          channelid;
+
+  /* the reply is as urgent as the most urgent call */
+  priority = KZ_PRIORITY_LEVELS - 1;
+
+  entry = K->rx_buffer + KZ_RX_PAYLOAD_START;
+
+  for( ; count > 0 ; count --) {
+    /* [ CHANID ] [ LEN ] [ a0 ] [ a1 ] ... */
+    if(payload_end - entry < 2 || payload_end - (entry + 2) < entry[1]) {
+      /* malformed, reply to what has been handled so far */
+      break;
+    }
+
+    if(putend - K->putptr < 2) {
+      /* no room for another result */
+      break;
+    }
+
+    channelid = entry[0];
+    args_end = entry + 2 + entry[1];
+
+    /* get ready to read this call's arguments */
+    set_getrange(K, entry + 2, args_end);
+
+    /* leave room for [ STATUS ] [ LEN ] */
+    results = K->putptr + 2;
+    K->putptr = results;
+
+    status = KZ_IGNORE;
+
+    if(channelid < max_channels) {
+      handler = channel_handler(K, channelid);
+
+      if(handler.callback) {
+        /* called outside of K->handling, so the handler can't defer */
+        status = handler.callback(K, handler.userdata);
+        kz_putrestore(K);
+
+        if(K->channels[channelid].priority < priority) {
+          priority = K->channels[channelid].priority;
+        }
+      }
+    }
+
+    if(status != KZ_OK) {
+      /* only keep the results of successful calls */
+      K->putptr = results;
+    }
+
+    results[-2] = status;
+    results[-1] = K->putptr - results;
+
+    entry = args_end;
+  }
+
+  send_reply(K, KZ_HEADER_REPLY, reqid, KZ_OK, priority);
+}
+
+static void handle_subscribe(kz_endpoint_t * K, unsigned int reqid, unsigned int channelid) {
+  const unsigned int max_channels = K->channel_count;
+
+#if KZ_MAX_SUBSCRIPTIONS
+  kz_subscription_t * sub;
+  kz_subscription_t * subscriptions_end;
+#endif
+  kz_byte_t priority;
+  kz_int_t mode;
+  kz_int_t period;
+
+  set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer_pos);
+
+  if(channelid >= max_channels || !channel_handler(K, channelid).callback ||
+     !kz_getint(K, &mode) || (mode != KZ_SUBSCRIBE_PERIODIC && mode != KZ_SUBSCRIBE_ONCHANGE) ||
+     !kz_getint(K, &period) || period <= 0 || period > KZ_MAX_TICKS) {
+    /* nothing to subscribe to */
+    send_reply(K, KZ_HEADER_REPLY, reqid, KZ_INVALID, KZ_PRIORITY_DEFAULT);
+    return;
+  }
+
+  priority = K->channels[channelid].priority;
+
+#if KZ_MAX_SUBSCRIPTIONS
+  subscriptions_end = K->subscriptions + KZ_MAX_SUBSCRIPTIONS;
+
+  /* find unused subscription object in table */
+  for(sub = K->subscriptions ;
+      sub != subscriptions_end ;
+      sub ++) {
+    if(!sub->mode) {
+      sub->foreign_id   = reqid;
+      sub->channelid    = channelid;
+      sub->mode         = mode;
+      sub->period_ticks = period;
+      sub->countdown    = 1;
+      sub->checksum     = 0;
+      sub->sent         = 0;
+      return;
+    }
+  }
+#endif
+
+  /* table full */
+  send_reply(K, KZ_HEADER_REPLY, reqid, KZ_BUSY, priority);
+}
+
+static void handle_unsubscribe(kz_endpoint_t * K, unsigned int reqid) {
+  kz_byte_t priority = KZ_PRIORITY_DEFAULT;
+
+#if KZ_MAX_SUBSCRIPTIONS
+  kz_subscription_t * sub;
+  kz_subscription_t * subscriptions_end;
+
+  subscriptions_end = K->subscriptions + KZ_MAX_SUBSCRIPTIONS;
+
+  for(sub = K->subscriptions ;
+      sub != subscriptions_end ;
+      sub ++) {
+    if(sub->mode && sub->foreign_id == reqid) {
+      priority = K->channels[sub->channelid].priority;
+      sub->mode = 0;
+    }
+  }
+#endif
+
+  /* end the stream, even if there was no such subscription */
+  send_reply(K, KZ_HEADER_REPLY, reqid, KZ_OK, priority);
+}
+
+/* Calls the handlers of subscriptions which are due, and sends their results */
+static void step_subscriptions(kz_endpoint_t * K) {
+#if KZ_MAX_SUBSCRIPTIONS
+  kz_subscription_t * sub;
+  kz_subscription_t * subscriptions_end;
+  kz_request_handler_t handler;
+  kz_request_status_t status;
+  kz_byte_t * results;
+  uint32_t checksum;
+
+  subscriptions_end = K->subscriptions + KZ_MAX_SUBSCRIPTIONS;
+
+  for(sub = K->subscriptions ;
+      sub != subscriptions_end ;
+      sub ++) {
+    if(sub->mode && --sub->countdown == 0) {
+      sub->countdown = sub->period_ticks;
+
+      handler = channel_handler(K, sub->channelid);
+
+      if(!handler.callback) {
+        /* handler has since been removed */
+        continue;
+      }
+
+      /* nothing to read */
+      set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer + KZ_RX_PAYLOAD_START);
+
+      results = K->putptr;
+
+      /* called outside of K->handling, so the handler can't defer */
+      status = handler.callback(K, handler.userdata);
+      kz_putrestore(K);
+
+      if(status != KZ_OK) {
+        kz_putclear(K);
+        continue;
+      }
+
+      if(sub->mode == KZ_SUBSCRIBE_ONCHANGE) {
+        checksum = hash_bytes(KZ_HASH_INIT, results, K->putptr - results);
+
+        if(sub->sent && checksum == sub->checksum) {
+          /* no change */
+          kz_putclear(K);
+          continue;
+        }
+
+        sub->checksum = checksum;
+      }
+
+      sub->sent = 1;
+
+      send_reply(K, KZ_HEADER_REPLYPART, sub->foreign_id, KZ_MORE, K->channels[sub->channelid].priority);
+    }
+  }
+#endif
+}
+
+/* Finds an unused local request object in the pool, and allocates it for an outgoing request */
+static kz_local_request_t * alloc_local_request(kz_endpoint_t * K, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks) {
+  const unsigned int max_local_requests = K->local_request_count;
+
+  kz_local_request_t * req;
+  kz_local_request_t * local_requests_end;
+
+  local_requests_end = K->local_requests + max_local_requests;
+
+  for(req = K->local_requests ;
+      req != local_requests_end ;
+      req ++) {
+    /* check handler field to determine whether this object is in use */
+    if(!req->callback) {
+      req->callback          = callback;
+      req->userdata          = userdata;
+      req->timeout_ticks     = timeout_ticks;
+      req->timeout_period    = timeout_ticks;
+      req->retransmits_left  = 0;
+      req->retransmit_period = 0;
+      req->shared            = 0;
+      req->leader            = NULL;
+      return req;
+    }
+  }
+
+  return NULL;
+}
+
+static void free_local_request(kz_endpoint_t * K, kz_local_request_t * req) {
+  const unsigned int max_local_requests = K->local_request_count;
+
+  unsigned int reqid;
+
+  req->callback          = NULL;
+  req->userdata          = NULL;
+  req->timeout_ticks     = 0;
+  req->retransmits_left  = 0;
+  req->retransmit_period = 0;
+  req->shared            = 0;
+  req->leader            = NULL;
+
+  /* a late reply to this request mustn't be taken for that of the next one to use this object */
+  reqid = req->reqid + max_local_requests;
+  req->reqid = reqid < 0xFF ? reqid : reqid % max_local_requests;
+}
+
+/* Finds the active local request with the given reqid, if any */
+static kz_local_request_t * find_local_request(kz_endpoint_t * K, unsigned int reqid) {
+  /* the low part of a reqid indexes into local_requests */
+  kz_local_request_t * req;
+
+  if(!K->local_request_count) {
+    return NULL;
+  }
+
+  req = K->local_requests + reqid % K->local_request_count;
+
+  if(req->callback && req->reqid == reqid) {
+    return req;
+  }
+
+  return NULL;
+}
+
+/* Finds a call waiting for its reply which identical calls may share */
+static kz_local_request_t * find_shared_request(kz_endpoint_t * K, uint32_t key) {
+  const unsigned int max_local_requests = K->local_request_count;
+
+  kz_local_request_t * req;
+  kz_local_request_t * local_requests_end;
+
+  local_requests_end = K->local_requests + max_local_requests;
+
+  for(req = K->local_requests ;
+      req != local_requests_end ;
+      req ++) {
+    if(req->callback && req->shared && req->key == key) {
+      return req;
+    }
+  }
+
+  return NULL;
+}
+
+/* Passes the reply, or a part of it, to the calls sharing the given one. The reply is read from
+ * the get range, which starts over for each. */
+static void complete_waiters(kz_endpoint_t * K, kz_local_request_t * leader, kz_request_status_t status) {
+  const unsigned int max_local_requests = K->local_request_count;
+
+  kz_byte_t * const getbegin = K->getbegin;
+  kz_byte_t * const getend   = K->getend;
+
+  kz_local_request_t * req;
+  kz_local_request_t * local_requests_end;
+
+  local_requests_end = K->local_requests + max_local_requests;
+
+  for(req = K->local_requests ;
+      req != local_requests_end ;
+      req ++) {
+    if(req->callback && req->leader == leader) {
+      set_getrange(K, getbegin, getend);
+
+      if(status == KZ_MORE) {
+        req->timeout_ticks = req->timeout_period;
+
+        req->callback(K, req->userdata, KZ_MORE);
+      } else {
+        req->callback(K, req->userdata, status);
+
+        free_local_request(K, req);
+      }
+    }
+  }
+}
+
+#if KZ_MAX_CACHE_ENTRIES
+/* Finds an unexpired cached reply to a call with the given channel and arguments */
+static kz_cache_entry_t * find_cache_entry(kz_endpoint_t * K, unsigned int channelid, const kz_byte_t * args, kz_size_t args_size) {
+  kz_cache_entry_t * entry;
+  kz_cache_entry_t * cache_end;
+
+  cache_end = K->cache + KZ_MAX_CACHE_ENTRIES;
+
+  for(entry = K->cache ;
+      entry != cache_end ;
+      entry ++) {
+    if(!entry->pending && entry->ttl_ticks > 0 &&
+       entry->channelid == channelid && entry->args_size == args_size &&
+       memcmp(entry->data, args, args_size) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/* Finds a cache entry to hold the reply to a call, reusing the one closest to expiry if none is
+ * free. Returns NULL if all are pending. */
+static kz_cache_entry_t * alloc_cache_entry(kz_endpoint_t * K) {
+  kz_cache_entry_t * entry;
+  kz_cache_entry_t * cache_end;
+  kz_cache_entry_t * oldest = NULL;
+
+  cache_end = K->cache + KZ_MAX_CACHE_ENTRIES;
+
+  for(entry = K->cache ;
+      entry != cache_end ;
+      entry ++) {
+    if(!entry->pending) {
+      if(entry->ttl_ticks <= 0) {
+        return entry;
+      }
+
+      if(!oldest || entry->ttl_ticks < oldest->ttl_ticks) {
+        oldest = entry;
+      }
+    }
+  }
+
+  return oldest;
+}
+
+/* Keeps the reply to the given request in its pending cache entry, if it has one and the reply
+ * is worth keeping, otherwise frees the entry. The reply is read from the get range. */
+static void settle_cache_entry(kz_endpoint_t * K, unsigned int reqid, kz_request_status_t status) {
+  const kz_size_t results_size = K->getend - K->getbegin;
+
+  kz_cache_entry_t * entry;
+  kz_cache_entry_t * cache_end;
+
+  cache_end = K->cache + KZ_MAX_CACHE_ENTRIES;
+
+  for(entry = K->cache ;
+      entry != cache_end ;
+      entry ++) {
+    if(entry->pending && entry->reqid == reqid) {
+      entry->pending   = 0;
+      entry->ttl_ticks = 0;
+
+      if(status == KZ_OK && entry->args_size + results_size <= KZ_CACHE_ENTRY_SIZE) {
+        memcpy(entry->data + entry->args_size, K->getbegin, results_size);
+        entry->results_size = results_size;
+        entry->ttl_ticks    = K->channels[entry->channelid].cache_ttl;
+      }
+
+      return;
+    }
+  }
+}
+
+/* Expires cached replies */
+static void step_cache(kz_endpoint_t * K) {
+  kz_cache_entry_t * entry;
+  kz_cache_entry_t * cache_end;
+
+  cache_end = K->cache + KZ_MAX_CACHE_ENTRIES;
+
+  for(entry = K->cache ;
+      entry != cache_end ;
+      entry ++) {
+    if(!entry->pending && entry->ttl_ticks > 0) {
+      entry->ttl_ticks --;
+    }
+  }
+}
+#else
+/* without a cache, no channel is given a TTL (see kz_cache()) and nothing is kept */
+static kz_cache_entry_t * find_cache_entry(kz_endpoint_t * K, unsigned int channelid, const kz_byte_t * args, kz_size_t args_size) {
+  return NULL;
+}
+
+static kz_cache_entry_t * alloc_cache_entry(kz_endpoint_t * K) {
+  return NULL;
+}
+
+static void settle_cache_entry(kz_endpoint_t * K, unsigned int reqid, kz_request_status_t status) {
+}
+
+static void step_cache(kz_endpoint_t * K) {
+}
+#endif
+
+static void handle_reply(kz_endpoint_t * K, unsigned int reqid, kz_request_status_t status, char final) {
+  kz_local_request_t * req;
+
+  /* find associated request, if it is still active */
+  req = find_local_request(K, reqid);
+
+  if(req) {
+    if(req->retransmit_period) {
+      /* it arrived, no need to keep it any longer */
+      dequeue_request(K, reqid);
+      req->retransmits_left  = 0;
+      req->retransmit_period = 0;
+    }
+
+    /* get ready to read */
+    set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer_pos);
+
+    /* streamed replies aren't cached */
+    settle_cache_entry(K, reqid, final ? status : KZ_MORE);
+
+    if(final) {
+      /* calls made from here on can't share this reply */
+      req->shared = 0;
+
+      /* active, call its handler */
+      req->callback(K, req->userdata, status);
+
+      complete_waiters(K, req, status);
+
+      free_local_request(K, req);
+    } else {
+      /* more to come, give it as long again for the next part */
+      req->timeout_ticks = req->timeout_period;
+
+      req->callback(K, req->userdata, KZ_MORE);
+
+      complete_waiters(K, req, KZ_MORE);
+    }
+  }
+}
+
+static void handle_timeouts(kz_endpoint_t * K) {
+  const unsigned int max_local_requests = K->local_request_count;
+
+  kz_local_request_t * req;
+  kz_local_request_t * local_requests_end;
+  char retransmit = 0;
+
+  local_requests_end = K->local_requests + max_local_requests;
+
+  /* decrement timeout for all local requests */
+  for(req = K->local_requests ;
+      req != local_requests_end ;
+      req ++) {
+    if(req->callback && req->retransmits_left) {
+      /* this request is idempotent, and hasn't been answered yet */
+      req->retransmit_ticks --;
+
+      if(req->retransmit_ticks <= 0) {
+        /* perhaps the request or its reply was lost, try again */
+        requeue_request(K, req->reqid);
+        retransmit = 1;
+
+        req->retransmits_left --;
+        req->retransmit_period = req->retransmit_period <= KZ_MAX_TICKS / 2 ? req->retransmit_period * 2 : KZ_MAX_TICKS;
+        req->retransmit_ticks = req->retransmit_period;
+      }
+    }
+
+    if(req->callback && req->timeout_period != KZ_NO_TIMEOUT) {
+      /* this request is active */
+      req->timeout_ticks --;
+
+      if(req->timeout_ticks <= 0) {
+        /* don't send the request if it is still waiting for credit, or was kept to be sent again */
+        dequeue_request(K, req->reqid);
+
+        if(K->tx_credits >= 0) {
+          /* the request, or the credit for it, may have been lost, along with the peer's credit */
+          K->credit_query |= KZ_CREDIT_QUERY;
+        }
+
+        /* get ready to read nothing */
+        set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer + KZ_RX_PAYLOAD_START);
+
+        settle_cache_entry(K, req->reqid, KZ_IGNORE);
+
+        req->shared = 0;
+
+        /* timed out, give it the ignore signal */
+        req->callback(K, req->userdata, KZ_IGNORE);
+
+        /* as well as any calls which were sharing its reply */
+        complete_waiters(K, req, KZ_IGNORE);
+
+        free_local_request(K, req);
+      }
+    }
+  }
+
+  if(retransmit) {
+    /* don't wait for the next tick */
+    drain_queue(K);
+  }
+}
+
+static void handle_credit(kz_endpoint_t * K, unsigned int grant, kz_byte_t flags) {
+  kz_int_t payload_max;
+
+  if(flags & KZ_CREDIT_RESET) {
+    /* peer (re)started, or answered our query */
+    set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer_pos);
+
+    if(kz_getint(K, &payload_max) && payload_max >= 0) {
+      K->tx_payload_max = payload_max;
+    }
+
+    K->tx_credits = grant;
+  } else if(K->tx_credits >= 0) {
+    K->tx_credits += grant;
+  }
+
+  if((flags & KZ_CREDIT_QUERY) && K->rx_window) {
+    /* tell the peer what we can accept, which it needn't be told again on our first tick */
+    K->rx_credit_owed = 0;
+
+    if(send_credit(K, K->rx_window, KZ_CREDIT_RESET)) {
+      K->credit_query &= ~KZ_CREDIT_RESET;
+    } else {
+      /* on the next tick, then */
+      K->credit_query |= KZ_CREDIT_RESET;
+    }
+  }
+}
+
+/* Sends the credit frame which is due, if any, and queries the peer's credit when it has been used
+ * up for too long */
+static void step_credit(kz_endpoint_t * K) {
+  if(K->address && !(K->address & 0x80)) {
+    /* a node on a bus only speaks when spoken to */
+    K->credit_query = 0;
+    return;
+  }
+
+  if(K->tx_credits == 0) {
+    K->credit_dry_ticks ++;
+
+    if(K->credit_dry_ticks >= KZ_CREDIT_QUERY_TICKS) {
+      /* perhaps credit was returned, but lost on the way */
+      K->credit_query |= KZ_CREDIT_QUERY;
+    }
+  } else {
+    K->credit_dry_ticks = 0;
+  }
+
+  if(K->credit_query) {
+    if(K->credit_query & KZ_CREDIT_RESET) {
+      /* the peer is given our whole window */
+      if(!send_credit(K, K->rx_window, K->credit_query)) {
+        return;
+      }
+
+      K->rx_credit_owed = 0;
+    } else if(!send_credit(K, 0, K->credit_query)) {
+      return;
+    }
+
+    K->credit_query     = 0;
+    K->credit_dry_ticks = 0;
+  }
+}
+
+static void step_tasks(kz_endpoint_t * K) {
+#if KZ_MAX_TASKS
+  kz_task_t * task;
+  kz_task_t * tasks_end;
+
+  tasks_end = K->tasks + KZ_MAX_TASKS;
+
+  for(task = K->tasks ;
+      task != tasks_end ;
+      task ++) {
+    if(task->fn) {
+      /* this task is active */
+      if(task->wait_ticks > 0) {
+        task->wait_ticks --;
+      }
+
+      if(task->wait_ticks == 0 || (task->wait_frame && K->frame_received)) {
+        /* time to wake up */
+        if(task->fn(K, task) == KZ_TASK_DONE) {
+          task->fn       = NULL;
+          task->userdata = NULL;
+          task->request  = NULL;
+        }
+      }
+    }
+  }
+#endif
+
+  K->frame_received = 0;
+}
+
+/* Relays a reply to a forwarded request back to the peer of the endpoint it came from */
+static void forward_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_endpoint_t * const upstream = userdata;
+  kz_byte_t * const results = upstream->tx_buffer + KZ_TX_PAYLOAD_START;
+  const kz_size_t size = K->getend - K->getbegin;
+
+  kz_local_request_t * req;
+
+  if(status == KZ_IGNORE) {
+    /* timed out, let the caller time out too */
+    return;
+  }
+
+  /* the reply being handled is still in the receive buffer */
+  req = find_local_request(K, K->rx_buffer[1]);
+
+  if(!req) {
+    return;
+  }
+
+  if(upstream->putptr != results) {
+    /* a frame is being built there, which mustn't be lost: lose the reply instead */
+    return;
+  }
+
+  if(size <= (kz_size_t)((upstream->tx_buffer_end - 1) - results)) {
+    memcpy(results, K->getbegin, size);
+    upstream->putptr = results + size;
+  } else {
+    /* doesn't fit upstream */
+    status = KZ_INVALID;
+  }
+
+  /* [0] is the upstream reqid, [1] its priority */
+  send_reply(upstream, status == KZ_MORE ? KZ_HEADER_REPLYPART : KZ_HEADER_REPLY,
+             req->context.bytes[0], status, req->context.bytes[1]);
+}
+
+/* Forwards the request in the receive buffer if its channel is routed elsewhere (see kz_route())
+ * Returns 1 if it was, 0 if it is to be handled here.
+ */
+static int forward_request(kz_endpoint_t * K, unsigned int reqid, unsigned int channelid) {
+  const unsigned int max_channels = K->channel_count;
+
+  kz_byte_t * const args = K->rx_buffer + KZ_RX_PAYLOAD_START;
+  const kz_size_t args_size = K->rx_buffer_pos - args;
+
+  kz_route_t * route = NULL;
+  kz_endpoint_t * D;
+  kz_local_request_t * req = NULL;
+  kz_byte_t priority;
+#if KZ_MAX_ROUTES
+  unsigned int i;
+
+  for(i = 0 ; i < KZ_MAX_ROUTES ; i ++) {
+    if(K->routes[i].downstream &&
+       channelid >= K->routes[i].first_channel && channelid <= K->routes[i].last_channel) {
+      route = K->routes + i;
+      break;
+    }
+  }
+#endif
+
+  if(!route) {
+    return 0;
+  }
+
+  D = route->downstream;
+  priority = channelid < max_channels ? K->channels[channelid].priority : KZ_PRIORITY_DEFAULT;
+
+  if(args_size > D->tx_payload_max || args_size > (kz_size_t)((D->tx_buffer_end - 1) - (D->tx_buffer + KZ_TX_PAYLOAD_START))) {
+    /* the downstream peer would never be able to receive this */
+    if(reqid != 0xFF) {
+      kz_putclear(K);
+      send_reply(K, KZ_HEADER_REPLY, reqid, KZ_INVALID, priority);
+    }
+    return 1;
+  }
+
+  if(D->putptr != D->tx_buffer + KZ_TX_PAYLOAD_START) {
+    /* a frame is being built downstream, which mustn't be lost */
+    if(reqid != 0xFF) {
+      kz_putclear(K);
+      send_reply(K, KZ_HEADER_REPLY, reqid, KZ_BUSY, priority);
+    }
+    return 1;
+  }
+
+  if(reqid != 0xFF) {
+    /* expects a reply, which will find its way back through this request */
+    req = alloc_local_request(D, forward_reply, K, route->timeout_ticks);
+
+    if(!req) {
+      kz_putclear(K);
+      send_reply(K, KZ_HEADER_REPLY, reqid, KZ_BUSY, priority);
+      return 1;
+    }
+
+    req->context.bytes[0] = reqid;
+    req->context.bytes[1] = priority;
+  }
+
+  memcpy(D->tx_buffer + KZ_TX_PAYLOAD_START, args, args_size);
+  D->putptr = D->tx_buffer + KZ_TX_PAYLOAD_START + args_size;
+
+  if(!send_request(D, KZ_HEADER_REQUEST, req ? req->reqid : 0xFF,
+                   channelid - route->first_channel + route->downstream_channel, priority)) {
+    if(req) {
+      free_local_request(D, req);
+      kz_putclear(K);
+      send_reply(K, KZ_HEADER_REPLY, reqid, KZ_BUSY, priority);
+    }
+  }
+
+  return 1;
+}
+
+/* Dispatches the frame contained in the receive buffer */
+static void handle_frame(kz_endpoint_t * K) {
+  kz_byte_t reqid;
+  kz_byte_t channelid;
+
+  size_t size = K->rx_buffer_pos - K->rx_buffer;
+  kz_byte_t * const frame = K->rx_buffer;
+
+  if(K->address && (size < KZ_HEADER_SIZE || frame[KZ_HEADER_ADDRESS] != K->address)) {
+    /* for another node, which a datagram endpoint only finds out here */
+    return;
+  }
+
+  /* wake any tasks waiting on a frame */
+  K->frame_received = 1;
+
+  if(size >= KZ_HEADER_SIZE) {
+    if(is_request(frame[0]) && K->rx_window) {
+      /* will be returned at the end of this tick */
+      K->rx_credit_owed ++;
+    }
+
+    switch(frame[0]) {
+      case KZ_HEADER_REQUEST:
+        reqid = frame[1];
+        channelid = frame[2];
+        if(!forward_request(K, reqid, channelid)) {
+          handle_request(K, reqid, channelid);
+        }
+        break;
+
+      case KZ_HEADER_BATCH:
+        reqid = frame[1];
+        handle_batch(K, reqid, frame[2]);
+        break;
+
+      case KZ_HEADER_SUBSCRIBE:
+        reqid = frame[1];
+        channelid = frame[2];
+        handle_subscribe(K, reqid, channelid);
+        break;
+
+      case KZ_HEADER_UNSUBSCRIBE:
+        reqid = frame[1];
+        handle_unsubscribe(K, reqid);
+        break;
+
+      case KZ_HEADER_REPLY:
+        reqid = frame[1];
+        handle_reply(K, reqid, (kz_request_status_t)frame[2], 1);
+        break;
+
+      case KZ_HEADER_REPLYPART:
+        reqid = frame[1];
+        handle_reply(K, reqid, KZ_MORE, 0);
+        break;
+
+      case KZ_HEADER_CREDIT:
+        handle_credit(K, frame[1], frame[2]);
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+void kz_init_static(kz_endpoint_t * K, const kz_endpointdef_t * def) {
+  unsigned int i;
+
+  /* Initialize RX buffer */
+  K->rx_buffer     = def->rx_buffer;
+  K->rx_buffer_pos = def->rx_buffer;
+  K->rx_buffer_end = def->rx_buffer + def->rx_buffer_size;
+  K->rx_buffer_size = def->rx_buffer_size;
+
+  /* Initialize TX buffers */
+  KZ_ASSERT(def->tx_buffer_count <= KZ_MAX_TX_BUFFERS);
+  /* a frame held by the transport leaves nowhere to build the next one, which waits in the queue
+   * until a buffer is released */
+  KZ_ASSERT(!def->tx_async || (def->tx_buffer_count >= 2 && def->queue_buffer));
+  K->tx_pool        = def->tx_buffer;
+  K->tx_pool_count  = def->tx_buffer_count > 1 ? def->tx_buffer_count : 1;
+  K->tx_pool_stride = def->tx_buffer_size / K->tx_pool_count;
+  K->tx_async       = def->tx_async;
+  K->aside_putptr   = NULL;
+  K->aside_index    = 0;
+  K->tx_dropped     = 0;
+  memset((char *)K->tx_held, 0, sizeof(K->tx_held));
+  select_tx_buffer(K, 0);
+
+  set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer + KZ_RX_PAYLOAD_START);
+  K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START; /* initialize to beginning of payload */
+
+  K->batch_putptr   = NULL;
+  K->batch_count    = 0;
+  K->batch_priority = KZ_PRIORITY_LEVELS - 1;
+
+  /* Initialize serial rx/tx handlers */
+  K->rx = def->rx;
+  K->tx = def->tx;
+  K->userdata = def->userdata;
+
+  /* Initialize flow control */
+  K->queue_buffer     = def->queue_buffer;
+  K->queue_pos        = def->queue_buffer;
+  K->queue_buffer_end = def->queue_buffer + def->queue_buffer_size;
+
+  K->tx_budget      = def->tx_budget;
+  K->tx_budget_left = def->tx_budget;
+  K->tx_credits     = -1;
+  K->tx_payload_max = KZ_MAX_BUFFER_SIZE;
+  K->rx_window      = def->rx_window;
+  K->rx_credit_owed = 0;
+
+  /* advertise our window, and ask for the peer's, on the first tick */
+  K->credit_query     = def->rx_window ? KZ_CREDIT_RESET | KZ_CREDIT_QUERY : KZ_CREDIT_QUERY;
+  K->credit_dry_ticks = 0;
+
+  K->retransmit_ticks = def->retransmit_ticks;
+
+  /* a datagram endpoint can't be given bytes one at a time */
+  KZ_ASSERT(!def->datagram || !def->rx);
+  K->datagram = def->datagram;
+
+  /* stored in a kz_ticks_t */
+  KZ_ASSERT(def->retransmit_ticks <= KZ_MAX_TICKS);
+
+  /* node 0 would be mistaken for a link with two peers */
+  KZ_ASSERT(!def->address || (def->address & 0x7F));
+  K->address   = def->address;
+  K->tx_enable = def->tx_enable;
+
+  /* Initialize table of channels: no handlers, default priorities, nothing cached */
+  KZ_ASSERT(def->channel_count <= 0x100 && (def->channels || !def->channel_count));
+  K->channels      = def->channels;
+  K->channel_count = def->channel_count;
+
+  for(i = 0 ; i < K->channel_count ; i ++) {
+    memset(K->channels + i, 0, sizeof(K->channels[i]));
+    K->channels[i].priority = KZ_PRIORITY_DEFAULT;
+  }
+#if KZ_COMPACT
+  memset(K->userdata_table, 0, sizeof(K->userdata_table));
+#endif
+
+  /* Initialize pool of local request objects, 0xFF is kept for requests which expect no reply */
+  KZ_ASSERT(def->local_request_count < 0xFF && (def->local_requests || !def->local_request_count));
+  K->local_requests      = def->local_requests;
+  K->local_request_count = def->local_request_count;
+
+  for(i = 0 ; i < K->local_request_count ; i ++) {
+    memset(K->local_requests + i, 0, sizeof(K->local_requests[i]));
+    K->local_requests[i].reqid = i;
+  }
+
+#if KZ_MAX_FOREIGN_REQUESTS
+  /* Initialize pool of deferred foreign request objects */
+  memset(K->foreign_requests, 0, sizeof(K->foreign_requests));
+#endif
+
+#if KZ_MAX_SUBSCRIPTIONS
+  /* Initialize table of subscriptions */
+  memset(K->subscriptions, 0, sizeof(K->subscriptions));
+#endif
+
+#if KZ_MAX_TASKS
+  /* Initialize pool of tasks */
+  memset(K->tasks, 0, sizeof(K->tasks));
+#endif
+  K->frame_received = 0;
+
+#if KZ_MAX_CACHE_ENTRIES
+  /* Initialize cache */
+  memset(K->cache, 0, sizeof(K->cache));
+#endif
+
+#if KZ_MAX_ROUTES
+  /* Initialize routes, every channel is handled here */
+  memset(K->routes, 0, sizeof(K->routes));
+#endif
+
+  K->deferred          = NULL;
+  K->handling_id       = 0;
+  K->handling_priority = KZ_PRIORITY_DEFAULT;
+  K->handling          = 0;
+
+  K->rx_state = KZ_RX_IDLE;
+  K->rx_count = 0;
+}
+
+
+#if KZ_COMPACT
+/* Returns 1 if a channel other than the given one has a handler given the userdata at index */
+static int userdata_in_use(kz_endpoint_t * K, unsigned int index, unsigned int channelid) {
+  const unsigned int max_channels = K->channel_count;
+
+  unsigned int i;
+
+  for(i = 0 ; i < max_channels ; i ++) {
+    if(i != channelid && K->channels[i].handler && K->channels[i].userdata_index == index) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+int kz_handle(kz_endpoint_t * K, unsigned int channelid, kz_request_handler_fn_t callback, void * userdata) {
+  const unsigned int max_channels = K->channel_count;
+
+#if KZ_COMPACT
+  const unsigned int max_userdata = sizeof(K->userdata_table)/sizeof(K->userdata_table[0]);
+
+  unsigned int index = 0;
+  unsigned int i;
+
+  if(channelid >= max_channels) {
+    return 0;
+  }
+
+  if(userdata) {
+    /* share an entry with any other channel given the same userdata */
+    for(i = 1 ; i < max_userdata && !index ; i ++) {
+      if(K->userdata_table[i] == userdata) {
+        index = i;
+      }
+    }
+
+    for(i = 1 ; i < max_userdata && !index ; i ++) {
+      if(!userdata_in_use(K, i, channelid)) {
+        K->userdata_table[i] = userdata;
+        index = i;
+      }
+    }
+
+    if(!index) {
+      /* the table is full */
+      return 0;
+    }
+  }
+
+  K->channels[channelid].handler        = callback;
+  K->channels[channelid].userdata_index = index;
+  return 1;
+#else
+  if(channelid < max_channels) {
+    K->channels[channelid].handler.callback = callback;
+    K->channels[channelid].handler.userdata = userdata;
+    return 1;
+  } else {
+    return 0;
+  }
+#endif
+}
+
+int kz_priority(kz_endpoint_t * K, unsigned int channelid, unsigned int priority) {
+  const unsigned int max_channels = K->channel_count;
+
+  if(channelid < max_channels && priority < KZ_PRIORITY_LEVELS) {
+    K->channels[channelid].priority = priority;
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+int kz_cache(kz_endpoint_t * K, unsigned int channelid, int ttl_ticks) {
+  const unsigned int max_channels = K->channel_count;
+#if KZ_MAX_CACHE_ENTRIES
+  unsigned int i;
+#endif
+
+  if(channelid >= max_channels || ttl_ticks < 0 || ttl_ticks > KZ_MAX_TICKS) {
+    return 0;
+  }
+
+#if KZ_MAX_CACHE_ENTRIES
+  K->channels[channelid].cache_ttl = ttl_ticks;
+
+  /* forget what was kept with the previous TTL, replies on their way are kept with the new one */
+  for(i = 0 ; i < KZ_MAX_CACHE_ENTRIES ; i ++) {
+    if(!K->cache[i].pending && K->cache[i].channelid == channelid) {
+      K->cache[i].ttl_ticks = 0;
+    }
+  }
+
+  return 1;
+#else
+  /* nowhere to keep replies, though a TTL of 0 is already what every channel has */
+  return ttl_ticks == 0;
+#endif
+}
+
+int kz_route(kz_endpoint_t * K, unsigned int first_channel, unsigned int count,
+             kz_endpoint_t * downstream, unsigned int downstream_channel, int timeout_ticks) {
+  kz_route_t * route = NULL;
+#if KZ_MAX_ROUTES
+  unsigned int i;
+
+  for(i = 0 ; i < KZ_MAX_ROUTES ; i ++) {
+    if(K->routes[i].downstream && K->routes[i].first_channel == first_channel) {
+      /* replace this one */
+      route = K->routes + i;
+      break;
+    } else if(!K->routes[i].downstream && !route) {
+      route = K->routes + i;
+    }
+  }
+#endif
+
+  if(!downstream) {
+    if(route && route->downstream && route->first_channel == first_channel) {
+      route->downstream = NULL;
+    }
+    return 1;
+  }
+
+  if(!route || count == 0 || first_channel + count > 0x100 || downstream_channel + count > 0x100 ||
+     timeout_ticks > KZ_MAX_TICKS) {
+    return 0;
+  }
+
+  route->downstream         = downstream;
+  route->timeout_ticks      = timeout_ticks;
+  route->first_channel      = first_channel;
+  route->last_channel       = first_channel + count - 1;
+  route->downstream_channel = downstream_channel;
+
+  return 1;
+}
+
+/* Determines the priority of an outgoing request from the call flags */
+static kz_byte_t call_priority(kz_endpoint_t * K, unsigned int channelid, unsigned int flags) {
+  const unsigned int max_channels = K->channel_count;
+  const unsigned int priority = flags & KZ_CALL_PRIORITY_MASK;
+
+  if(priority) {
+    /* given for this call */
+    return priority - 1 < KZ_PRIORITY_LEVELS ? priority - 1 : KZ_PRIORITY_LEVELS - 1;
+  } else if(channelid < max_channels) {
+    return K->channels[channelid].priority;
+  } else {
+    return KZ_PRIORITY_DEFAULT;
+  }
+}
+
+int kz_call(kz_endpoint_t * K, unsigned int channelid, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks) {
+  return kz_callf(K, channelid, callback, userdata, timeout_ticks, 0);
+}
+
+/* Calls the reply handler with a cached reply, leaving the get range as it was */
+static void call_cached(kz_endpoint_t * K, kz_cache_entry_t * entry, kz_reply_handler_fn_t callback, void * userdata) {
+  kz_byte_t * const getbegin     = K->getbegin;
+  kz_byte_t * const getptr       = K->getptr;
+  kz_byte_t * const getend       = K->getend;
+  kz_byte_t * const batch_getptr = K->batch_getptr;
+  kz_byte_t * const batch_getend = K->batch_getend;
+
+  kz_byte_t * const results = entry->data + entry->args_size;
+
+  set_getrange(K, results, results + entry->results_size);
+
+  callback(K, userdata, KZ_OK);
+
+  K->getbegin     = getbegin;
+  K->getptr       = getptr;
+  K->getend       = getend;
+  K->batch_getptr = batch_getptr;
+  K->batch_getend = batch_getend;
+}
+
+/* keeps a copy of the caller's context, which the reply handler is then given */
+static void copy_context(kz_local_request_t * req, const void * context, kz_size_t context_size) {
+  if(context) {
+    memcpy(req->context.bytes, context, context_size);
+    req->userdata = req->context.bytes;
+  }
+}
+
+static int make_call(kz_endpoint_t * K, unsigned int channelid, kz_reply_handler_fn_t callback, void * userdata,
+                     const void * context, kz_size_t context_size, int timeout_ticks, unsigned int flags) {
+  const unsigned int max_channels = K->channel_count;
+
+  kz_byte_t * const args = K->tx_buffer + KZ_TX_PAYLOAD_START;
+  const kz_size_t args_size = K->putptr - args;
+
+  /* replies on this channel are cached */
+  const char cached = channelid < max_channels && K->channels[channelid].cache_ttl > 0;
+
+  /* identical calls may share a reply */
+  const char shared = cached || (flags & KZ_CALL_IDEMPOTENT);
+
+  kz_local_request_t * req;
+  kz_local_request_t * leader = NULL;
+  kz_cache_entry_t * entry = NULL;
+  kz_call_context_t context_copy;
+  kz_byte_t tag;
+  kz_byte_t channel_byte;
+  uint32_t key = 0;
+
+  if(timeout_ticks > KZ_MAX_TICKS) {
+    /* would wrap around, to a timeout which is shorter or none at all */
+    kz_putclear(K);
+    return 0;
+  }
+
+  if(cached && !(flags & KZ_CALL_NOCACHE)) {
+    entry = find_cache_entry(K, channelid, args, args_size);
+
+    if(entry) {
+      /* no need to ask */
+      kz_putclear(K);
+
+      if(context) {
+        /* the handler may write to its context, but not to the caller's */
+        memcpy(context_copy.bytes, context, context_size);
+        userdata = context_copy.bytes;
+      }
+
+      call_cached(K, entry, callback, userdata);
+      return 1;
+    }
+  }
+
+  if(shared) {
+    channel_byte = channelid;
+    key = hash_bytes(hash_bytes(KZ_HASH_INIT, &channel_byte, 1), args, args_size);
 
-  /* Past-end pointer of TX data */
-  data_end = K->putptr;
+    leader = find_shared_request(K, key);
+  }
 
-  len = 1;
+  if(leader) {
+    /* the same call is already on its way, wait for its reply instead */
+    kz_putclear(K);
 
-  while(search_ptr != data_end) {
-    if(*search_ptr == 0x00) {
-      *len_ptr = len;
-      len_ptr = search_ptr;
-      len = 1;
-    } else {
-      len ++;
+    req = alloc_local_request(K, callback, userdata, timeout_ticks);
+
+    if(!req) {
+      return 0;
     }
-    search_ptr ++;
+
+    copy_context(req, context, context_size);
+    req->leader = leader;
+
+    return 1;
   }
 
-  *len_ptr = len;
-  *search_ptr = 0x00;
-  search_ptr ++;
+  if(cached && args_size <= KZ_CACHE_ENTRY_SIZE) {
+    /* keep the reply once it arrives */
+    entry = alloc_cache_entry(K);
+  }
 
-  /* send all bytes in the newly encoded buffer */
-  K->tx(K->tx_buffer, search_ptr - K->tx_buffer);
-  /* reset write pointer */
-  K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START;
+  req = alloc_local_request(K, callback, userdata, timeout_ticks);
+
+  if(!req) {
+    /* too many requests in flight */
+    kz_putclear(K);
+    return 0;
+  }
+
+  copy_context(req, context, context_size);
+  req->shared = shared;
+  req->key    = key;
+
+  if(entry) {
+    memcpy(entry->data, args, args_size);
+    entry->args_size = args_size;
+    entry->channelid = channelid;
+    entry->reqid     = req->reqid;
+    entry->pending   = 1;
+    entry->ttl_ticks = 0;
+  }
+
+  tag = call_priority(K, channelid, flags);
+
+  if((flags & KZ_CALL_IDEMPOTENT) && K->retransmit_ticks > 0 && K->queue_buffer) {
+    /* keep a copy to send again if the reply is late */
+    tag |= KZ_QUEUE_RETAIN;
+
+    req->retransmits_left  = KZ_MAX_RETRANSMITS;
+    req->retransmit_ticks  = K->retransmit_ticks;
+    req->retransmit_period = K->retransmit_ticks;
+  }
+
+  /* actually send data */
+  if(send_request(K, KZ_HEADER_REQUEST, req->reqid, channelid, tag)) {
+    return 1;
+  }
+
+  /* couldn't be sent or queued */
+  if(entry) {
+    entry->pending = 0;
+  }
+
+  free_local_request(K, req);
+
+  return 0;
 }
 
-static void send_reply(kz_endpoint_t * K, kz_byte_t reqid, kz_request_status_t stat) {
-  /* these bytes are reserved for the header */
-  K->tx_buffer[1] = KZ_HEADER_REPLY;
-  K->tx_buffer[2] = reqid;
-  K->tx_buffer[3] = 0x00;
-  K->tx_buffer[4] = 0x00;
+int kz_callf(kz_endpoint_t * K, unsigned int channelid, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks, unsigned int flags) {
+  int made;
 
-  tx_encode_and_send(K);
+  made = make_call(K, channelid, callback, userdata, NULL, 0, timeout_ticks, flags);
+  kz_putrestore(K);
+
+  return made;
 }
 
-static void send_request(kz_endpoint_t * K, kz_byte_t reqid, kz_byte_t channelid) {
-  /* these bytes are reserved for the header */
-  K->tx_buffer[1] = KZ_HEADER_REQUEST;
-  K->tx_buffer[2] = reqid;
-  K->tx_buffer[3] = channelid;
-  K->tx_buffer[4] = 0x00;
+int kz_callcopy(kz_endpoint_t * K, unsigned int channelid, kz_reply_handler_fn_t callback, const void * context, kz_size_t context_size, int timeout_ticks, unsigned int flags) {
+  int made = 0;
 
-  tx_encode_and_send(K);
+  if(context_size > KZ_CALL_CONTEXT_SIZE) {
+    kz_putclear(K);
+  } else {
+    made = make_call(K, channelid, callback, NULL, context, context_size, timeout_ticks, flags);
+  }
+
+  kz_putrestore(K);
+
+  return made;
 }
 
-static void handle_request(kz_endpoint_t * K, unsigned int reqid, unsigned int channelid) {
-  const unsigned int max_channels = sizeof(K->handlers)/sizeof(K->handlers[0]);
+int kz_subscribe(kz_endpoint_t * K, unsigned int channelid, unsigned int mode, unsigned int period_ticks, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks) {
+  kz_local_request_t * req;
+  kz_byte_t reqid;
 
-  kz_request_handler_t  handler;
-  kz_request_status_t   status;
+  if(timeout_ticks > KZ_MAX_TICKS || period_ticks > KZ_MAX_TICKS) {
+    return -1;
+  }
 
-  if(channelid < max_channels) {
-    /* find a associated handler for this request */
-    handler = K->handlers[channelid];
+  req = alloc_local_request(K, callback, userdata, timeout_ticks);
 
-    if(handler.callback) {
-      /* get ready to read */
-      K->getptr = K->rx_buffer + KZ_RX_PAYLOAD_START;
+  if(!req) {
+    return -1;
+  }
 
-      /* call the handler */
-      status = handler.callback(K, handler.userdata);
+  reqid = req->reqid;
 
-      if(status != KZ_IGNORE) {
-        send_reply(K, reqid, status);
-      }
-    }
+  /* ( mode ) ( period ) */
+  kz_putclear(K);
+  kz_putint(K, mode);
+  kz_putint(K, period_ticks);
+
+  if(send_request(K, KZ_HEADER_SUBSCRIBE, reqid, channelid, call_priority(K, channelid, 0))) {
+    return reqid;
   }
 
-  /* ignore this request, its channelid has no handler */
+  free_local_request(K, req);
+
+  return -1;
 }
 
-static void handle_reply(kz_endpoint_t * K, unsigned int reqid) {
+int kz_unsubscribe(kz_endpoint_t * K, int subscription, int timeout_ticks) {
   kz_local_request_t * req;
 
-  /* reqid happens to index directly into local_requests */
-  const unsigned int max_local_requests = sizeof(K->local_requests)/sizeof(K->local_requests[0]);
-
-  /* verify index is accessible */
-  if(reqid < max_local_requests) {
-    /* find associated request */
-    req = K->local_requests + reqid;
-    /* check to see if this reqid is active */
-    if(req->callback) {
-      /* get ready to read */
-      K->getptr = K->rx_buffer + KZ_RX_PAYLOAD_START;
+  if(subscription < 0 || subscription >= 0xFF || timeout_ticks > KZ_MAX_TICKS) {
+    return 0;
+  }
 
-      /* active, call its handler */
-      /* TODO: pass in status */
-      req->callback(K, req->userdata, KZ_OK);
+  req = find_local_request(K, subscription);
 
-      req->callback      = NULL;
-      req->userdata      = NULL;
-      req->timeout_ticks = 0;
-    }
+  if(!req) {
+    /* already over */
+    return 0;
   }
+
+  /* the subscription ends with the reply to this */
+  req->timeout_ticks  = timeout_ticks;
+  req->timeout_period = timeout_ticks;
+
+  kz_putclear(K);
+
+  return send_request(K, KZ_HEADER_UNSUBSCRIBE, subscription, 0x00, KZ_PRIORITY_DEFAULT);
 }
 
-static void handle_timeouts(kz_endpoint_t * K) {
-  const unsigned int max_local_requests = sizeof(K->local_requests)/sizeof(K->local_requests[0]);
+void kz_send(kz_endpoint_t * K, unsigned int channelid) {
+  /* just send data */
+  send_request(K, KZ_HEADER_REQUEST, 0xFF, channelid, call_priority(K, channelid, 0));
+  kz_putrestore(K);
+}
 
-  kz_local_request_t * req;
-  kz_local_request_t * local_requests_end;
+void kz_batchbegin(kz_endpoint_t * K) {
+  kz_putclear(K);
 
-  local_requests_end = K->local_requests + max_local_requests;
+  K->batch_putptr   = NULL;
+  K->batch_count    = 0;
+  K->batch_priority = KZ_PRIORITY_LEVELS - 1;
+}
 
-  /* decrement timeout for all local requests */
-  for(req = K->local_requests ;
-      req != local_requests_end ;
-      req ++) {
-    if(req->callback) {
-      /* this request is active */
-      req->timeout_ticks --;
+/* Fills in the length of the batch entry being built, if any */
+static void close_batch_entry(kz_endpoint_t * K) {
+  if(K->batch_putptr) {
+    K->batch_putptr[1] = K->putptr - (K->batch_putptr + 2);
+  }
+}
 
-      if(req->timeout_ticks <= 0) {
-        /* get ready to read nothing */
-        K->rx_buffer_pos = K->rx_buffer + KZ_RX_PAYLOAD_START;
-        K->getptr = K->rx_buffer_pos;
+int kz_batchadd(kz_endpoint_t * K, unsigned int channelid) {
+  kz_byte_t * const putend = K->tx_buffer_end - 1;
+  kz_byte_t priority;
 
-        /* timed out, give it the ignore signal */
-        req->callback(K, req->userdata, KZ_IGNORE);
+  close_batch_entry(K);
 
-        req->callback      = NULL;
-        req->userdata      = NULL;
-        req->timeout_ticks = 0;
-      }
-    }
+  if(K->batch_count == 0xFF || putend - K->putptr < 2) {
+    return 0;
+  }
+
+  /* [ CHANID ] [ LEN ], length filled in once the arguments have been placed */
+  K->batch_putptr = K->putptr;
+  *K->putptr++ = channelid;
+  *K->putptr++ = 0;
+
+  K->batch_count ++;
+
+  priority = call_priority(K, channelid, 0);
+  if(priority < K->batch_priority) {
+    K->batch_priority = priority;
   }
+
+  return 1;
 }
 
-void kz_init_static(kz_endpoint_t * K, const kz_endpointdef_t * def) {
-  /* Initialize RX buffer */
-  K->rx_buffer     = def->rx_buffer;
-  K->rx_buffer_pos = def->rx_buffer;
-  K->rx_buffer_end = def->rx_buffer + def->rx_buffer_size;
+int kz_batchcall(kz_endpoint_t * K, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks) {
+  kz_local_request_t * req = NULL;
+  kz_byte_t count;
+  kz_byte_t priority;
+  int made = 0;
 
-  /* Initialize TX buffer */
-  K->tx_buffer     = def->tx_buffer;
-  K->tx_buffer_end = def->tx_buffer + def->tx_buffer_size;
+  close_batch_entry(K);
 
-  K->getptr = def->rx_buffer + KZ_RX_PAYLOAD_START; /* initialize to beginning of payload */
-  K->putptr = def->tx_buffer + KZ_TX_PAYLOAD_START; /* initialize to beginning of payload */
+  count    = K->batch_count;
+  priority = K->batch_priority;
 
-  /* Initialize serial rx/tx handlers */
-  K->rx = def->rx;
-  K->tx = def->tx;
+  K->batch_putptr   = NULL;
+  K->batch_count    = 0;
+  K->batch_priority = KZ_PRIORITY_LEVELS - 1;
+
+  if(count > 0) {
+    req = alloc_local_request(K, callback, userdata, timeout_ticks);
+  }
 
-  /* Initialize list of request handlers */
-  memset(K->handlers, 0, sizeof(K->handlers));
+  if(!req) {
+    /* nothing to call, or too many requests in flight */
+    kz_putclear(K);
+  } else if(send_request(K, KZ_HEADER_BATCH, req->reqid, count, priority)) {
+    made = 1;
+  } else {
+    free_local_request(K, req);
+  }
 
-  /* Initialize pool of local request objects */
-  memset(K->local_requests, 0, sizeof(K->local_requests));
+  kz_putrestore(K);
 
-  K->rx_state = KZ_RX_IDLE;
-  K->rx_count = 0;
+  return made;
 }
 
+/* Counts one endpoint's reply to a fan-out, and completes it after the last one */
+static void fanout_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_fanout_t * const F = userdata;
 
-int kz_handle(kz_endpoint_t * K, unsigned int channelid, kz_request_handler_fn_t callback, void * userdata) {
-  const unsigned int max_channels = sizeof(K->handlers)/sizeof(K->handlers[0]);
+  if(F->reply) {
+    F->reply(K, F->userdata, status);
+  }
 
-  if(channelid < max_channels) {
-    K->handlers[channelid].callback = callback;
-    K->handlers[channelid].userdata = userdata;
-    return 1;
+  if(status == KZ_MORE) {
+    /* not done yet */
+    return;
+  }
+
+  if(status == KZ_OK) {
+    F->replied ++;
   } else {
+    F->failed ++;
+  }
+
+  F->pending --;
+
+  if(F->pending == 0 && !F->calling && F->done) {
+    F->done(F, F->userdata);
+  }
+}
+
+void kz_fanoutinit(kz_fanout_t * F, kz_endpoint_t ** endpoints, unsigned int count,
+                   kz_reply_handler_fn_t callback, kz_fanout_done_fn_t done, void * userdata) {
+  F->endpoints = endpoints;
+  F->count     = count;
+  F->reply     = callback;
+  F->done      = done;
+  F->userdata  = userdata;
+  F->pending   = 0;
+  F->replied   = 0;
+  F->failed    = 0;
+  F->calling   = 0;
+}
+
+int kz_fanoutcall(kz_fanout_t * F, unsigned int channelid, int timeout_ticks) {
+  kz_endpoint_t * first;
+  kz_endpoint_t * K;
+  kz_byte_t * args;
+  kz_size_t args_size;
+  unsigned int made = 0;
+  unsigned int i;
+
+  if(F->count == 0) {
+    return 0;
+  }
+
+  first = F->endpoints[0];
+
+  if(F->pending) {
+    /* still waiting for the last one */
+    kz_putclear(first);
     return 0;
   }
+
+  args      = first->tx_buffer + KZ_TX_PAYLOAD_START;
+  args_size = first->putptr - args;
+
+  F->pending = F->count;
+  F->replied = 0;
+  F->failed  = 0;
+  F->calling = 1;
+
+  /* the first endpoint's arguments are sent last, once they've been copied to the others */
+  for(i = F->count ; i-- > 0 ; ) {
+    K = F->endpoints[i];
+
+    if(K != first) {
+      if(K->putptr != K->tx_buffer + KZ_TX_PAYLOAD_START) {
+        /* a frame is being built there, which mustn't be lost */
+        F->pending --;
+        F->failed ++;
+        continue;
+      }
+
+      if(args_size > (kz_size_t)((K->tx_buffer_end - 1) - (K->tx_buffer + KZ_TX_PAYLOAD_START))) {
+        F->pending --;
+        F->failed ++;
+        continue;
+      }
+
+      memcpy(K->tx_buffer + KZ_TX_PAYLOAD_START, args, args_size);
+      K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START + args_size;
+    }
+
+    if(make_call(K, channelid, fanout_reply, F, NULL, 0, timeout_ticks, 0)) {
+      made ++;
+    } else {
+      F->pending --;
+      F->failed ++;
+    }
+  }
+
+  F->calling = 0;
+
+  if(made && F->pending == 0 && F->done) {
+    /* answered before the calls were all made (e.g. from a cache) */
+    F->done(F, F->userdata);
+  }
+
+  return made;
 }
 
-int kz_call(kz_endpoint_t * K, unsigned int channelid, kz_reply_handler_fn_t callback, void * userdata, int timeout_ticks) {
-  const unsigned int max_local_requests = sizeof(K->local_requests)/sizeof(K->local_requests[0]);
+kz_request_t * kz_defer(kz_endpoint_t * K) {
+#if KZ_MAX_FOREIGN_REQUESTS
+  kz_request_t * req;
+  kz_request_t * foreign_requests_end;
+#endif
 
-  kz_local_request_t * req;
-  kz_local_request_t * local_requests_end;
-  kz_byte_t reqid = 0;
+  if(!K->handling) {
+    /* there is no request to defer */
+    return NULL;
+  }
 
-  local_requests_end = K->local_requests + max_local_requests;
+  if(K->deferred) {
+    /* already deferred by this handler */
+    return K->deferred;
+  }
 
-  /* find unused local request object in pool */
-  for(req = K->local_requests ;
-      req != local_requests_end ;
+#if KZ_MAX_FOREIGN_REQUESTS
+  foreign_requests_end = K->foreign_requests + KZ_MAX_FOREIGN_REQUESTS;
+
+  /* find unused foreign request object in pool */
+  for(req = K->foreign_requests ;
+      req != foreign_requests_end ;
       req ++) {
-    /* check handler field to determine whether this object is in use */
-    if(!req->callback) {
-      /* found unused object, allocate for this outgoing request */
-      req->callback      = callback;
-      req->userdata      = userdata;
-      req->timeout_ticks = timeout_ticks;
+    if(!req->active) {
+      /* found unused object, remember the foreign id for kz_reply() */
+      req->foreign_id = K->handling_id;
+      req->priority   = K->handling_priority;
+      req->active     = 1;
 
-      /* actually send data */
-      send_request(K, reqid, channelid);
+      K->deferred = req;
 
-      return 1;
+      return req;
     }
+  }
+#endif
+
+  /* pool exhausted, the handler should reply with KZ_BUSY */
+  return NULL;
+}
 
-    reqid ++;
+void kz_reply(kz_endpoint_t * K, kz_request_t * req, kz_request_status_t status) {
+  /* only a deferred request may be replied to, and only once */
+  KZ_ASSERT(req->active);
+  KZ_ASSERT(status != KZ_DEFER);
+
+  req->active = 0;
+
+  if(status != KZ_IGNORE) {
+    send_reply(K, KZ_HEADER_REPLY, req->foreign_id, status, req->priority);
+  } else {
+    /* discard anything placed for the reply */
+    kz_putclear(K);
   }
+}
 
-  return 0;
+void kz_replypart(kz_endpoint_t * K, kz_request_t * req) {
+  /* only a deferred request may be streamed to */
+  KZ_ASSERT(req->active);
+
+  send_reply(K, KZ_HEADER_REPLYPART, req->foreign_id, KZ_MORE, req->priority);
 }
 
-void kz_send(kz_endpoint_t * K, unsigned int channelid) {
-  /* just send data */
-  send_request(K, 0xFF, channelid);
+kz_task_t * kz_spawn(kz_endpoint_t * K, kz_task_fn_t fn, void * userdata) {
+#if KZ_MAX_TASKS
+  kz_task_t * task;
+  kz_task_t * tasks_end;
+#endif
+
+  KZ_ASSERT(fn);
+
+#if KZ_MAX_TASKS
+  tasks_end = K->tasks + KZ_MAX_TASKS;
+
+  /* find unused task object in pool */
+  for(task = K->tasks ;
+      task != tasks_end ;
+      task ++) {
+    if(!task->fn) {
+      memset(task, 0, sizeof(*task));
+      task->fn       = fn;
+      task->userdata = userdata;
+      return task;
+    }
+  }
+#endif
+
+  return NULL;
 }
 
 void kz_tick(kz_endpoint_t * K) {
-  kz_byte_t reqid;
-  kz_byte_t channelid;
   kz_byte_t byte;
 
+  /* the link can carry another tick's worth of bytes */
+  K->tx_budget_left = K->tx_budget;
+
+  /* advertise our window, or query the peer's credit */
+  step_credit(K);
+
   /* call rx until it indicates no more bytes to be received */
-  while(K->rx(&byte)) {
+  while(K->rx && call_rx(K, &byte)) {
     /* decode this byte as part of the in-progress rx frame */
     if(rx_decode(K, byte)) {
       /* frame received! */
-      size_t size = K->rx_buffer_pos - K->rx_buffer;
-      kz_byte_t * const frame = K->rx_buffer;
-
-      if(size >= 4) {
-        switch(frame[0]) {
-          case KZ_HEADER_REQUEST:
-            reqid = frame[1];
-            channelid = frame[2];
-            handle_request(K, reqid, channelid);
-            break;
-
-          case KZ_HEADER_REPLY:
-            reqid = frame[1];
-            handle_reply(K, reqid);
-            break;
-
-          default:
-            break;
-        }
-      }
+      handle_frame(K);
     }
   }
 
+  /* send queued frames which have received credit or room on the link */
+  drain_queue(K);
+
+  /* step tasks which are due, or woken by a frame */
+  step_tasks(K);
+
+  /* send results to subscribers */
+  step_subscriptions(K);
+
   /* call call handlers who have timed out */
   handle_timeouts(K);
+
+  /* expire cached replies */
+  step_cache(K);
+
+  /* return credit for the requests received this tick */
+  if(K->rx_window && K->rx_credit_owed && send_credit(K, K->rx_credit_owed, 0)) {
+    K->rx_credit_owed = 0;
+  }
+}
+
+void kz_receive(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size) {
+  const kz_byte_t * const bytes_end = bytes + size;
+
+  for( ; bytes != bytes_end ; bytes ++) {
+    if(rx_decode(K, *bytes)) {
+      handle_frame(K);
+    }
+  }
+}
+
+void kz_receiveframe(kz_endpoint_t * K, kz_byte_t * frame, kz_size_t size) {
+  kz_byte_t * const rx_buffer = K->rx_buffer;
+  kz_byte_t * const rx_buffer_end = K->rx_buffer_end;
+
+  /* the frame stands in for the receive buffer while it is handled */
+  K->rx_buffer     = frame;
+  K->rx_buffer_pos = frame + size;
+  K->rx_buffer_end = frame + size;
+
+  handle_frame(K);
+
+  K->rx_buffer     = rx_buffer;
+  K->rx_buffer_pos = rx_buffer;
+  K->rx_buffer_end = rx_buffer_end;
 }
 
 int kz_getint(kz_endpoint_t * K, kz_int_t * i) {
@@ -376,7 +2419,7 @@ int kz_getint(kz_endpoint_t * K, kz_int_t * i) {
     uint64_t u64;
   } s;
 
-  const kz_byte_t * const getend = K->rx_buffer_pos;
+  const kz_byte_t * const getend = K->getend;
 
   kz_byte_t    header_byte;
   kz_byte_t *  getptr;
@@ -513,7 +2556,7 @@ int kz_getfloat(kz_endpoint_t * K, kz_float_t * f) {
     double d;
   } s;
 
-  const kz_byte_t * const getend = K->rx_buffer_pos;
+  const kz_byte_t * const getend = K->getend;
 
   kz_byte_t    header_byte;
   kz_byte_t *  getptr;
@@ -618,8 +2661,43 @@ int kz_getnumber(kz_endpoint_t * K, kz_float_t * f) {
 }
 
 
+int kz_getbatchentry(kz_endpoint_t * K, kz_request_status_t * status) {
+  kz_byte_t * entry;
+
+  /* first entry is at the beginning of the reply */
+  entry = K->batch_getptr ? K->batch_getptr : K->getbegin;
+
+  /* [ STATUS ] [ LEN ] [ r0 ] [ r1 ] ... */
+  if(K->batch_getend - entry < 2 || K->batch_getend - (entry + 2) < entry[1]) {
+    /* no more entries */
+    return 0;
+  }
+
+  *status = (kz_request_status_t)entry[0];
+
+  /* read this entry's results, without disturbing batch_getend */
+  K->getbegin = entry + 2;
+  K->getptr   = entry + 2;
+  K->getend   = entry + 2 + entry[1];
+
+  K->batch_getptr = K->getend;
+
+  return 1;
+}
+
+
 void kz_getreset(kz_endpoint_t * K) {
-  K->getptr = K->rx_buffer + KZ_RX_PAYLOAD_START; /* initialize to beginning of payload */
+  K->getptr = K->getbegin; /* initialize to beginning of payload */
+}
+
+void kz_getraw(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size) {
+  /* never written through */
+  set_getrange(K, (kz_byte_t *)bytes, (kz_byte_t *)bytes + size);
+}
+
+const kz_byte_t * kz_getdata(kz_endpoint_t * K, kz_size_t * size) {
+  *size = K->getend - K->getbegin;
+  return K->getbegin;
 }
 
 
@@ -732,6 +2810,50 @@ int kz_putnil(kz_endpoint_t * K) {
 
   return 1;
 }
+int kz_putraw(kz_endpoint_t * K, const kz_byte_t * bytes, kz_size_t size) {
+  kz_byte_t * const putend = K->tx_buffer_end - 1;
+
+  if((kz_size_t)(putend - K->putptr) < size) { return 0; }
+
+  memcpy(K->putptr, bytes, size);
+  K->putptr += size;
+
+  return 1;
+}
+const kz_byte_t * kz_putdata(kz_endpoint_t * K, kz_size_t * size) {
+  *size = K->putptr - (K->tx_buffer + KZ_TX_PAYLOAD_START);
+  return K->tx_buffer + KZ_TX_PAYLOAD_START;
+}
+void kz_txdone(kz_endpoint_t * K, const kz_byte_t * bytes) {
+  const unsigned int index = (bytes - K->tx_pool) / K->tx_pool_stride;
+
+  if(index < K->tx_pool_count) {
+    K->tx_held[index] = 0;
+  }
+}
+
+int kz_putaside(kz_endpoint_t * K) {
+  if(K->tx_pool_count < 2 || K->aside_putptr || !tx_buffer_ready(K)) {
+    return 0;
+  }
+
+  K->aside_index  = K->tx_pool_index;
+  K->aside_putptr = K->putptr;
+
+  next_tx_buffer(K);
+  K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START;
+
+  return 1;
+}
+
+void kz_putrestore(kz_endpoint_t * K) {
+  if(K->aside_putptr) {
+    select_tx_buffer(K, K->aside_index);
+    K->putptr = K->aside_putptr;
+    K->aside_putptr = NULL;
+  }
+}
+
 void kz_putclear(kz_endpoint_t * K) {
   K->putptr = K->tx_buffer + KZ_TX_PAYLOAD_START; /* initialize to beginning of payload */
 }
@@ -5,4 +5,306 @@ extern "C" {
 #include "kinzhal.h"
 }
 
+/* Endpoints sized at compile time (C++11)
+ *
+ * kz::endpoint<64, 128> device(rx, tx);
+ *
+ * device.handle<1>(fn, userdata);
+ * kz_tick(device);
+ *
+ * The buffers and tables are held inline, so each endpoint on a device may be sized on its own,
+ * and its sizes are constants which are checked against the library's limits when compiled.
+ * Channels sizes its table of channels (those handled, called or cached), and Requests its pool of
+ * calls in flight at once. It converts to a kz_endpoint_t *, for use with the rest of the API.
+ */
+
+namespace kz {
+
+template<kz_size_t RxSize, kz_size_t TxSize = RxSize,
+         unsigned int Channels = KZ_MAX_CHANNELS, unsigned int Requests = KZ_MAX_LOCAL_REQUESTS>
+class endpoint {
+  static_assert(RxSize >= KZ_MIN_BUFFER_SIZE && RxSize <= KZ_MAX_BUFFER_SIZE, "receive buffer size out of range");
+  static_assert(TxSize >= KZ_MIN_BUFFER_SIZE && TxSize <= KZ_MAX_BUFFER_SIZE, "transmit buffer size out of range");
+  static_assert(Channels > 0 && Channels <= 0x100, "channel ids are a byte");
+  static_assert(Requests > 0 && Requests < 0xFF, "request ids are a byte, and 0xFF expects no reply");
+
+public:
+  /* a datagram endpoint is given no rx callback, see kz_endpointdef_t */
+  endpoint(kz_rxhandlerfn_t rx, kz_txhandlerfn_t tx, void * userdata = nullptr, bool datagram = false) : def_() {
+    def_.rx_buffer      = rx_buffer_;
+    def_.rx_buffer_size = RxSize;
+    def_.tx_buffer      = tx_buffer_;
+    def_.tx_buffer_size = TxSize;
+    def_.channels            = channels_;
+    def_.channel_count       = Channels;
+    def_.local_requests      = requests_;
+    def_.local_request_count = Requests;
+    def_.datagram = datagram;
+    def_.rx       = rx;
+    def_.tx       = tx;
+    def_.userdata = userdata;
+
+    kz_init_static(&endpoint_, &def_);
+  }
+
+  /* the endpoint points into itself */
+  endpoint(const endpoint &) = delete;
+  endpoint & operator=(const endpoint &) = delete;
+
+  static constexpr kz_size_t rx_buffer_size() { return RxSize; }
+  static constexpr kz_size_t tx_buffer_size() { return TxSize; }
+  static constexpr unsigned int channels() { return Channels; }
+  static constexpr unsigned int requests() { return Requests; }
+
+  /* largest payload which can be sent, after the reserved bytes and the header */
+  static constexpr kz_size_t tx_payload_max() { return TxSize - 2 - 4; }
+
+  /* largest payload which can be received, after the header */
+  static constexpr kz_size_t rx_payload_max() { return RxSize - 4; }
+
+  operator kz_endpoint_t * () { return &endpoint_; }
+  kz_endpoint_t * get() { return &endpoint_; }
+
+  template<unsigned int Channel>
+  bool handle(kz_request_handler_fn_t fn, void * userdata = nullptr) {
+    static_assert(Channel < Channels, "channel out of range");
+    return kz_handle(&endpoint_, Channel, fn, userdata);
+  }
+
+  template<unsigned int Channel>
+  bool priority(unsigned int priority) {
+    static_assert(Channel < Channels, "channel out of range");
+    return kz_priority(&endpoint_, Channel, priority);
+  }
+
+  /* kz_callf(), which fails if Requests calls are already in flight */
+  template<unsigned int Channel>
+  bool call(kz_reply_handler_fn_t fn, void * userdata, int timeout_ticks, unsigned int flags = 0) {
+    static_assert(Channel < Channels, "channel out of range");
+    return kz_callf(&endpoint_, Channel, fn, userdata, timeout_ticks, flags);
+  }
+
+  template<unsigned int Channel>
+  void send() {
+    static_assert(Channel < Channels, "channel out of range");
+    kz_send(&endpoint_, Channel);
+  }
+
+  /* # of calls waiting for their reply */
+  unsigned int in_flight() const {
+    unsigned int count = 0;
+
+    for(unsigned int i = 0 ; i < Requests ; i ++) {
+      count += requests_[i].callback != nullptr;
+    }
+
+    return count;
+  }
+
+private:
+  kz_endpoint_t endpoint_;
+  kz_endpointdef_t def_;
+  kz_byte_t rx_buffer_[RxSize];
+  kz_byte_t tx_buffer_[TxSize];
+  kz_channel_t channels_[Channels];
+  kz_local_request_t requests_[Requests];
+};
+
+}
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define KZ_HAVE_COROUTINES 1
+#endif
+#endif
+
+#ifdef KZ_HAVE_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/* Awaitable calls (C++20)
+ *
+ * kz::task poll(kz_endpoint_t * K) {
+ *   auto r = co_await kz::call<kz_int_t>(K, 4, 42);
+ *
+ *   if(r) {
+ *     printf("%ld\n", (long)r.get<0>());
+ *   }
+ * }
+ *
+ * The coroutine is suspended until the reply arrives, or the call times out, and is resumed from
+ * within kz_tick() or kz_receive(). Its frame holds everything the call needs, so nothing else is
+ * allocated. A streamed reply is resumed by its final status only, its parts are dropped. The
+ * coroutine must not be destroyed while a call is in flight.
+ */
+
+namespace kz {
+
+/* timeout of kz::call(), in ticks */
+constexpr int default_timeout_ticks = 100;
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type put(kz_endpoint_t * K, T i) {
+  return kz_putint(K, (kz_int_t)i);
+}
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type put(kz_endpoint_t * K, T f) {
+  return kz_putfloat(K, (kz_float_t)f);
+}
+
+inline bool put(kz_endpoint_t * K, const kz_string_t & v) {
+  return kz_putstring(K, &v);
+}
+
+inline bool put(kz_endpoint_t * K, std::nullptr_t) {
+  return kz_putnil(K);
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type get(kz_endpoint_t * K, T & i) {
+  kz_int_t v;
+
+  if(!kz_getint(K, &v)) {
+    return false;
+  }
+
+  i = (T)v;
+  return true;
+}
+
+/* accepts integers too */
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type get(kz_endpoint_t * K, T & f) {
+  kz_float_t v;
+
+  if(!kz_getnumber(K, &v)) {
+    return false;
+  }
+
+  f = (T)v;
+  return true;
+}
+
+/* status and decoded results of a call */
+template<typename... Results>
+struct result {
+  kz_request_status_t status = KZ_IGNORE;
+  std::tuple<Results...> values;
+
+  /* true if the call succeeded and every result could be decoded */
+  explicit operator bool() const { return status == KZ_OK; }
+
+  template<std::size_t I>
+  const typename std::tuple_element<I, std::tuple<Results...>>::type & get() const {
+    return std::get<I>(values);
+  }
+};
+
+template<typename... Results>
+class call_awaiter {
+public:
+  call_awaiter(kz_endpoint_t * K, unsigned int channelid, int timeout_ticks, unsigned int flags, bool encoded)
+    : K_(K), channelid_(channelid), timeout_ticks_(timeout_ticks), flags_(flags), encoded_(encoded) {
+  }
+
+  /* awaited in place, the reply handler holds on to its address */
+  call_awaiter(const call_awaiter &) = delete;
+  call_awaiter & operator=(const call_awaiter &) = delete;
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  /* returns false to carry on without suspending, if the call couldn't be made or was answered
+   * before kz_callf() returned (from the cache) */
+  bool await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    if(!encoded_) {
+      kz_putclear(K_);
+      result_.status = KZ_INVALID;
+      return false;
+    }
+
+    if(!kz_callf(K_, channelid_, on_reply, this, timeout_ticks_, flags_)) {
+      result_.status = KZ_BUSY;
+      return false;
+    }
+
+    suspended_ = !done_;
+
+    return suspended_;
+  }
+
+  result<Results...> await_resume() {
+    return std::move(result_);
+  }
+
+private:
+  static void on_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+    call_awaiter * self = static_cast<call_awaiter *>(userdata);
+
+    if(status == KZ_MORE) {
+      return;
+    }
+
+    self->result_.status = status;
+
+    if(status == KZ_OK && !std::apply([K](auto &... v) { return (get(K, v) && ...); }, self->result_.values)) {
+      self->result_.status = KZ_INVALID;
+    }
+
+    self->done_ = true;
+
+    if(self->suspended_) {
+      self->handle_.resume();
+    }
+  }
+
+  kz_endpoint_t * K_;
+  unsigned int channelid_;
+  int timeout_ticks_;
+  unsigned int flags_;
+  bool encoded_;
+  bool done_ = false;
+  bool suspended_ = false;
+  std::coroutine_handle<> handle_;
+  result<Results...> result_;
+};
+
+/* kz_callf() with the given arguments, awaiting results of the given types. If the arguments don't
+ * fit, the result is KZ_INVALID, and if no request could be made, KZ_BUSY. Results which can't be
+ * decoded make an otherwise successful result KZ_INVALID. */
+template<typename... Results, typename... Args>
+call_awaiter<Results...> callf(kz_endpoint_t * K, unsigned int channelid, int timeout_ticks, unsigned int flags, const Args &... args) {
+  const bool encoded = (put(K, args) && ... && true);
+
+  return call_awaiter<Results...>(K, channelid, timeout_ticks, flags, encoded);
+}
+
+template<typename... Results, typename... Args>
+call_awaiter<Results...> call(kz_endpoint_t * K, unsigned int channelid, const Args &... args) {
+  return callf<Results...>(K, channelid, default_timeout_ticks, 0, args...);
+}
+
+/* coroutine which starts at once and frees itself once done, for awaiting calls in */
+struct task {
+  struct promise_type {
+    task get_return_object() noexcept { return task(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+}
+
+#endif
+
 #endif
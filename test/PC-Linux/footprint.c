@@ -0,0 +1,50 @@
+
+// Reports the size of an endpoint, and of each of its tables, in the configuration it is built with
+//
+// usage: footprint
+//
+// `make footprint` (which `make all` leaves out) builds it three times, as footprint (the default
+// layout), footprint_compact (KZ_COMPACT) and footprint_minimal (KZ_COMPACT, with every optional
+// table left out), and runs them. Buffers, and the tables of channels and local requests, are given
+// to an endpoint separately: the size of an entry of each is reported, and kz_endpoint_t excludes
+// them.
+
+#include <stdio.h>
+
+#include "kinzhal.h"
+
+#define MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
+
+static void row(const char * name, size_t size) {
+  printf("  %-18s %6lu\n", name, (unsigned long)size);
+}
+
+int main(void) {
+  printf("%s layout%s, %lu-bit pointers:\n", KZ_COMPACT ? "compact" : "default",
+         KZ_MAX_CACHE_ENTRIES || KZ_MAX_ROUTES || KZ_MAX_FOREIGN_REQUESTS || KZ_MAX_SUBSCRIPTIONS || KZ_MAX_TASKS ?
+         "" : " without optional tables", (unsigned long)sizeof(void *) * 8);
+
+  row("channel", sizeof(kz_channel_t));
+#if KZ_COMPACT
+  row("userdata_table", MEMBER_SIZE(kz_endpoint_t, userdata_table));
+#endif
+  row("local_request", sizeof(kz_local_request_t));
+#if KZ_MAX_CACHE_ENTRIES
+  row("cache", MEMBER_SIZE(kz_endpoint_t, cache));
+#endif
+#if KZ_MAX_ROUTES
+  row("routes", MEMBER_SIZE(kz_endpoint_t, routes));
+#endif
+#if KZ_MAX_FOREIGN_REQUESTS
+  row("foreign_requests", MEMBER_SIZE(kz_endpoint_t, foreign_requests));
+#endif
+#if KZ_MAX_SUBSCRIPTIONS
+  row("subscriptions", MEMBER_SIZE(kz_endpoint_t, subscriptions));
+#endif
+#if KZ_MAX_TASKS
+  row("tasks", MEMBER_SIZE(kz_endpoint_t, tasks));
+#endif
+  row("kz_endpoint_t", sizeof(kz_endpoint_t));
+
+  return 0;
+}
@@ -0,0 +1,406 @@
+
+// Measures the throughput of kzgateway, with pty pairs standing in for devices
+//
+// usage: gateway_bench [devices] [clients per device] [seconds] [calls in flight per client]
+//
+// Every device answers calls on channel 1 by doubling its argument. The gateway is started on
+// the pty slaves, and each client calls its device through the gateway as fast as it can. This
+// is done once with the gateway on epoll, then again on io_uring.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "kinzhal.h"
+
+#define TICK_MS       10
+#define CALL_TIMEOUT  100  // ticks
+
+typedef struct {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+
+  int fd;
+  char slave_path[64];
+  char socket_path[64];
+} device_t;
+
+typedef struct {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+
+  int fd;
+  device_t * device;
+  int window;
+
+  int in_flight;
+  long next_arg;
+  long ok;
+  long busy;
+  long failed;
+} client_t;
+
+
+static volatile int running = 1;
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void write_all(int fd, const kz_byte_t * bytes, size_t size) {
+  struct pollfd pfd;
+  ssize_t ret;
+
+  while(size > 0) {
+    ret = write(fd, bytes, size);
+
+    if(ret > 0) {
+      bytes += ret;
+      size -= ret;
+    } else if(ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, 100);
+    } else {
+      return;
+    }
+  }
+}
+
+static void device_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((device_t *)kz_userdata())->fd, bytes, size);
+}
+
+static void client_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((client_t *)kz_userdata())->fd, bytes, size);
+}
+
+static kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+static void init_endpoint(kz_endpoint_t * K, kz_endpointdef_t * def, kz_byte_t * rx_buffer, kz_byte_t * tx_buffer,
+                          kz_channel_t * channels, kz_local_request_t * local_requests, kz_txhandlerfn_t tx, void * userdata) {
+  def->rx_buffer = rx_buffer;
+  def->rx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->tx_buffer = tx_buffer;
+  def->tx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->channels = channels;
+  def->channel_count = KZ_MAX_CHANNELS;
+  def->local_requests = local_requests;
+  def->local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  def->rx_window = 0;
+  def->tx_budget = 0;
+  def->queue_buffer = NULL;
+  def->queue_buffer_size = 0;
+  def->retransmit_ticks = 0;
+  def->datagram = 0;
+  def->address = 0;
+  def->tx_enable = NULL;
+  def->tx_buffer_count = 0;
+  def->tx_async = 0;
+  def->rx = NULL;
+  def->tx = tx;
+  def->userdata = userdata;
+
+  kz_init_static(K, def);
+}
+
+// serves calls until the benchmark is over
+static void * device_thread(void * arg) {
+  device_t * device = arg;
+  kz_byte_t bytes[4096];
+  struct pollfd pfd;
+  ssize_t ret;
+
+  pfd.fd = device->fd;
+  pfd.events = POLLIN;
+
+  while(running) {
+    if(poll(&pfd, 1, 100) > 0) {
+      ret = read(device->fd, bytes, sizeof(bytes));
+
+      if(ret > 0) {
+        kz_receive(&device->endpoint, bytes, ret);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  client_t * client = K->userdata;
+  kz_int_t arg = (intptr_t)userdata;
+  kz_int_t result;
+
+  client->in_flight --;
+
+  if(status == KZ_OK && kz_getint(K, &result) && result == 2*arg) {
+    client->ok ++;
+  } else if(status == KZ_BUSY) {
+    // more calls in flight than the device has room for
+    client->busy ++;
+  } else {
+    client->failed ++;
+  }
+}
+
+static int connect_to(const char * path) {
+  struct sockaddr_un addr;
+  int fd;
+  int tries;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  // the gateway may still be starting
+  for(tries = 0 ; tries < 100 ; tries ++) {
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+
+    close(fd);
+    usleep(20000);
+  }
+
+  return -1;
+}
+
+// calls its device as fast as it can, keeping `window` calls in flight
+static void * client_thread(void * arg) {
+  client_t * client = arg;
+  kz_byte_t bytes[4096];
+  struct pollfd pfd;
+  long next_tick;
+  ssize_t ret;
+
+  pfd.fd = client->fd;
+  pfd.events = POLLIN;
+
+  next_tick = now_ms() + TICK_MS;
+
+  while(running) {
+    while(client->in_flight < client->window) {
+      kz_putint(&client->endpoint, client->next_arg);
+
+      if(!kz_call(&client->endpoint, 1, record_reply, (void *)(intptr_t)client->next_arg, CALL_TIMEOUT)) {
+        break;
+      }
+
+      client->in_flight ++;
+      client->next_arg ++;
+    }
+
+    if(poll(&pfd, 1, TICK_MS) > 0) {
+      ret = read(client->fd, bytes, sizeof(bytes));
+
+      if(ret > 0) {
+        kz_receive(&client->endpoint, bytes, ret);
+      } else if(ret == 0) {
+        break;
+      }
+    }
+
+    if(now_ms() >= next_tick) {
+      kz_tick(&client->endpoint);
+      next_tick += TICK_MS;
+    }
+  }
+
+  return NULL;
+}
+
+static int open_pty(device_t * device) {
+  struct termios tty;
+
+  device->fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+  if(device->fd < 0 || grantpt(device->fd) != 0 || unlockpt(device->fd) != 0) {
+    return 0;
+  }
+
+  snprintf(device->slave_path, sizeof(device->slave_path), "%s", ptsname(device->fd));
+
+  // the master end doesn't translate either
+  tcgetattr(device->fd, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(device->fd, TCSANOW, &tty);
+
+  return 1;
+}
+
+// returns 0 if the gateway couldn't be started
+static int run(const char * backend, int device_count, int clients_per_device, int seconds, int window) {
+  const int client_count = device_count * clients_per_device;
+
+  device_t * devices;
+  client_t * clients;
+  pthread_t * device_threads;
+  pthread_t * client_threads;
+  char ** gateway_argv;
+  pid_t gateway;
+  long started;
+  long elapsed;
+  long ok = 0;
+  long busy = 0;
+  long failed = 0;
+  int first;
+  int i;
+
+  running = 1;
+
+  devices = calloc(device_count, sizeof(*devices));
+  clients = calloc(client_count, sizeof(*clients));
+  device_threads = calloc(device_count, sizeof(*device_threads));
+  client_threads = calloc(client_count, sizeof(*client_threads));
+  gateway_argv = calloc(3 + device_count * 2, sizeof(*gateway_argv));
+
+  gateway_argv[0] = "./kzgateway";
+  first = 1;
+  if(strcmp(backend, "epoll") == 0) {
+    gateway_argv[first ++] = "-e";
+  }
+
+  for(i = 0 ; i < device_count ; i ++) {
+    if(!open_pty(devices + i)) {
+      fprintf(stderr, "error opening pty: %s\n", strerror(errno));
+      return 0;
+    }
+
+    snprintf(devices[i].socket_path, sizeof(devices[i].socket_path), "/tmp/kzbench-%d-%d.sock", (int)getpid(), i);
+
+    gateway_argv[first + i*2]     = devices[i].slave_path;
+    gateway_argv[first + i*2 + 1] = devices[i].socket_path;
+
+    init_endpoint(&devices[i].endpoint, &devices[i].def, devices[i].rx_buffer, devices[i].tx_buffer,
+                  devices[i].channels, devices[i].local_requests, device_tx, devices + i);
+    kz_handle(&devices[i].endpoint, 1, double_handler, NULL);
+
+    pthread_create(device_threads + i, NULL, device_thread, devices + i);
+  }
+
+  gateway = fork();
+
+  if(gateway == 0) {
+    execv(gateway_argv[0], gateway_argv);
+    fprintf(stderr, "error starting %s: %s\n", gateway_argv[0], strerror(errno));
+    _exit(1);
+  }
+
+  for(i = 0 ; i < client_count ; i ++) {
+    clients[i].device = devices + i % device_count;
+    clients[i].window = window;
+    clients[i].fd = connect_to(clients[i].device->socket_path);
+
+    if(clients[i].fd < 0) {
+      fprintf(stderr, "error connecting to %s\n", clients[i].device->socket_path);
+      kill(gateway, SIGTERM);
+      return 0;
+    }
+
+    init_endpoint(&clients[i].endpoint, &clients[i].def, clients[i].rx_buffer, clients[i].tx_buffer,
+                  clients[i].channels, clients[i].local_requests, client_tx, clients + i);
+  }
+
+  started = now_ms();
+
+  for(i = 0 ; i < client_count ; i ++) {
+    pthread_create(client_threads + i, NULL, client_thread, clients + i);
+  }
+
+  sleep(seconds);
+  running = 0;
+
+  for(i = 0 ; i < client_count ; i ++) {
+    pthread_join(client_threads[i], NULL);
+    ok += clients[i].ok;
+    busy += clients[i].busy;
+    failed += clients[i].failed;
+  }
+
+  elapsed = now_ms() - started;
+
+  for(i = 0 ; i < device_count ; i ++) {
+    pthread_join(device_threads[i], NULL);
+  }
+
+  kill(gateway, SIGTERM);
+  waitpid(gateway, NULL, 0);
+
+  for(i = 0 ; i < device_count ; i ++) {
+    close(devices[i].fd);
+  }
+
+  for(i = 0 ; i < client_count ; i ++) {
+    close(clients[i].fd);
+  }
+
+  printf("%-8s %ld calls in %ld ms: %.0f calls/s, %ld busy, %ld failed\n", backend, ok, elapsed, ok * 1000.0 / elapsed, busy, failed);
+
+  free(devices);
+  free(clients);
+  free(device_threads);
+  free(client_threads);
+  free(gateway_argv);
+
+  return 1;
+}
+
+int main(int argc, char ** argv) {
+  const int device_count = argc > 1 ? atoi(argv[1]) : 4;
+  const int clients_per_device = argc > 2 ? atoi(argv[2]) : 4;
+  const int seconds = argc > 3 ? atoi(argv[3]) : 5;
+  const int window = argc > 4 ? atoi(argv[4]) : 4;
+
+  if(device_count <= 0 || clients_per_device <= 0 || seconds <= 0 || window <= 0) {
+    fprintf(stderr, "usage: %s [devices] [clients per device] [seconds] [calls in flight per client]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d device(s), %d client(s), %d call(s) in flight per client\n", device_count, device_count * clients_per_device, window);
+
+  if(!run("epoll", device_count, clients_per_device, seconds, window) ||
+     !run("io_uring", device_count, clients_per_device, seconds, window)) {
+    return 1;
+  }
+
+  return 0;
+}
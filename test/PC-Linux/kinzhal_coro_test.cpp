@@ -0,0 +1,328 @@
+#include "kinzhal.hpp"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* frames from one endpoint to the other wait here until delivered */
+typedef struct test_link {
+  kz_endpoint_t * peer;
+  kz_byte_t bytes[4096];
+  size_t size;
+  bool direct;  /* deliver at once, from within the tx callback */
+} test_link_t;
+
+typedef struct test_endpoint {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+  test_link_t link;
+} test_endpoint_t;
+
+void link_tx(const kz_byte_t * bytes, size_t size) {
+  test_link_t * link = (test_link_t *)kz_userdata();
+
+  if(link->direct) {
+    kz_receive(link->peer, bytes, size);
+    return;
+  }
+
+  ck_assert(link->size + size <= sizeof(link->bytes));
+  memcpy(link->bytes + link->size, bytes, size);
+  link->size += size;
+}
+
+/* delivers everything waiting in both directions, until nothing more is sent */
+void pump(test_endpoint_t * a, test_endpoint_t * b) {
+  kz_byte_t bytes[4096];
+  size_t size;
+
+  while(a->link.size || b->link.size) {
+    size = a->link.size;
+    memcpy(bytes, a->link.bytes, size);
+    a->link.size = 0;
+    kz_receive(&b->endpoint, bytes, size);
+
+    size = b->link.size;
+    memcpy(bytes, b->link.bytes, size);
+    b->link.size = 0;
+    kz_receive(&a->endpoint, bytes, size);
+  }
+}
+
+void test_endpoint_init(test_endpoint_t * T, test_endpoint_t * peer) {
+  T->link.peer   = &peer->endpoint;
+  T->link.size   = 0;
+  T->link.direct = false;
+
+  T->def.rx_buffer      = T->rx_buffer;
+  T->def.rx_buffer_size = sizeof(T->rx_buffer);
+  T->def.tx_buffer      = T->tx_buffer;
+  T->def.tx_buffer_size = sizeof(T->tx_buffer);
+  T->def.channels            = T->channels;
+  T->def.channel_count       = KZ_MAX_CHANNELS;
+  T->def.local_requests      = T->local_requests;
+  T->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  T->def.rx_window         = 0;
+  T->def.tx_budget         = 0;
+  T->def.queue_buffer      = NULL;
+  T->def.queue_buffer_size = 0;
+  T->def.retransmit_ticks  = 0;
+  T->def.datagram          = 0;
+  T->def.address           = 0;
+  T->def.tx_enable         = NULL;
+  T->def.tx_buffer_count   = 0;
+  T->def.tx_async          = 0;
+  T->def.rx       = NULL;
+  T->def.tx       = link_tx;
+  T->def.userdata = &T->link;
+
+  kz_init_static(&T->endpoint, &T->def);
+}
+
+kz_request_status_t sum_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t a, b;
+
+  if(!kz_getint(K, &a) || !kz_getint(K, &b)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, a + b);
+  kz_putfloat(K, (a + b) / 2.0);
+
+  return KZ_OK;
+}
+
+kz_request_status_t nothing_handler(kz_endpoint_t * K, void * userdata) {
+  return KZ_OK;
+}
+
+/* what the coroutines saw */
+typedef struct test_outcome {
+  int steps;
+  kz_request_status_t status;
+  kz_int_t sum;
+  double mean;
+} test_outcome_t;
+
+kz::task sum_twice(kz_endpoint_t * K, test_outcome_t * out) {
+  auto r = co_await kz::call<kz_int_t, double>(K, 1, 2, 3);
+
+  out->steps ++;
+  out->status = r.status;
+  out->sum = r.get<0>();
+
+  r = co_await kz::call<kz_int_t, double>(K, 1, out->sum, 10);
+
+  out->steps ++;
+  out->status = r.status;
+  out->sum = r.get<0>();
+  out->mean = r.get<1>();
+}
+
+kz::task call_once(kz_endpoint_t * K, unsigned int channelid, int timeout_ticks, test_outcome_t * out) {
+  auto r = co_await kz::callf<kz_int_t>(K, channelid, timeout_ticks, 0, 1, 2);
+
+  out->steps ++;
+  out->status = r.status;
+}
+
+START_TEST(awaited_calls) {
+  test_endpoint_t a, b;
+  test_outcome_t out = {0, KZ_IGNORE, 0, 0};
+
+  test_endpoint_init(&a, &b);
+  test_endpoint_init(&b, &a);
+  kz_handle(&b.endpoint, 1, sum_handler, NULL);
+  pump(&a, &b);
+
+  sum_twice(&a.endpoint, &out);
+
+  /* suspended until the reply arrives */
+  ck_assert_int_eq(out.steps, 0);
+
+  pump(&a, &b);
+
+  ck_assert_int_eq(out.steps, 2);
+  ck_assert_int_eq(out.status, KZ_OK);
+  ck_assert_int_eq(out.sum, 15);
+  ck_assert(out.mean == 7.5);
+}
+END_TEST
+
+START_TEST(immediate_reply) {
+  test_endpoint_t a, b;
+  test_outcome_t out = {0, KZ_IGNORE, 0, 0};
+
+  test_endpoint_init(&a, &b);
+  test_endpoint_init(&b, &a);
+  kz_handle(&b.endpoint, 1, sum_handler, NULL);
+  pump(&a, &b);
+
+  /* the reply arrives before kz_callf() returns, so there's no need to suspend */
+  a.link.direct = true;
+  b.link.direct = true;
+
+  sum_twice(&a.endpoint, &out);
+
+  ck_assert_int_eq(out.steps, 2);
+  ck_assert_int_eq(out.status, KZ_OK);
+  ck_assert_int_eq(out.sum, 15);
+}
+END_TEST
+
+START_TEST(awaited_timeout) {
+  test_endpoint_t a, b;
+  test_outcome_t out = {0, KZ_OK, 0, 0};
+  int i;
+
+  test_endpoint_init(&a, &b);
+  test_endpoint_init(&b, &a);
+
+  call_once(&a.endpoint, 1, 3, &out);
+
+  /* never delivered */
+  for(i = 0 ; i < 3 ; i ++) {
+    ck_assert_int_eq(out.steps, 0);
+    kz_tick(&a.endpoint);
+  }
+
+  ck_assert_int_eq(out.steps, 1);
+  ck_assert_int_eq(out.status, KZ_IGNORE);
+}
+END_TEST
+
+START_TEST(undecodable_results) {
+  test_endpoint_t a, b;
+  test_outcome_t out = {0, KZ_OK, 0, 0};
+
+  test_endpoint_init(&a, &b);
+  test_endpoint_init(&b, &a);
+  kz_handle(&b.endpoint, 2, nothing_handler, NULL);
+  pump(&a, &b);
+
+  /* an integer is expected, none is sent */
+  call_once(&a.endpoint, 2, 10, &out);
+  pump(&a, &b);
+
+  ck_assert_int_eq(out.steps, 1);
+  ck_assert_int_eq(out.status, KZ_INVALID);
+}
+END_TEST
+
+/* delivers what has been sent over a link to its peer */
+void deliver(test_link_t * link) {
+  kz_byte_t bytes[4096];
+  size_t size;
+
+  size = link->size;
+  memcpy(bytes, link->bytes, size);
+  link->size = 0;
+  kz_receive(link->peer, bytes, size);
+}
+
+void record_status(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  test_outcome_t * out = (test_outcome_t *)userdata;
+
+  out->steps ++;
+  out->status = status;
+
+  if(status == KZ_OK) {
+    kz_getint(K, &out->sum);
+  }
+}
+
+START_TEST(sized_endpoints) {
+  test_link_t host_link = {};
+  test_link_t device_link = {};
+  test_outcome_t out = {0, KZ_IGNORE, 0, 0};
+
+  /* one call in flight, to a device with small buffers and tables */
+  kz::endpoint<KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE, 4, 1> host(NULL, link_tx, &host_link);
+  kz::endpoint<32, 64, 2, 1> device(NULL, link_tx, &device_link);
+
+  static_assert(decltype(device)::rx_buffer_size() == 32, "sizes are constants");
+  static_assert(decltype(device)::tx_payload_max() == 58, "sizes are constants");
+  static_assert(sizeof(device) < sizeof(host), "buffers are held inline");
+  static_assert(sizeof(kz::endpoint<32, 64, 2, 1>) < sizeof(kz::endpoint<32, 64>), "tables are held inline");
+
+  host_link.peer = device;
+  device_link.peer = host;
+  deliver(&host_link);
+  deliver(&device_link);
+
+  ck_assert(device.handle<1>(sum_handler, NULL));
+
+  /* the device's table only has room for two channels */
+  ck_assert(!kz_handle(device, 2, sum_handler, NULL));
+
+  kz_putint(host, 2);
+  kz_putint(host, 3);
+  ck_assert(host.call<1>(record_status, &out, 10));
+
+  /* no more until it has been answered */
+  kz_putint(host, 1);
+  ck_assert(!host.call<1>(record_status, &out, 10));
+  ck_assert_uint_eq(host.in_flight(), 1);
+
+  deliver(&host_link);
+  deliver(&device_link);
+
+  ck_assert_int_eq(out.steps, 1);
+  ck_assert_int_eq(out.status, KZ_OK);
+  ck_assert_int_eq(out.sum, 5);
+  ck_assert_uint_eq(host.in_flight(), 0);
+
+  /* and its one request object is used again, under a new id */
+  kz_putint(host, 4);
+  kz_putint(host, 5);
+  ck_assert(host.call<1>(record_status, &out, 10));
+  ck_assert_uint_eq(host.get()->local_requests[0].reqid, 1);
+
+  deliver(&host_link);
+  deliver(&device_link);
+
+  ck_assert_int_eq(out.steps, 2);
+  ck_assert_int_eq(out.status, KZ_OK);
+  ck_assert_int_eq(out.sum, 9);
+  ck_assert_uint_eq(host.in_flight(), 0);
+}
+END_TEST
+
+Suite * kinzhal_coro_suite(void) {
+  Suite * s;
+  TCase * tc_core;
+
+  s = suite_create("Kinzhal coroutines");
+
+  tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, awaited_calls);
+  tcase_add_test(tc_core, immediate_reply);
+  tcase_add_test(tc_core, awaited_timeout);
+  tcase_add_test(tc_core, undecodable_results);
+  tcase_add_test(tc_core, sized_endpoints);
+
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite * s;
+  SRunner * sr;
+
+  s = kinzhal_coro_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,484 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "kinzhal_mt.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TEST_THREADS 4
+#define TEST_CALLS   500
+
+/* stands in for the device, on the other end of a socket pair */
+typedef struct test_device {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+  int fd;
+} test_device_t;
+
+void device_tx(const kz_byte_t * bytes, size_t size) {
+  test_device_t * device = kz_userdata();
+  ssize_t ret;
+
+  while(size > 0) {
+    ret = write(device->fd, bytes, size);
+    assert(ret > 0);
+    bytes += ret;
+    size -= ret;
+  }
+}
+
+kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+/* streams more parts than a client has room for, then ends the stream */
+kz_request_status_t stream_handler(kz_endpoint_t * K, void * userdata) {
+  kz_request_t * req;
+  kz_int_t i;
+
+  req = kz_defer(K);
+  if(!req) {
+    return KZ_BUSY;
+  }
+
+  for(i = 0 ; i < KZ_MT_MAX_COMPLETIONS ; i ++) {
+    kz_putint(K, i);
+    kz_replypart(K, req);
+  }
+
+  return KZ_OK;
+}
+
+void test_device_init(test_device_t * device, int fd) {
+  device->fd = fd;
+
+  device->def.rx_buffer      = device->rx_buffer;
+  device->def.rx_buffer_size = sizeof(device->rx_buffer);
+  device->def.tx_buffer      = device->tx_buffer;
+  device->def.tx_buffer_size = sizeof(device->tx_buffer);
+  device->def.channels            = device->channels;
+  device->def.channel_count       = KZ_MAX_CHANNELS;
+  device->def.local_requests      = device->local_requests;
+  device->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  device->def.rx_window         = 0;
+  device->def.tx_budget         = 0;
+  device->def.queue_buffer      = NULL;
+  device->def.queue_buffer_size = 0;
+  device->def.retransmit_ticks  = 0;
+  device->def.datagram          = 0;
+  device->def.address           = 0;
+  device->def.tx_enable         = NULL;
+  device->def.tx_buffer_count   = 0;
+  device->def.tx_async          = 0;
+  device->def.rx       = NULL;
+  device->def.tx       = device_tx;
+  device->def.userdata = device;
+
+  kz_init_static(&device->endpoint, &device->def);
+
+  kz_handle(&device->endpoint, 1, double_handler, NULL);
+  kz_handle(&device->endpoint, 2, stream_handler, NULL);
+}
+
+/* serves requests until told to stop */
+void test_device_run(test_device_t * device, atomic_int * running) {
+  kz_byte_t bytes[KZ_MAX_BUFFER_SIZE];
+  struct pollfd pfd;
+  ssize_t ret;
+
+  pfd.fd     = device->fd;
+  pfd.events = POLLIN;
+
+  while(atomic_load(running)) {
+    if(poll(&pfd, 1, 10) > 0) {
+      ret = read(device->fd, bytes, sizeof(bytes));
+
+      if(ret > 0) {
+        kz_receive(&device->endpoint, bytes, ret);
+      }
+    }
+  }
+}
+
+
+typedef struct test_client {
+  kz_mt_client_t client;
+  kz_mt_endpoint_t * M;
+  int id;
+  int replies;
+  int errors;
+} test_client_t;
+
+typedef struct test_call {
+  test_client_t * T;
+  kz_int_t arg;
+} test_call_t;
+
+void record_double(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  test_call_t * call = userdata;
+  kz_int_t result;
+
+  call->T->replies ++;
+
+  if(status != KZ_OK || !kz_getint(K, &result) || result != 2*call->arg) {
+    call->T->errors ++;
+  }
+}
+
+void * client_thread(void * arg) {
+  test_client_t * T = arg;
+  test_call_t * calls;
+  int i;
+
+  calls = malloc(sizeof(*calls) * TEST_CALLS);
+
+  kz_mt_client_init(&T->client, T->M);
+
+  for(i = 0 ; i < TEST_CALLS ; i ++) {
+    calls[i].T   = T;
+    calls[i].arg = T->id * TEST_CALLS + i;
+
+    kz_putint(kz_mt_args(&T->client), calls[i].arg);
+
+    while(!kz_mt_call(&T->client, 1, record_double, &calls[i], 100, 0)) {
+      /* wait for room, the arguments have to be placed again */
+      if(!kz_mt_poll(&T->client)) {
+        sched_yield();
+      }
+      kz_putint(kz_mt_args(&T->client), calls[i].arg);
+    }
+
+    kz_mt_poll(&T->client);
+  }
+
+  while(T->replies < TEST_CALLS) {
+    if(!kz_mt_poll(&T->client)) {
+      sched_yield();
+    }
+  }
+
+  free(calls);
+
+  return NULL;
+}
+
+void * device_thread(void * arg) {
+  void ** args = arg;
+
+  test_device_run(args[0], args[1]);
+
+  return NULL;
+}
+
+START_TEST(concurrent_calls) {
+  int fds[2];
+  kz_mt_endpoint_t * M;
+  test_device_t * device;
+  test_client_t clients[TEST_THREADS];
+  pthread_t threads[TEST_THREADS];
+  pthread_t device_thread_id;
+  atomic_int device_running;
+  void * device_args[2];
+  int i;
+
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  M = malloc(sizeof(*M));
+  device = malloc(sizeof(*device));
+
+  test_device_init(device, fds[1]);
+  atomic_init(&device_running, 1);
+  device_args[0] = device;
+  device_args[1] = &device_running;
+  ck_assert_int_eq(pthread_create(&device_thread_id, NULL, device_thread, device_args), 0);
+
+  ck_assert_int_eq(kz_mt_init(M, fds[0], 10), 1);
+  ck_assert_int_eq(kz_mt_start(M), 1);
+
+  for(i = 0 ; i < TEST_THREADS ; i ++) {
+    clients[i].M       = M;
+    clients[i].id      = i;
+    clients[i].replies = 0;
+    clients[i].errors  = 0;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, client_thread, &clients[i]), 0);
+  }
+
+  for(i = 0 ; i < TEST_THREADS ; i ++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  kz_mt_stop(M);
+
+  atomic_store(&device_running, 0);
+  pthread_join(device_thread_id, NULL);
+
+  /* every call was answered once, with its own results */
+  for(i = 0 ; i < TEST_THREADS ; i ++) {
+    ck_assert_int_eq(clients[i].replies, TEST_CALLS);
+    ck_assert_int_eq(clients[i].errors, 0);
+    ck_assert_uint_eq(atomic_load(&clients[i].client.in_flight), 0);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  free(device);
+  free(M);
+}
+END_TEST
+
+START_TEST(full_queue) {
+  int fds[2];
+  kz_mt_endpoint_t * M;
+  test_client_t T;
+  test_call_t call;
+  kz_size_t args_size;
+  int i;
+
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  M = malloc(sizeof(*M));
+
+  /* not started, nothing is taken from the queue */
+  ck_assert_int_eq(kz_mt_init(M, fds[0], 10), 1);
+
+  T.M       = M;
+  T.id      = 0;
+  T.replies = 0;
+  T.errors  = 0;
+  kz_mt_client_init(&T.client, M);
+
+  call.T   = &T;
+  call.arg = 1;
+
+  /* limited by room for completions */
+  for(i = 0 ; i < KZ_MT_MAX_COMPLETIONS ; i ++) {
+    kz_putint(kz_mt_args(&T.client), 1);
+    ck_assert_int_eq(kz_mt_call(&T.client, 1, record_double, &call, 10, 0), 1);
+  }
+  kz_putint(kz_mt_args(&T.client), 1);
+  ck_assert_int_eq(kz_mt_call(&T.client, 1, record_double, &call, 10, 0), 0);
+
+  /* arguments of a failed call aren't left behind */
+  kz_putdata(kz_mt_args(&T.client), &args_size);
+  ck_assert_uint_eq(args_size, 0);
+
+  ck_assert_int_eq(kz_mt_poll(&T.client), 0);
+
+  close(M->wake_fd);
+  close(fds[0]);
+  close(fds[1]);
+  free(M);
+}
+END_TEST
+
+void record_status(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  *(kz_request_status_t *)userdata = status;
+}
+
+START_TEST(closed_descriptor) {
+  int fds[2];
+  kz_mt_endpoint_t * M;
+  kz_mt_client_t * C;
+  kz_request_status_t status = KZ_DEFER;
+  struct timespec ts;
+  clock_t cpu;
+  int rounds;
+
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  M = malloc(sizeof(*M));
+  C = malloc(sizeof(*C));
+
+  ck_assert_int_eq(kz_mt_init(M, fds[0], 5), 1);
+  kz_mt_client_init(C, M);
+
+  /* the device goes away */
+  close(fds[1]);
+
+  cpu = clock();
+  ck_assert_int_eq(kz_mt_start(M), 1);
+
+  kz_putint(kz_mt_args(C), 1);
+  ck_assert_int_eq(kz_mt_call(C, 1, record_status, &status, 10, 0), 1);
+
+  ts.tv_sec  = 0;
+  ts.tv_nsec = 10000000;
+
+  for(rounds = 0 ; status == KZ_DEFER && rounds < 100 ; rounds ++) {
+    nanosleep(&ts, NULL);
+    kz_mt_poll(C);
+  }
+
+  /* the call timed out, without the I/O thread spinning on the descriptor meanwhile */
+  ck_assert_int_eq(status, KZ_IGNORE);
+  ck_assert_int_eq(atomic_load(&M->closed), 1);
+  ck_assert_int_lt((clock() - cpu) * 1000 / CLOCKS_PER_SEC, rounds * 10 / 2);
+
+  kz_mt_stop(M);
+  close(fds[0]);
+  free(C);
+  free(M);
+}
+END_TEST
+
+typedef struct stream_result {
+  int parts;
+  int done;
+} stream_result_t;
+
+void record_stream(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  stream_result_t * result = userdata;
+
+  if(status == KZ_MORE) {
+    result->parts ++;
+  } else {
+    result->done ++;
+  }
+}
+
+START_TEST(streamed_parts_fill_ring) {
+  int fds[2];
+  kz_mt_endpoint_t * M;
+  test_device_t * device;
+  test_client_t T;
+  test_call_t calls[KZ_MT_MAX_COMPLETIONS];
+  stream_result_t stream;
+  pthread_t device_thread_id;
+  atomic_int device_running;
+  void * device_args[2];
+  int made;
+  int i;
+
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  M = malloc(sizeof(*M));
+  device = malloc(sizeof(*device));
+
+  test_device_init(device, fds[1]);
+  atomic_init(&device_running, 1);
+  device_args[0] = device;
+  device_args[1] = &device_running;
+  ck_assert_int_eq(pthread_create(&device_thread_id, NULL, device_thread, device_args), 0);
+
+  ck_assert_int_eq(kz_mt_init(M, fds[0], 10), 1);
+  ck_assert_int_eq(kz_mt_start(M), 1);
+
+  T.M       = M;
+  T.id      = 0;
+  T.replies = 0;
+  T.errors  = 0;
+  kz_mt_client_init(&T.client, M);
+  memset(&stream, 0, sizeof(stream));
+
+  for(i = 0 ; i < KZ_MT_MAX_COMPLETIONS ; i ++) {
+    calls[i].T   = &T;
+    calls[i].arg = i;
+  }
+
+  /* the parts fill every slot but the one held for the end of the stream */
+  ck_assert_int_eq(kz_mt_call(&T.client, 2, record_stream, &stream, 100, 0), 1);
+
+  while(atomic_load(&T.client.completions_head) < KZ_MT_MAX_COMPLETIONS) {
+    sched_yield();
+  }
+  ck_assert_uint_eq(atomic_load(&T.client.dropped), 1);
+
+  /* so there is no room for another call, though only one is in flight */
+  ck_assert_uint_eq(atomic_load(&T.client.in_flight), 1);
+  kz_putint(kz_mt_args(&T.client), 1);
+  ck_assert_int_eq(kz_mt_call(&T.client, 1, record_double, calls, 100, 0), 0);
+
+  /* taking the completions out frees their slots */
+  ck_assert_int_eq(kz_mt_poll(&T.client), KZ_MT_MAX_COMPLETIONS);
+  ck_assert_int_eq(stream.parts, KZ_MT_MAX_COMPLETIONS - 1);
+  ck_assert_int_eq(stream.done, 1);
+
+  /* a stream and calls together never need more slots than there are */
+  ck_assert_int_eq(kz_mt_call(&T.client, 2, record_stream, &stream, 100, 0), 1);
+  for(made = 0 ; made < KZ_MT_MAX_COMPLETIONS ; made ++) {
+    kz_putint(kz_mt_args(&T.client), calls[made].arg);
+    if(!kz_mt_call(&T.client, 1, record_double, calls + made, 100, 0)) {
+      break;
+    }
+  }
+  ck_assert_int_lt(made, KZ_MT_MAX_COMPLETIONS);
+
+  while(stream.done < 2 || T.replies < made) {
+    ck_assert_uint_le(atomic_load(&T.client.completions_head) - atomic_load(&T.client.completions_tail),
+                      KZ_MT_MAX_COMPLETIONS);
+    if(!kz_mt_poll(&T.client)) {
+      sched_yield();
+    }
+  }
+
+  /* every call was answered with its own results */
+  ck_assert_int_eq(T.replies, made);
+  ck_assert_int_eq(T.errors, 0);
+  ck_assert_uint_eq(atomic_load(&T.client.in_flight), 0);
+  ck_assert_uint_eq(atomic_load(&T.client.reserved), 0);
+
+  kz_mt_stop(M);
+
+  atomic_store(&device_running, 0);
+  pthread_join(device_thread_id, NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  free(device);
+  free(M);
+}
+END_TEST
+
+Suite * kinzhal_mt_suite(void) {
+  Suite * s;
+  TCase * tc_core;
+
+  s = suite_create("Kinzhal MT");
+
+  tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, concurrent_calls);
+  tcase_add_test(tc_core, full_queue);
+  tcase_add_test(tc_core, streamed_parts_fill_ring);
+  tcase_add_test(tc_core, closed_descriptor);
+
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite * s;
+  SRunner * sr;
+
+  s = kinzhal_mt_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
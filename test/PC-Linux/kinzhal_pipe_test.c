@@ -0,0 +1,331 @@
+
+#include "kinzhal_pipe.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_CALLS  200
+
+/* two endpoints, connected by a pipe */
+typedef struct test_link {
+  kz_pipe_t pipe;
+  kz_endpoint_t host;
+  kz_endpoint_t device;
+  kz_endpointdef_t host_def;
+  kz_endpointdef_t device_def;
+  kz_byte_t host_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t host_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t host_queue_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t device_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t device_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t host_channels[KZ_MAX_CHANNELS];
+  kz_channel_t device_channels[KZ_MAX_CHANNELS];
+  kz_local_request_t host_local_requests[KZ_MAX_LOCAL_REQUESTS];
+  kz_local_request_t device_local_requests[KZ_MAX_LOCAL_REQUESTS];
+} test_link_t;
+
+void test_def_init(kz_endpointdef_t * def, kz_byte_t * rx_buffer, kz_byte_t * tx_buffer,
+                   kz_channel_t * channels, kz_local_request_t * local_requests) {
+  def->rx_buffer      = rx_buffer;
+  def->rx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->tx_buffer      = tx_buffer;
+  def->tx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->channels            = channels;
+  def->channel_count       = KZ_MAX_CHANNELS;
+  def->local_requests      = local_requests;
+  def->local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  def->rx_window         = 0;
+  def->tx_budget         = 0;
+  def->queue_buffer      = NULL;
+  def->queue_buffer_size = 0;
+  def->retransmit_ticks  = 0;
+  def->datagram          = 0;
+  def->address           = 0;
+  def->tx_enable         = NULL;
+  def->tx_buffer_count   = 0;
+  def->tx_async          = 0;
+}
+
+/* the device accepts the given # of requests per tick (0 if unlimited) */
+test_link_t * test_link_create(unsigned int device_window, char datagram) {
+  test_link_t * L = malloc(sizeof(*L));
+
+  test_def_init(&L->host_def, L->host_rx_buffer, L->host_tx_buffer, L->host_channels, L->host_local_requests);
+  test_def_init(&L->device_def, L->device_rx_buffer, L->device_tx_buffer, L->device_channels, L->device_local_requests);
+
+  L->host_def.queue_buffer      = L->host_queue_buffer;
+  L->host_def.queue_buffer_size = sizeof(L->host_queue_buffer);
+  L->device_def.rx_window       = device_window;
+  L->host_def.datagram          = datagram;
+  L->device_def.datagram        = datagram;
+
+  kz_pipe_connect(&L->pipe, &L->host, &L->host_def, &L->device, &L->device_def);
+
+  /* each endpoint asks for the other's credit on its first tick */
+  kz_tick(&L->host);
+  kz_tick(&L->device);
+
+  return L;
+}
+
+kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+kz_request_status_t nothing_handler(kz_endpoint_t * K, void * userdata) {
+  return KZ_OK;
+}
+
+typedef struct test_replies {
+  int count;
+  int errors;
+  int timeouts;
+} test_replies_t;
+
+test_replies_t replies;
+
+void record_double(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_int_t arg = *(kz_int_t *)userdata;
+  kz_int_t result;
+
+  replies.count ++;
+
+  if(status == KZ_IGNORE) {
+    replies.timeouts ++;
+  } else if(status != KZ_OK || !kz_getint(K, &result) || result != 2*arg) {
+    replies.errors ++;
+  }
+}
+
+void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  replies.count ++;
+
+  if(status == KZ_IGNORE) {
+    replies.timeouts ++;
+  } else if(status != KZ_OK) {
+    replies.errors ++;
+  }
+}
+
+int call_double(kz_endpoint_t * K, kz_int_t arg, int timeout_ticks) {
+  kz_putint(K, arg);
+
+  return kz_callcopy(K, 1, record_double, &arg, sizeof(arg), timeout_ticks, 0);
+}
+
+START_TEST(pumped_calls) {
+  test_link_t * L;
+  unsigned long requests;
+  unsigned long replies_sent;
+  int i;
+
+  memset(&replies, 0, sizeof(replies));
+
+  L = test_link_create(0, 0);
+  kz_handle(&L->device, 1, double_handler, NULL);
+
+  /* and is answered once pumped */
+  kz_pipe_pump(&L->pipe);
+  requests     = L->pipe.ends[1].frames;
+  replies_sent = L->pipe.ends[0].frames;
+
+  for(i = 0 ; i < TEST_CALLS ; i ++) {
+    ck_assert_int_eq(call_double(&L->host, i, 10), 1);
+
+    /* nothing is delivered until pumped */
+    ck_assert_int_eq(replies.count, i);
+    ck_assert_uint_ne(kz_pipe_waiting(&L->pipe, &L->device), 0);
+
+    ck_assert_uint_ne(kz_pipe_pump(&L->pipe), 0);
+
+    ck_assert_uint_eq(kz_pipe_waiting(&L->pipe, &L->device), 0);
+    ck_assert_uint_eq(kz_pipe_waiting(&L->pipe, &L->host), 0);
+  }
+
+  ck_assert_int_eq(replies.count, TEST_CALLS);
+  ck_assert_int_eq(replies.errors, 0);
+
+  /* a request and a reply for every call */
+  ck_assert_uint_eq(L->pipe.ends[1].frames - requests, TEST_CALLS);
+  ck_assert_uint_eq(L->pipe.ends[0].frames - replies_sent, TEST_CALLS);
+  ck_assert_uint_eq(L->pipe.ends[0].frames_dropped + L->pipe.ends[1].frames_dropped, 0);
+
+  free(L);
+}
+END_TEST
+
+START_TEST(datagram_calls) {
+  test_link_t * L;
+  int rounds;
+  int i;
+
+  memset(&replies, 0, sizeof(replies));
+
+  /* frames are delivered whole, credit included */
+  L = test_link_create(2, 1);
+  kz_handle(&L->device, 1, double_handler, NULL);
+  kz_pipe_pump(&L->pipe);
+
+  for(i = 0 ; i < 8 ; i ++) {
+    ck_assert_int_eq(call_double(&L->host, i, 100), 1);
+  }
+
+  for(rounds = 0 ; replies.count < 8 && rounds < 20 ; rounds ++) {
+    kz_pipe_pump(&L->pipe);
+    kz_tick(&L->device);
+    kz_pipe_pump(&L->pipe);
+    kz_tick(&L->host);
+  }
+
+  ck_assert_int_eq(replies.count, 8);
+  ck_assert_int_eq(replies.errors, 0);
+
+  free(L);
+}
+END_TEST
+
+START_TEST(ticked_calls) {
+  test_link_t * L;
+  int i;
+
+  memset(&replies, 0, sizeof(replies));
+
+  L = test_link_create(0, 0);
+  kz_handle(&L->device, 1, double_handler, NULL);
+
+  for(i = 0 ; i < KZ_MAX_LOCAL_REQUESTS ; i ++) {
+    ck_assert_int_eq(call_double(&L->host, i, 10), 1);
+  }
+
+  /* received through the rx callbacks */
+  kz_tick(&L->device);
+  ck_assert_int_eq(replies.count, 0);
+  kz_tick(&L->host);
+
+  ck_assert_int_eq(replies.count, KZ_MAX_LOCAL_REQUESTS);
+  ck_assert_int_eq(replies.errors, 0);
+
+  free(L);
+}
+END_TEST
+
+START_TEST(credit_through_pipe) {
+  test_link_t * L;
+  int rounds;
+  int i;
+
+  memset(&replies, 0, sizeof(replies));
+
+  /* the device's credit is carried over the pipe like any other frame */
+  L = test_link_create(2, 0);
+  kz_handle(&L->device, 1, double_handler, NULL);
+  kz_pipe_pump(&L->pipe);
+
+  for(i = 0 ; i < 8 ; i ++) {
+    ck_assert_int_eq(call_double(&L->host, i, 100), 1);
+  }
+
+  /* only as many as the device has credit for are sent at once */
+  ck_assert_uint_eq(L->pipe.ends[1].frames, 1 + 2);
+
+  for(rounds = 0 ; replies.count < 8 && rounds < 20 ; rounds ++) {
+    kz_pipe_pump(&L->pipe);
+    kz_tick(&L->device);
+    kz_pipe_pump(&L->pipe);
+    kz_tick(&L->host);
+  }
+
+  ck_assert_int_eq(replies.count, 8);
+  ck_assert_int_eq(replies.errors, 0);
+
+  free(L);
+}
+END_TEST
+
+START_TEST(full_pipe_drops) {
+  test_link_t * L;
+  kz_byte_t nils[200];
+  int sent = 0;
+  int i;
+
+  memset(&replies, 0, sizeof(replies));
+  memset(nils, 0x80, sizeof(nils));
+
+  L = test_link_create(0, 0);
+  kz_handle(&L->device, 1, double_handler, NULL);
+  kz_handle(&L->device, 2, nothing_handler, NULL);
+
+  /* large requests, until one doesn't fit */
+  while(L->pipe.ends[1].frames_dropped == 0) {
+    ck_assert_int_lt(sent, KZ_MAX_LOCAL_REQUESTS);
+
+    ck_assert_int_eq(kz_putraw(&L->host, nils, sizeof(nils)), 1);
+    ck_assert_int_eq(kz_call(&L->host, 2, record_reply, NULL, 2), 1);
+    sent ++;
+  }
+
+  /* everything which fit is still delivered */
+  kz_pipe_pump(&L->pipe);
+  ck_assert_int_eq(replies.count, sent - 1);
+  ck_assert_int_eq(replies.errors, 0);
+
+  /* and the dropped call times out */
+  for(i = 0 ; i < 2 ; i ++) {
+    kz_tick(&L->host);
+  }
+  ck_assert_int_eq(replies.count, sent);
+  ck_assert_int_eq(replies.timeouts, 1);
+
+  /* the pipe carries on */
+  ck_assert_int_eq(call_double(&L->host, 3, 2), 1);
+  kz_pipe_pump(&L->pipe);
+  ck_assert_int_eq(replies.count, sent + 1);
+  ck_assert_int_eq(replies.errors, 0);
+
+  free(L);
+}
+END_TEST
+
+Suite * kinzhal_pipe_suite(void) {
+  Suite * s;
+  TCase * tc_core;
+
+  s = suite_create("Kinzhal pipe");
+
+  tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, pumped_calls);
+  tcase_add_test(tc_core, ticked_calls);
+  tcase_add_test(tc_core, credit_through_pipe);
+  tcase_add_test(tc_core, datagram_calls);
+  tcase_add_test(tc_core, full_pipe_drops);
+
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite * s;
+  SRunner * sr;
+
+  s = kinzhal_pipe_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "kinzhal_shard.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define TEST_SHARDS  4
+#define TEST_PAIRS   16
+#define TEST_CALLS   2000
+#define TEST_WINDOW  4
+
+/* a caller and a server, on either end of a socket pair */
+typedef struct test_pair {
+  kz_endpoint_t caller;
+  kz_endpoint_t server;
+  kz_endpointdef_t caller_def;
+  kz_endpointdef_t server_def;
+  kz_byte_t caller_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t caller_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t server_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t server_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t caller_channels[KZ_MAX_CHANNELS];
+  kz_channel_t server_channels[KZ_MAX_CHANNELS];
+  kz_local_request_t caller_local_requests[KZ_MAX_LOCAL_REQUESTS];
+  kz_local_request_t server_local_requests[KZ_MAX_LOCAL_REQUESTS];
+  int fds[2];
+
+  kz_shard_endpoint_t caller_shard;
+  kz_shard_endpoint_t server_shard;
+
+  /* owned by whichever shard owns the caller */
+  int in_flight;
+  int sent;
+
+  atomic_int replies;
+  atomic_int errors;
+} test_pair_t;
+
+void write_all(int fd, const kz_byte_t * bytes, size_t size) {
+  ssize_t ret;
+
+  while(size > 0) {
+    ret = write(fd, bytes, size);
+    assert(ret > 0);
+    bytes += ret;
+    size -= ret;
+  }
+}
+
+void caller_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((test_pair_t *)kz_userdata())->fds[0], bytes, size);
+}
+
+void server_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((test_pair_t *)kz_userdata())->fds[1], bytes, size);
+}
+
+kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+void fill_window(test_pair_t * P);
+
+void record_double(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  test_pair_t * P = K->userdata;
+  kz_int_t arg = (kz_int_t)(intptr_t)userdata;
+  kz_int_t result;
+
+  P->in_flight --;
+
+  if(status != KZ_OK || !kz_getint(K, &result) || result != 2*arg) {
+    atomic_fetch_add(&P->errors, 1);
+  }
+
+  atomic_fetch_add(&P->replies, 1);
+
+  fill_window(P);
+}
+
+void fill_window(test_pair_t * P) {
+  while(P->in_flight < TEST_WINDOW && P->sent < TEST_CALLS) {
+    kz_putint(&P->caller, P->sent);
+
+    if(!kz_call(&P->caller, 1, record_double, (void *)(intptr_t)P->sent, 100)) {
+      break;
+    }
+
+    P->in_flight ++;
+    P->sent ++;
+  }
+}
+
+void caller_tick(kz_shard_endpoint_t * E, void * userdata) {
+  fill_window(userdata);
+}
+
+void test_endpoint_init(kz_endpoint_t * K, kz_endpointdef_t * def, kz_byte_t * rx_buffer, kz_byte_t * tx_buffer,
+                        kz_channel_t * channels, kz_local_request_t * local_requests, test_pair_t * P) {
+  def->rx_buffer      = rx_buffer;
+  def->rx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->tx_buffer      = tx_buffer;
+  def->tx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->channels            = channels;
+  def->channel_count       = KZ_MAX_CHANNELS;
+  def->local_requests      = local_requests;
+  def->local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  def->rx_window         = 0;
+  def->tx_budget         = 0;
+  def->queue_buffer      = NULL;
+  def->queue_buffer_size = 0;
+  def->retransmit_ticks  = 0;
+  def->datagram          = 0;
+  def->address           = 0;
+  def->tx_enable         = NULL;
+  def->tx_buffer_count   = 0;
+  def->tx_async          = 0;
+  def->rx       = NULL;
+  def->tx       = K == &P->caller ? caller_tx : server_tx;
+  def->userdata = P;
+
+  kz_init_static(K, def);
+}
+
+void test_pair_add(test_pair_t * P, kz_shard_runtime_t * R, int caller_shard, int server_shard) {
+  int ret;
+
+  ret = socketpair(AF_UNIX, SOCK_STREAM, 0, P->fds);
+  assert(ret == 0);
+
+  P->in_flight = 0;
+  P->sent      = 0;
+  atomic_init(&P->replies, 0);
+  atomic_init(&P->errors, 0);
+
+  test_endpoint_init(&P->caller, &P->caller_def, P->caller_rx_buffer, P->caller_tx_buffer,
+                     P->caller_channels, P->caller_local_requests, P);
+  test_endpoint_init(&P->server, &P->server_def, P->server_rx_buffer, P->server_tx_buffer,
+                     P->server_channels, P->server_local_requests, P);
+
+  kz_handle(&P->server, 1, double_handler, NULL);
+
+  P->caller_shard.on_tick  = caller_tick;
+  P->caller_shard.userdata = P;
+  P->server_shard.on_tick  = NULL;
+  P->server_shard.userdata = NULL;
+
+  kz_shard_add(R, &P->server_shard, &P->server, P->fds[1], server_shard);
+  kz_shard_add(R, &P->caller_shard, &P->caller, P->fds[0], caller_shard);
+}
+
+int test_pairs_done(test_pair_t * pairs) {
+  int i;
+
+  for(i = 0 ; i < TEST_PAIRS ; i ++) {
+    if(atomic_load(&pairs[i].replies) < TEST_CALLS) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void sleep_ms(long ms) {
+  struct timespec ts;
+
+  ts.tv_sec  = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
+
+START_TEST(calls_across_moves) {
+  kz_shard_runtime_t * R;
+  test_pair_t * pairs;
+  int rounds;
+  int i;
+
+  R = malloc(sizeof(*R));
+  pairs = malloc(sizeof(*pairs) * TEST_PAIRS);
+
+  ck_assert_int_eq(kz_shard_init(R, TEST_SHARDS, 1, 1), 1);
+
+  for(i = 0 ; i < TEST_PAIRS ; i ++) {
+    test_pair_add(pairs + i, R, i % TEST_SHARDS, (i + 1) % TEST_SHARDS);
+  }
+
+  ck_assert_int_eq(kz_shard_start(R), 1);
+
+  /* keep endpoints on the move while they are busy */
+  for(rounds = 0 ; !test_pairs_done(pairs) && rounds < 5000 ; rounds ++) {
+    i = rounds % TEST_PAIRS;
+    kz_shard_move(R, rounds % 2 ? &pairs[i].caller_shard : &pairs[i].server_shard, rounds % TEST_SHARDS);
+    sleep_ms(1);
+  }
+
+  kz_shard_stop(R);
+
+  /* every call was answered once, with its own results */
+  for(i = 0 ; i < TEST_PAIRS ; i ++) {
+    ck_assert_int_eq(atomic_load(&pairs[i].replies), TEST_CALLS);
+    ck_assert_int_eq(atomic_load(&pairs[i].errors), 0);
+    close(pairs[i].fds[0]);
+    close(pairs[i].fds[1]);
+  }
+
+  ck_assert_uint_gt(atomic_load(&R->moves), 0);
+
+  free(pairs);
+  free(R);
+}
+END_TEST
+
+START_TEST(balancer_spreads_load) {
+  kz_shard_runtime_t * R;
+  test_pair_t * pairs;
+  int owners[TEST_SHARDS];
+  int shards_used;
+  int rounds;
+  int i;
+
+  R = malloc(sizeof(*R));
+  pairs = malloc(sizeof(*pairs) * TEST_PAIRS);
+
+  ck_assert_int_eq(kz_shard_init(R, TEST_SHARDS, 1, 0), 1);
+  kz_shard_set_balancer(R, kz_shard_balance, NULL, 5);
+
+  /* all on one shard to begin with */
+  for(i = 0 ; i < TEST_PAIRS ; i ++) {
+    test_pair_add(pairs + i, R, 0, 0);
+  }
+
+  ck_assert_int_eq(kz_shard_start(R), 1);
+
+  for(rounds = 0 ; !test_pairs_done(pairs) && rounds < 5000 ; rounds ++) {
+    sleep_ms(1);
+  }
+
+  kz_shard_stop(R);
+
+  for(i = 0 ; i < TEST_SHARDS ; i ++) {
+    owners[i] = 0;
+  }
+
+  for(i = 0 ; i < TEST_PAIRS ; i ++) {
+    ck_assert_int_eq(atomic_load(&pairs[i].replies), TEST_CALLS);
+    ck_assert_int_eq(atomic_load(&pairs[i].errors), 0);
+    owners[atomic_load(&pairs[i].caller_shard.shard)] ++;
+    owners[atomic_load(&pairs[i].server_shard.shard)] ++;
+    close(pairs[i].fds[0]);
+    close(pairs[i].fds[1]);
+  }
+
+  /* some were moved off the first shard */
+  shards_used = 0;
+  for(i = 0 ; i < TEST_SHARDS ; i ++) {
+    shards_used += owners[i] > 0;
+  }
+
+  ck_assert_uint_gt(atomic_load(&R->moves), 0);
+  ck_assert_int_gt(shards_used, 1);
+
+  free(pairs);
+  free(R);
+}
+END_TEST
+
+START_TEST(failed_init_unwinds) {
+  kz_shard_runtime_t * R;
+  struct rlimit limit;
+  struct rlimit low;
+  int first_free;
+  int i;
+
+  R = malloc(sizeof(*R));
+
+  first_free = dup(0);
+  close(first_free);
+
+  /* room for the first shard's descriptors, and half of the second's */
+  getrlimit(RLIMIT_NOFILE, &limit);
+  low = limit;
+  low.rlim_cur = first_free + 3;
+  setrlimit(RLIMIT_NOFILE, &low);
+
+  ck_assert_int_eq(kz_shard_init(R, TEST_SHARDS, 1, 0), 0);
+
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  /* none of them are left open */
+  for(i = 0 ; i < 3 ; i ++) {
+    ck_assert_int_eq(fcntl(first_free + i, F_GETFD), -1);
+  }
+
+  /* and the runtime may be set up again */
+  ck_assert_int_eq(kz_shard_init(R, TEST_SHARDS, 1, 0), 1);
+  ck_assert_int_eq(kz_shard_start(R), 1);
+  kz_shard_stop(R);
+
+  free(R);
+}
+END_TEST
+
+Suite * kinzhal_shard_suite(void) {
+  Suite * s;
+  TCase * tc_core;
+
+  s = suite_create("Kinzhal shards");
+
+  tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, calls_across_moves);
+  tcase_add_test(tc_core, balancer_spreads_load);
+  tcase_add_test(tc_core, failed_init_unwinds);
+
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite * s;
+  SRunner * sr;
+
+  s = kinzhal_shard_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
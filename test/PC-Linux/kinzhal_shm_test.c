@@ -0,0 +1,258 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "kinzhal_shm.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_CALLS   20000
+#define TEST_WINDOW  8
+
+kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+kz_request_status_t stop_handler(kz_endpoint_t * K, void * userdata) {
+  *(int *)userdata = 1;
+
+  return KZ_OK;
+}
+
+kz_request_status_t nothing_handler(kz_endpoint_t * K, void * userdata) {
+  return KZ_OK;
+}
+
+typedef struct test_replies {
+  int count;
+  int errors;
+  int in_flight;
+} test_replies_t;
+
+test_replies_t replies;
+
+void record_double(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_int_t arg = *(kz_int_t *)userdata;
+  kz_int_t result;
+
+  replies.count ++;
+  replies.in_flight --;
+
+  if(status != KZ_OK || !kz_getint(K, &result) || result != 2*arg) {
+    replies.errors ++;
+  }
+}
+
+void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  replies.count ++;
+  replies.in_flight --;
+
+  if(status != KZ_OK) {
+    replies.errors ++;
+  }
+}
+
+int call_double(kz_endpoint_t * K, kz_int_t arg) {
+  kz_putint(K, arg);
+
+  if(!kz_callcopy(K, 1, record_double, &arg, sizeof(arg), 100, 0)) {
+    return 0;
+  }
+
+  replies.in_flight ++;
+
+  return 1;
+}
+
+/* serves the other side of the segment until asked to stop */
+void serve(int fd) {
+  kz_shm_t S;
+  int stop = 0;
+
+  if(!kz_shm_attach(&S, fd, 0)) {
+    _exit(2);
+  }
+
+  kz_handle(&S.endpoint, 1, double_handler, NULL);
+  kz_handle(&S.endpoint, 2, stop_handler, &stop);
+
+  while(!stop) {
+    kz_shm_poll(&S, 100);
+  }
+
+  kz_shm_close(&S);
+
+  _exit(0);
+}
+
+START_TEST(calls_between_processes) {
+  kz_shm_t * S;
+  pid_t child;
+  int sent = 0;
+  int status;
+
+  memset(&replies, 0, sizeof(replies));
+
+  S = malloc(sizeof(*S));
+  ck_assert_int_eq(kz_shm_create(S, NULL, 0), 1);
+
+  child = fork();
+  ck_assert_int_ge(child, 0);
+
+  if(child == 0) {
+    serve(S->fd);
+  }
+
+  /* woken by each reply */
+  while(replies.count < TEST_CALLS) {
+    while(sent < TEST_CALLS && replies.in_flight < TEST_WINDOW) {
+      ck_assert_int_eq(call_double(&S->endpoint, sent), 1);
+      sent ++;
+    }
+
+    kz_shm_poll(S, -1);
+  }
+
+  ck_assert_int_eq(replies.errors, 0);
+  ck_assert_uint_eq(atomic_load(&S->tx_ring->dropped), 0);
+  ck_assert_uint_eq(atomic_load(&S->rx_ring->dropped), 0);
+
+  /* wrapped around the ring more than once */
+  ck_assert_uint_gt(atomic_load(&S->tx_ring->head), 2*KZ_SHM_RING_SIZE);
+
+  ck_assert_int_eq(kz_call(&S->endpoint, 2, record_reply, NULL, 100), 1);
+  replies.in_flight ++;
+
+  while(replies.in_flight) {
+    kz_shm_poll(S, -1);
+  }
+
+  ck_assert_int_eq(waitpid(child, &status, 0), child);
+  ck_assert(WIFEXITED(status));
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+  ck_assert_int_eq(replies.errors, 0);
+
+  kz_shm_close(S);
+  free(S);
+}
+END_TEST
+
+START_TEST(full_ring_drops) {
+  kz_shm_t * A;
+  kz_shm_t * B;
+  kz_byte_t nils[200];
+  int sent = 0;
+  int handled;
+
+  memset(&replies, 0, sizeof(replies));
+  memset(nils, 0x80, sizeof(nils));
+
+  /* both sides in this process */
+  A = malloc(sizeof(*A));
+  B = malloc(sizeof(*B));
+  ck_assert_int_eq(kz_shm_create(A, NULL, 0), 1);
+  ck_assert_int_eq(kz_shm_attach(B, dup(A->fd), 0), 1);
+  kz_handle(&B->endpoint, 2, nothing_handler, NULL);
+
+  /* large frames, until one doesn't fit */
+  while(atomic_load(&A->tx_ring->dropped) == 0) {
+    ck_assert_int_le(sent, KZ_SHM_RING_SIZE / sizeof(nils));
+
+    kz_putraw(&A->endpoint, nils, sizeof(nils));
+    kz_send(&A->endpoint, 2);
+    sent ++;
+  }
+
+  /* every frame which fit is handled (A hasn't ticked, so it hasn't queried B's credit) */
+  handled = kz_shm_poll(B, 0);
+  ck_assert_int_eq(handled, sent - 1);
+
+  /* and there's room again */
+  kz_putraw(&A->endpoint, nils, sizeof(nils));
+  kz_send(&A->endpoint, 2);
+  ck_assert_int_eq(kz_shm_poll(B, 0), 1);
+  ck_assert_uint_eq(atomic_load(&A->tx_ring->dropped), 1);
+
+  kz_shm_close(B);
+  kz_shm_close(A);
+  free(A);
+  free(B);
+}
+END_TEST
+
+START_TEST(named_segment) {
+  kz_shm_t * A;
+  kz_shm_t * B;
+  char name[64];
+
+  memset(&replies, 0, sizeof(replies));
+
+  snprintf(name, sizeof(name), "/kinzhal-test-%d", (int)getpid());
+
+  A = malloc(sizeof(*A));
+  B = malloc(sizeof(*B));
+  ck_assert_int_eq(kz_shm_create(A, name, 0), 1);
+  ck_assert_int_eq(kz_shm_open(B, name, 0), 1);
+  kz_handle(&B->endpoint, 1, double_handler, NULL);
+
+  ck_assert_int_eq(call_double(&A->endpoint, 21), 1);
+  kz_shm_poll(B, 0);
+  kz_shm_poll(A, 0);
+
+  ck_assert_int_eq(replies.count, 1);
+  ck_assert_int_eq(replies.errors, 0);
+
+  kz_shm_close(B);
+  kz_shm_close(A);
+
+  /* unlinked once closed by its creator */
+  ck_assert_int_eq(kz_shm_open(B, name, 0), 0);
+
+  free(A);
+  free(B);
+}
+END_TEST
+
+Suite * kinzhal_shm_suite(void) {
+  Suite * s;
+  TCase * tc_core;
+
+  s = suite_create("Kinzhal shared memory");
+
+  tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, calls_between_processes);
+  tcase_add_test(tc_core, full_ring_drops);
+  tcase_add_test(tc_core, named_segment);
+
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite * s;
+  SRunner * sr;
+
+  s = kinzhal_shm_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -11,6 +11,8 @@ void null_tx(const kz_byte_t * bytes, size_t size) {}
 typedef struct test_endpoint {
   kz_endpointdef_t def;
   kz_endpoint_t endpoint;
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
 } test_endpoint_t;
 
 kz_endpoint_t * test_endpoint_init(test_endpoint_t * endpoint, size_t rx_space, size_t tx_space) {
@@ -23,8 +25,25 @@ kz_endpoint_t * test_endpoint_init(test_endpoint_t * endpoint, size_t rx_space,
   endpoint->def.tx_buffer      = malloc(tx_space);
   endpoint->def.tx_buffer_size = tx_space;
 
+  endpoint->def.channels            = endpoint->channels;
+  endpoint->def.channel_count       = KZ_MAX_CHANNELS;
+  endpoint->def.local_requests      = endpoint->local_requests;
+  endpoint->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+
+  endpoint->def.rx_window = 0;
+  endpoint->def.tx_budget = 0;
+  endpoint->def.queue_buffer = NULL;
+  endpoint->def.queue_buffer_size = 0;
+  endpoint->def.retransmit_ticks = 0;
+  endpoint->def.datagram = 0;
+  endpoint->def.address = 0;
+  endpoint->def.tx_enable = NULL;
+  endpoint->def.tx_buffer_count = 0;
+  endpoint->def.tx_async = 0;
+
   endpoint->def.rx = null_rx;
   endpoint->def.tx = null_tx;
+  endpoint->def.userdata = NULL;
 
   kz_init_static(&endpoint->endpoint, &endpoint->def);
 
@@ -38,6 +57,51 @@ void test_endpoint_deinit(test_endpoint_t * endpoint) {
 }
 
 
+/* last frame sent by any endpoint using capture_tx */
+kz_byte_t tx_capture[KZ_MAX_BUFFER_SIZE + 2];
+size_t    tx_capture_size;
+int       tx_capture_count;
+
+void capture_tx(const kz_byte_t * bytes, size_t size) {
+  assert(size <= sizeof(tx_capture));
+
+  memcpy(tx_capture, bytes, size);
+  tx_capture_size = size;
+  tx_capture_count ++;
+}
+
+/* read back the last captured frame via an endpoint's rx handler */
+size_t capture_rx_pos;
+
+int capture_rx(kz_byte_t * byte) {
+  if(capture_rx_pos < tx_capture_size) {
+    *byte = tx_capture[capture_rx_pos++];
+    return 1;
+  }
+  return 0;
+}
+
+/* feed the last captured frame to the given endpoint, as if received over the wire */
+void deliver_capture(kz_endpoint_t * K) {
+  kz_byte_t bytes[sizeof(tx_capture)];
+  size_t size;
+  size_t i;
+
+  /* handling the frame may capture another */
+  size = tx_capture_size;
+  memcpy(bytes, tx_capture, size);
+
+  ck_assert_uint_ne(size, 0);
+
+  for(i = 0 ; i < size ; i ++) {
+    if(rx_decode(K, bytes[i])) {
+      ck_assert_uint_eq(i, size - 1);
+      handle_frame(K);
+    }
+  }
+}
+
+
 void check_decode_packet(kz_endpoint_t * K,
                          const uint8_t * bytes_in,
                          size_t bytes_in_num, 
@@ -72,8 +136,8 @@ void loopback(kz_endpoint_t * K) {
 
   memcpy(rx_frame, tx_frame, len);
 
-  K->getptr = K->rx_buffer + KZ_RX_PAYLOAD_START;
   K->rx_buffer_pos = rx_frame + len;
+  set_getrange(K, K->rx_buffer + KZ_RX_PAYLOAD_START, K->rx_buffer_pos);
 }
 
 
@@ -403,6 +467,2020 @@ START_TEST(putget_floats) {
 }
 END_TEST
 
+kz_request_t * deferred_req;
+kz_int_t       deferred_arg;
+
+kz_request_status_t defer_handler(kz_endpoint_t * K, void * userdata) {
+  if(!kz_getint(K, &deferred_arg)) {
+    return KZ_INVALID;
+  }
+
+  deferred_req = kz_defer(K);
+
+  return deferred_req ? KZ_DEFER : KZ_BUSY;
+}
+
+typedef struct reply_result {
+  int                 count;
+  kz_request_status_t status;
+  kz_int_t            value;
+} reply_result_t;
+
+void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  reply_result_t * result = userdata;
+
+  result->count ++;
+  result->status = status;
+  if(!kz_getint(K, &result->value)) {
+    result->value = -1;
+  }
+}
+
+START_TEST(deferred_reply) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  memset(&result, 0, sizeof(result));
+  deferred_req = NULL;
+
+  ck_assert_int_eq(kz_handle(D, 3, defer_handler, NULL), 1);
+
+  /* deferring outside of a handler is not possible */
+  ck_assert_ptr_eq(kz_defer(D), NULL);
+
+  kz_putint(H, 7);
+  ck_assert_int_eq(kz_call(H, 3, record_reply, &result, 10), 1);
+
+  /* device defers, nothing is sent back */
+  sent = tx_capture_count;
+  deliver_capture(D);
+  ck_assert_int_eq(tx_capture_count, sent);
+  ck_assert_ptr_ne(deferred_req, NULL);
+  ck_assert_int_eq(deferred_arg, 7);
+  ck_assert_int_eq(result.count, 0);
+
+  /* reply some time later */
+  kz_putint(D, 42);
+  kz_reply(D, deferred_req, KZ_OK);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  ck_assert_int_eq(deferred_req->active, 0);
+
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 42);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+kz_task_status_t counting_task(kz_endpoint_t * K, kz_task_t * T) {
+  int * steps = T->userdata;
+
+  KZ_TASK_BEGIN(T);
+
+  for(T->locals[0] = 0 ; T->locals[0] < 3 ; T->locals[0] ++) {
+    (*steps) ++;
+    KZ_TASK_SLEEP(T, 2);
+  }
+
+  KZ_TASK_WAIT_FRAME(T, -1);
+  (*steps) ++;
+
+  KZ_TASK_END(T);
+}
+
+START_TEST(task_scheduling) {
+  test_endpoint_t test_endpoint;
+  kz_endpoint_t * K;
+  kz_task_t * T;
+  int steps = 0;
+  int i;
+
+  K = test_endpoint_init(&test_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  K->tx = capture_tx;
+  K->rx = capture_rx;
+
+  T = kz_spawn(K, counting_task, &steps);
+  ck_assert_ptr_ne(T, NULL);
+
+  /* first step happens on the next tick, then every other tick */
+  kz_tick(K);
+  ck_assert_int_eq(steps, 1);
+  kz_tick(K);
+  ck_assert_int_eq(steps, 1);
+  kz_tick(K);
+  ck_assert_int_eq(steps, 2);
+  kz_tick(K);
+  kz_tick(K);
+  ck_assert_int_eq(steps, 3);
+
+  /* now waiting on a frame, ticks alone shouldn't wake it */
+  for(i = 0 ; i < 10 ; i ++) {
+    kz_tick(K);
+  }
+  ck_assert_int_eq(steps, 3);
+  ck_assert_ptr_eq(T->fn, counting_task);
+
+  /* any frame will do */
+  kz_send(K, 1);
+  capture_rx_pos = 0;
+  kz_tick(K);
+  ck_assert_int_eq(steps, 4);
+
+  /* task finished, its slot is free again */
+  ck_assert_ptr_eq(T->fn, NULL);
+
+  test_endpoint_deinit(&test_endpoint);
+}
+END_TEST
+
+kz_request_status_t ok_handler(kz_endpoint_t * K, void * userdata) {
+  return KZ_OK;
+}
+
+START_TEST(flow_control) {
+  kz_byte_t queue[64];
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MIN_BUFFER_SIZE, KZ_MIN_BUFFER_SIZE);
+
+  /* restart both with flow control */
+  host_endpoint.def.queue_buffer = queue;
+  host_endpoint.def.queue_buffer_size = sizeof(queue);
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+  kz_tick(H);
+
+  /* peer hasn't advertised anything, credit is unlimited */
+  ck_assert_int_lt(H->tx_credits, 0);
+
+  device_endpoint.def.rx_window = 1;
+  device_endpoint.def.tx = capture_tx;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 2, ok_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* device announces its window on its first tick, not before */
+  sent = tx_capture_count;
+  ck_assert_int_eq(D->tx_credits, -1);
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  deliver_capture(H);
+  ck_assert_int_eq(H->tx_credits, 1);
+  ck_assert_uint_eq(H->tx_payload_max, KZ_MIN_BUFFER_SIZE - KZ_HEADER_SIZE);
+
+  /* too large for the device to ever receive */
+  ck_assert_int_eq(kz_putlistopen(H), 1);
+  while(H->putptr - (H->tx_buffer + KZ_TX_PAYLOAD_START) <= KZ_MIN_BUFFER_SIZE) {
+    ck_assert_int_eq(kz_putnil(H), 1);
+  }
+  ck_assert_int_eq(kz_putlistclose(H), 1);
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, 10), 0);
+
+  /* first call is sent, the second waits for credit */
+  sent = tx_capture_count;
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  ck_assert_int_eq(H->tx_credits, 0);
+
+  /* device handles the first call and replies */
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+
+  /* device returns the credit at the end of its tick */
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 3);
+  deliver_capture(H);
+  ck_assert_int_eq(H->tx_credits, 1);
+
+  /* queued call goes out on the host's next tick */
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 4);
+  ck_assert_int_eq(H->tx_credits, 0);
+  ck_assert_ptr_eq(H->queue_pos, H->queue_buffer);
+
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.status, KZ_OK);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(credit_after_loss) {
+  kz_byte_t queue[64];
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  host_endpoint.def.queue_buffer = queue;
+  host_endpoint.def.queue_buffer_size = sizeof(queue);
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+  kz_tick(H);
+
+  device_endpoint.def.rx_window = 1;
+  device_endpoint.def.tx = capture_tx;
+  kz_init_static(D, &device_endpoint.def);
+  kz_tick(D);
+  deliver_capture(H);
+  ck_assert_int_eq(H->tx_credits, 1);
+
+  ck_assert_int_eq(kz_handle(D, 2, ok_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* the first request is lost, the second waits for the credit it used */
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, 3), 1);
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, KZ_NO_TIMEOUT), 1);
+  ck_assert_int_eq(H->tx_credits, 0);
+
+  /* the first times out, and the device's credit is queried on the next tick:
+   * [ code ] [ 0x53 ] [ GRANT ] [ FLAGS ] ... */
+  for(i = 0 ; i < 3 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+
+  sent = tx_capture_count;
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  ck_assert_uint_eq(tx_capture[1], KZ_HEADER_CREDIT);
+  ck_assert_uint_eq(tx_capture[3], KZ_CREDIT_QUERY);
+
+  /* the device answers with its whole window, and the second call goes out */
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(H->tx_credits, 1);
+  kz_tick(H);
+  ck_assert_int_eq(H->tx_credits, 0);
+  ck_assert_ptr_eq(H->queue_pos, H->queue_buffer);
+
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.status, KZ_OK);
+
+  /* the credit returned for it is lost too, and nothing times out this time */
+  kz_tick(D);
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, KZ_NO_TIMEOUT), 1);
+  ck_assert_ptr_ne(H->queue_pos, H->queue_buffer);
+
+  /* so the device's credit is queried again once it has stayed used up for long enough */
+  sent = tx_capture_count;
+  for(i = 1 ; i < KZ_CREDIT_QUERY_TICKS ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(tx_capture_count, sent);
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  ck_assert_uint_eq(tx_capture[1], KZ_HEADER_CREDIT);
+
+  deliver_capture(D);
+  deliver_capture(H);
+  kz_tick(H);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 3);
+  ck_assert_int_eq(result.status, KZ_OK);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(priorities) {
+  kz_byte_t queue[64];
+  test_endpoint_t test_endpoint;
+  kz_endpoint_t * K;
+  int sent;
+
+  K = test_endpoint_init(&test_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  /* room for a single empty frame per tick */
+  test_endpoint.def.tx_budget = KZ_HEADER_SIZE + KZ_COBS_OVERHEAD;
+  test_endpoint.def.queue_buffer = queue;
+  test_endpoint.def.queue_buffer_size = sizeof(queue);
+  test_endpoint.def.tx = capture_tx;
+  kz_init_static(K, &test_endpoint.def);
+  kz_tick(K);
+
+  ck_assert_int_eq(kz_priority(K, 1, 0), 1);
+  ck_assert_int_eq(kz_priority(K, 5, KZ_PRIORITY_LEVELS - 1), 1);
+  ck_assert_int_eq(kz_priority(K, 5, KZ_PRIORITY_LEVELS), 0);
+
+  /* a bulk transfer, only the first frame fits this tick */
+  sent = tx_capture_count;
+  kz_send(K, 5);
+  kz_send(K, 5);
+  kz_send(K, 5);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  /* urgent frame, also has to wait */
+  kz_send(K, 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  /* ...but goes out first: [ code ] [ 0x50 ] [ 0xFF ] [ CHANID ] ... */
+  kz_tick(K);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  ck_assert_uint_eq(tx_capture[3], 1);
+
+  kz_tick(K);
+  ck_assert_int_eq(tx_capture_count, sent + 3);
+  ck_assert_uint_eq(tx_capture[3], 5);
+
+  /* per-call priority overrides the channel's */
+  ck_assert_int_eq(kz_callf(K, 5, record_reply, NULL, 10, KZ_CALL_PRIORITY(0)), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 3);
+
+  kz_tick(K);
+  ck_assert_int_eq(tx_capture_count, sent + 4);
+  ck_assert_uint_eq(tx_capture[1], KZ_HEADER_REQUEST);
+  ck_assert_uint_ne(tx_capture[2], 0xFF);
+
+  kz_tick(K);
+  ck_assert_int_eq(tx_capture_count, sent + 5);
+  ck_assert_uint_eq(tx_capture[2], 0xFF);
+  ck_assert_ptr_eq(K->queue_pos, K->queue_buffer);
+
+  test_endpoint_deinit(&test_endpoint);
+}
+END_TEST
+
+kz_request_status_t stream_handler(kz_endpoint_t * K, void * userdata) {
+  kz_request_t * req;
+  kz_int_t i;
+
+  req = kz_defer(K);
+  if(!req) {
+    return KZ_BUSY;
+  }
+
+  for(i = 0 ; i < 3 ; i ++) {
+    kz_putint(K, i);
+    kz_replypart(K, req);
+    /* hand each part over as it is sent */
+    deliver_capture(userdata);
+  }
+
+  /* ends the stream */
+  return KZ_OK;
+}
+
+typedef struct stream_result {
+  int      parts;
+  int      done;
+  kz_int_t sum;
+} stream_result_t;
+
+void record_stream(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  stream_result_t * result = userdata;
+  kz_int_t i;
+
+  if(status == KZ_MORE) {
+    ck_assert_int_eq(kz_getint(K, &i), 1);
+    result->parts ++;
+    result->sum += i;
+  } else {
+    ck_assert_int_eq(status, KZ_OK);
+    ck_assert_int_eq(kz_getint(K, &i), 0);
+    result->done ++;
+  }
+}
+
+START_TEST(streamed_reply) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  stream_result_t result;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+  kz_tick(H);
+  kz_tick(D);
+
+  memset(&result, 0, sizeof(result));
+
+  ck_assert_int_eq(kz_handle(D, 4, stream_handler, H), 1);
+  ck_assert_int_eq(kz_call(H, 4, record_stream, &result, 2), 1);
+
+  /* the call doesn't time out while parts keep coming */
+  kz_tick(H);
+  deliver_capture(D);
+  ck_assert_int_eq(result.parts, 3);
+  ck_assert_int_eq(result.sum, 0 + 1 + 2);
+  ck_assert_int_eq(result.done, 0);
+  ck_assert_ptr_ne(H->local_requests[0].callback, NULL);
+  ck_assert_int_eq(H->local_requests[0].timeout_ticks, 2);
+
+  /* final reply */
+  deliver_capture(H);
+  ck_assert_int_eq(result.done, 1);
+  ck_assert_ptr_eq(H->local_requests[0].callback, NULL);
+
+  /* device's slot has been released */
+  for(i = 0 ; i < KZ_MAX_FOREIGN_REQUESTS ; i ++) {
+    ck_assert_int_eq(D->foreign_requests[i].active, 0);
+  }
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  /* arguments are limited to this call's */
+  ck_assert_int_eq(kz_getint(K, &i), 0);
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+typedef struct batch_result {
+  int                 count;
+  int                 entries;
+  kz_request_status_t status[4];
+  kz_int_t            value[4];
+} batch_result_t;
+
+void record_batch(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  batch_result_t * result = userdata;
+  kz_request_status_t entry_status;
+
+  result->count ++;
+  ck_assert_int_eq(status, KZ_OK);
+
+  while(kz_getbatchentry(K, &entry_status)) {
+    ck_assert_int_lt(result->entries, 4);
+
+    result->status[result->entries] = entry_status;
+    if(!kz_getint(K, &result->value[result->entries])) {
+      result->value[result->entries] = -1;
+    }
+
+    result->entries ++;
+  }
+}
+
+START_TEST(batched_calls) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  batch_result_t result;
+  int sent;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  memset(&result, 0, sizeof(result));
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(D, 2, defer_handler, NULL), 1);
+
+  /* empty batches aren't sent */
+  kz_batchbegin(H);
+  ck_assert_int_eq(kz_batchcall(H, record_batch, &result, 10), 0);
+
+  kz_batchbegin(H);
+  ck_assert_int_eq(kz_batchadd(H, 1), 1);
+  kz_putint(H, 21);
+  ck_assert_int_eq(kz_batchadd(H, 1), 1);
+  kz_putint(H, -1000);
+  /* this channel has no handler */
+  ck_assert_int_eq(kz_batchadd(H, 9), 1);
+  /* this handler can't defer */
+  ck_assert_int_eq(kz_batchadd(H, 2), 1);
+  kz_putint(H, 5);
+
+  sent = tx_capture_count;
+  ck_assert_int_eq(kz_batchcall(H, record_batch, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  /* a single reply comes back */
+  deliver_capture(D);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  deliver_capture(H);
+
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.entries, 4);
+  ck_assert_int_eq(result.status[0], KZ_OK);
+  ck_assert_int_eq(result.value[0], 42);
+  ck_assert_int_eq(result.status[1], KZ_OK);
+  ck_assert_int_eq(result.value[1], -2000);
+  ck_assert_int_eq(result.status[2], KZ_IGNORE);
+  ck_assert_int_eq(result.value[2], -1);
+  ck_assert_int_eq(result.status[3], KZ_BUSY);
+  ck_assert_int_eq(result.value[3], -1);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+kz_int_t telemetry_value;
+
+kz_request_status_t telemetry_handler(kz_endpoint_t * K, void * userdata) {
+  kz_putint(K, telemetry_value);
+  return KZ_OK;
+}
+
+START_TEST(subscriptions) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int subscription;
+  int sent;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+  kz_tick(H);
+  kz_tick(D);
+
+  memset(&result, 0, sizeof(result));
+  telemetry_value = 10;
+
+  ck_assert_int_eq(kz_handle(D, 7, telemetry_handler, NULL), 1);
+
+  subscription = kz_subscribe(H, 7, KZ_SUBSCRIBE_ONCHANGE, 2, record_reply, &result, KZ_NO_TIMEOUT);
+  ck_assert_int_ge(subscription, 0);
+
+  sent = tx_capture_count;
+  deliver_capture(D);
+  ck_assert_int_eq(tx_capture_count, sent);
+
+  /* first results are always sent */
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_MORE);
+  ck_assert_int_eq(result.value, 10);
+
+  /* unchanged, nothing sent */
+  kz_tick(D);
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  /* changed, but only checked once per period */
+  telemetry_value = 11;
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  kz_tick(D);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.value, 11);
+
+  /* host doesn't give up on a subscription without a timeout */
+  for(sent = 0 ; sent < 10 ; sent ++) {
+    kz_tick(H);
+  }
+  ck_assert_ptr_ne(H->local_requests[subscription % KZ_MAX_LOCAL_REQUESTS].callback, NULL);
+
+  /* end it */
+  ck_assert_int_eq(kz_unsubscribe(H, subscription, 10), 1);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 3);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_ptr_eq(H->local_requests[subscription % KZ_MAX_LOCAL_REQUESTS].callback, NULL);
+  ck_assert_int_eq(D->subscriptions[0].mode, 0);
+
+  /* subscribing to nothing fails */
+  subscription = kz_subscribe(H, 9, KZ_SUBSCRIBE_PERIODIC, 1, record_reply, &result, 10);
+  ck_assert_int_ge(subscription, 0);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 4);
+  ck_assert_int_eq(result.status, KZ_INVALID);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(retransmission) {
+  kz_byte_t queue[64];
+  kz_byte_t stale_reply[sizeof(tx_capture)];
+  size_t stale_reply_size;
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  /* restart the host, resending after 2 ticks */
+  host_endpoint.def.queue_buffer = queue;
+  host_endpoint.def.queue_buffer_size = sizeof(queue);
+  host_endpoint.def.retransmit_ticks = 2;
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+  kz_tick(H);
+  D->tx = capture_tx;
+
+  ck_assert_int_eq(kz_handle(D, 2, ok_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* the first request is lost */
+  sent = tx_capture_count;
+  ck_assert_int_eq(kz_callf(H, 2, record_reply, &result, 20, KZ_CALL_IDEMPOTENT), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+
+  /* and so is the second, which is retried twice as late */
+  for(i = 0 ; i < 3 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  kz_tick(H);
+  ck_assert_int_eq(tx_capture_count, sent + 3);
+
+  /* the third makes it */
+  deliver_capture(D);
+  stale_reply_size = tx_capture_size;
+  memcpy(stale_reply, tx_capture, stale_reply_size);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_ptr_eq(H->queue_pos, H->queue_buffer);
+
+  /* a duplicate reply is ignored, even once the request object has been reused */
+  deliver_capture(H);
+  ck_assert_int_eq(kz_call(H, 2, record_reply, &result, 20), 1);
+  memcpy(tx_capture, stale_reply, stale_reply_size);
+  tx_capture_size = stale_reply_size;
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_ptr_ne(H->local_requests[0].callback, NULL);
+
+  /* other calls aren't retransmitted */
+  sent = tx_capture_count;
+  for(i = 0 ; i < 20 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(tx_capture_count, sent);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+
+  /* retransmission gives up eventually, and the call times out as usual */
+  ck_assert_int_eq(kz_callf(H, 2, record_reply, &result, 20, KZ_CALL_IDEMPOTENT), 1);
+  for(i = 0 ; i < 20 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(tx_capture_count, sent + 1 + KZ_MAX_RETRANSMITS);
+  ck_assert_int_eq(result.count, 3);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+  ck_assert_ptr_eq(H->queue_pos, H->queue_buffer);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(cached_replies) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  memset(&result, 0, sizeof(result));
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_cache(H, 1, 3), 1);
+  ck_assert_int_eq(kz_cache(H, KZ_MAX_CHANNELS, 3), 0);
+
+  /* first call goes to the device */
+  sent = tx_capture_count;
+  kz_putint(H, 4);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 8);
+
+  /* the same call is answered right away */
+  kz_putint(H, 4);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 8);
+  ck_assert_ptr_eq(H->putptr, H->tx_buffer + KZ_TX_PAYLOAD_START);
+
+  /* different arguments, different reply */
+  kz_putint(H, 5);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 3);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.value, 10);
+
+  /* unless asked not to */
+  kz_putint(H, 4);
+  ck_assert_int_eq(kz_callf(H, 1, record_reply, &result, 10, KZ_CALL_NOCACHE), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 5);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 4);
+
+  /* failures aren't cached */
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.status, KZ_INVALID);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 9);
+
+  /* expired */
+  for(i = 0 ; i < 3 ; i ++) {
+    kz_tick(H);
+  }
+  sent = tx_capture_count;
+  kz_putint(H, 4);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(coalesced_calls) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int sent;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  memset(&result, 0, sizeof(result));
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+
+  /* only the first of three identical calls is sent */
+  sent = tx_capture_count;
+  for(i = 0 ; i < 3 ; i ++) {
+    kz_putint(H, 3);
+    ck_assert_int_eq(kz_callf(H, 1, record_reply, &result, 10, KZ_CALL_IDEMPOTENT), 1);
+  }
+  ck_assert_int_eq(tx_capture_count, sent + 1);
+
+  /* all are given the one reply */
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 3);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 6);
+  for(i = 0 ; i < KZ_MAX_LOCAL_REQUESTS ; i ++) {
+    ck_assert_ptr_eq(H->local_requests[i].callback, NULL);
+  }
+
+  /* calls which aren't idempotent are always sent */
+  sent = tx_capture_count;
+  kz_putint(H, 3);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  kz_putint(H, 3);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 2);
+
+  /* and so are those with other arguments */
+  kz_putint(H, 3);
+  ck_assert_int_eq(kz_callf(H, 1, record_reply, &result, 2, KZ_CALL_IDEMPOTENT), 1);
+  kz_putint(H, 4);
+  ck_assert_int_eq(kz_callf(H, 1, record_reply, &result, 10, KZ_CALL_IDEMPOTENT), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 4);
+
+  /* a call sharing another's reply also shares its timeout */
+  kz_putint(H, 3);
+  ck_assert_int_eq(kz_callf(H, 1, record_reply, &result, 10, KZ_CALL_IDEMPOTENT), 1);
+  ck_assert_int_eq(tx_capture_count, sent + 4);
+  kz_tick(H);
+  kz_tick(H);
+  ck_assert_int_eq(result.count, 5);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+typedef struct context_result {
+  int                 count;
+  kz_request_status_t status;
+  int                 context;
+} context_result_t;
+
+context_result_t context_result;
+
+void record_context(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  int * context = userdata;
+
+  context_result.count ++;
+  context_result.status  = status;
+  context_result.context = *context;
+
+  /* belongs to the call, not to the caller */
+  *context = -1;
+}
+
+START_TEST(call_context) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  kz_byte_t too_big[KZ_CALL_CONTEXT_SIZE + 1];
+  int context;
+  int sent;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  memset(&context_result, 0, sizeof(context_result));
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+
+  /* the handler sees the context as it was when the call was made */
+  context = 7;
+  kz_putint(H, 2);
+  ck_assert_int_eq(kz_callcopy(H, 1, record_context, &context, sizeof(context), 10, 0), 1);
+  context = 8;
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(context_result.count, 1);
+  ck_assert_int_eq(context_result.status, KZ_OK);
+  ck_assert_int_eq(context_result.context, 7);
+  ck_assert_int_eq(context, 8);
+
+  /* also when the call times out */
+  context = 9;
+  kz_putint(H, 2);
+  ck_assert_int_eq(kz_callcopy(H, 1, record_context, &context, sizeof(context), 1, 0), 1);
+  kz_tick(H);
+  ck_assert_int_eq(context_result.count, 2);
+  ck_assert_int_eq(context_result.status, KZ_IGNORE);
+  ck_assert_int_eq(context_result.context, 9);
+
+  /* and when it is answered from the cache */
+  ck_assert_int_eq(kz_cache(H, 1, 3), 1);
+  context = 10;
+  kz_putint(H, 2);
+  ck_assert_int_eq(kz_callcopy(H, 1, record_context, &context, sizeof(context), 10, 0), 1);
+  deliver_capture(D);
+  deliver_capture(H);
+  context = 11;
+  sent = tx_capture_count;
+  kz_putint(H, 2);
+  ck_assert_int_eq(kz_callcopy(H, 1, record_context, &context, sizeof(context), 10, 0), 1);
+  ck_assert_int_eq(tx_capture_count, sent);
+  ck_assert_int_eq(context_result.count, 4);
+  ck_assert_int_eq(context_result.context, 11);
+  ck_assert_int_eq(context, 11);
+
+  /* context which doesn't fit */
+  memset(too_big, 0, sizeof(too_big));
+  kz_putint(H, 3);
+  ck_assert_int_eq(kz_callcopy(H, 1, record_context, too_big, sizeof(too_big), 10, 0), 0);
+  ck_assert_int_eq(tx_capture_count, sent);
+  ck_assert_ptr_eq(H->putptr, H->tx_buffer + KZ_TX_PAYLOAD_START);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+/* feed the last captured frame to the given datagram endpoint, whole */
+void deliver_capture_frame(kz_endpoint_t * K) {
+  kz_byte_t frame[sizeof(tx_capture)];
+  size_t size;
+
+  /* handling the frame may capture another */
+  size = tx_capture_size;
+  memcpy(frame, tx_capture, size);
+
+  kz_receiveframe(K, frame, size);
+}
+
+START_TEST(datagram_frames) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  /* restart both as datagram endpoints */
+  host_endpoint.def.datagram = 1;
+  host_endpoint.def.rx = NULL;
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+
+  device_endpoint.def.datagram = 1;
+  device_endpoint.def.rx = NULL;
+  device_endpoint.def.tx = capture_tx;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* the request is sent as it is: header, then payload, zeros and all */
+  ck_assert_int_eq(kz_putint(H, 0), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+
+  ck_assert_uint_eq(tx_capture_size, KZ_HEADER_SIZE + 1);
+  ck_assert_uint_eq(tx_capture[0], KZ_HEADER_REQUEST);
+  ck_assert_uint_eq(tx_capture[2], 1);
+  ck_assert_uint_eq(tx_capture[4], 0x00);
+
+  /* and handled in place, without touching the receive buffer */
+  deliver_capture_frame(D);
+  ck_assert_ptr_eq(D->rx_buffer, device_endpoint.def.rx_buffer);
+  ck_assert_ptr_eq(D->rx_buffer_pos, D->rx_buffer);
+  ck_assert_uint_eq(tx_capture[0], KZ_HEADER_REPLY);
+
+  deliver_capture_frame(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 0);
+
+  /* another, with a larger argument */
+  ck_assert_int_eq(kz_putint(H, 1000), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  deliver_capture_frame(D);
+  deliver_capture_frame(H);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.value, 2000);
+
+  /* frames too short for a header are ignored */
+  tx_capture_size = KZ_HEADER_SIZE - 1;
+  deliver_capture_frame(D);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(datagram_credit) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, 64, KZ_MAX_BUFFER_SIZE);
+
+  /* restart both as datagram endpoints, the device with a window */
+  host_endpoint.def.datagram = 1;
+  host_endpoint.def.rx = NULL;
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+
+  device_endpoint.def.datagram = 1;
+  device_endpoint.def.rx_window = 2;
+  device_endpoint.def.rx = NULL;
+  device_endpoint.def.tx = capture_tx;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* the device advertises what its receive buffer holds */
+  kz_tick(D);
+  deliver_capture_frame(H);
+  ck_assert_int_eq(H->tx_credits, 2);
+  ck_assert_uint_eq(H->tx_payload_max, 64 - KZ_HEADER_SIZE);
+
+  /* and again when asked, while the query stands in for its receive buffer */
+  kz_tick(H);
+  ck_assert_uint_eq(tx_capture[0], KZ_HEADER_CREDIT);
+  deliver_capture_frame(D);
+  ck_assert_ptr_eq(D->rx_buffer, device_endpoint.def.rx_buffer);
+  ck_assert_ptr_eq(D->rx_buffer_end, D->rx_buffer + 64);
+
+  H->tx_payload_max = 0;
+  deliver_capture_frame(H);
+  ck_assert_int_eq(H->tx_credits, 2);
+  ck_assert_uint_eq(H->tx_payload_max, 64 - KZ_HEADER_SIZE);
+
+  /* a call uses credit, which the device returns at the end of its tick */
+  ck_assert_int_eq(kz_putint(H, 1000), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_int_eq(H->tx_credits, 1);
+  deliver_capture_frame(D);
+  deliver_capture_frame(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 2000);
+
+  kz_tick(D);
+  deliver_capture_frame(H);
+  ck_assert_int_eq(H->tx_credits, 2);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(routed_calls) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t upstream_endpoint;
+  test_endpoint_t downstream_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * U;
+  kz_endpoint_t * E;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  reply_result_t filler;
+  int count;
+  int i;
+
+  /* host -> U (bridge) E -> device */
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  U = test_endpoint_init(&upstream_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  E = test_endpoint_init(&downstream_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  U->tx = capture_tx;
+  E->tx = capture_tx;
+  D->tx = capture_tx;
+
+  /* the device's channels appear as 8 to 15 to the host */
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(U, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_route(U, 8, 8, E, 0, 5), 1);
+  memset(&result, 0, sizeof(result));
+
+  ck_assert_int_eq(kz_putint(H, 21), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+
+  /* forwarded as it was, but for its reqid and channel */
+  count = tx_capture_count;
+  deliver_capture(U);
+  ck_assert_int_eq(tx_capture_count, count + 1);
+  ck_assert_ptr_eq(find_local_request(E, E->local_requests[0].reqid), E->local_requests + 0);
+  ck_assert_ptr_eq(E->local_requests[0].callback, forward_reply);
+
+  deliver_capture(D);
+  deliver_capture(E);
+  ck_assert_ptr_eq(E->local_requests[0].callback, NULL);
+
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 42);
+
+  /* channels outside the route are still handled by the bridge */
+  ck_assert_int_eq(kz_putint(H, 5), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 2);
+  ck_assert_int_eq(result.value, 10);
+
+  /* answered by the bridge if the downstream endpoint can't take another request */
+  for(i = 0 ; i < KZ_MAX_LOCAL_REQUESTS ; i ++) {
+    ck_assert_int_eq(kz_call(E, 1, record_reply, &filler, 10), 1);
+  }
+
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 3);
+  ck_assert_int_eq(result.status, KZ_BUSY);
+
+  for(i = 0 ; i < 10 ; i ++) {
+    kz_tick(E);
+  }
+
+  /* a forwarded request which times out downstream isn't answered */
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+
+  count = tx_capture_count;
+  for(i = 0 ; i < 5 ; i ++) {
+    kz_tick(E);
+  }
+  ck_assert_int_eq(tx_capture_count, count);
+  ck_assert_ptr_eq(E->local_requests[0].callback, NULL);
+
+  for(i = 0 ; i < 10 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(result.count, 4);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+
+  /* nor is one which expects no reply */
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  kz_send(H, 9);
+  deliver_capture(U);
+  ck_assert_uint_eq(E->local_requests[0].callback == NULL, 1);
+
+  /* a frame being built downstream isn't overwritten, the request is answered with KZ_BUSY */
+  ck_assert_int_eq(kz_putint(E, 0x33), 1);
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  ck_assert_ptr_eq(E->putptr, E->tx_buffer + KZ_TX_PAYLOAD_START + 1);
+  ck_assert_uint_eq(E->tx_buffer[KZ_TX_PAYLOAD_START], 0x33);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 5);
+  ck_assert_int_eq(result.status, KZ_BUSY);
+  kz_putclear(E);
+
+  /* nor is one being built upstream, the reply is lost instead */
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  deliver_capture(D);
+  ck_assert_int_eq(kz_putint(U, 0x33), 1);
+  count = tx_capture_count;
+  deliver_capture(E);
+  ck_assert_int_eq(tx_capture_count, count);
+  ck_assert_ptr_eq(U->putptr, U->tx_buffer + KZ_TX_PAYLOAD_START + 1);
+  ck_assert_uint_eq(U->tx_buffer[KZ_TX_PAYLOAD_START], 0x33);
+  ck_assert_ptr_eq(E->local_requests[0].callback, NULL);
+  kz_putclear(U);
+
+  for(i = 0 ; i < 10 ; i ++) {
+    kz_tick(H);
+  }
+  ck_assert_int_eq(result.count, 6);
+  ck_assert_int_eq(result.status, KZ_IGNORE);
+
+  /* a request which can't be sent downstream is answered with KZ_BUSY, and its slot in the
+   * downstream pool (smaller than the bridge's) used for the next one */
+  downstream_endpoint.def.local_request_count = 3;
+  downstream_endpoint.def.tx = capture_tx;
+  kz_init_static(E, &downstream_endpoint.def);
+  E->tx_credits = 0;
+
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 7);
+  ck_assert_int_eq(result.status, KZ_BUSY);
+  ck_assert_ptr_eq(E->local_requests[0].callback, NULL);
+  ck_assert_uint_eq(E->local_requests[0].reqid % 3, 0);
+
+  E->tx_credits = -1;
+  ck_assert_int_eq(kz_putint(H, 21), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  deliver_capture(U);
+  ck_assert_ptr_eq(E->local_requests[0].callback, forward_reply);
+  deliver_capture(D);
+  deliver_capture(E);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 8);
+  ck_assert_int_eq(result.status, KZ_OK);
+  ck_assert_int_eq(result.value, 42);
+
+  /* removed */
+  ck_assert_int_eq(kz_route(U, 8, 0, NULL, 0, 0), 1);
+  count = tx_capture_count;
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 9, record_reply, &result, 10), 1);
+  ck_assert_int_eq(tx_capture_count, count + 1);
+  deliver_capture(U);
+  ck_assert_int_eq(tx_capture_count, count + 1);
+
+  /* no more room */
+  ck_assert_int_eq(kz_route(U, 0, 1, E, 0, 5), 1);
+  ck_assert_int_eq(kz_route(U, 2, 1, E, 0, 5), 1);
+  ck_assert_int_eq(kz_route(U, 4, 1, E, 0, 5), 0);
+  ck_assert_int_eq(kz_route(U, 250, 10, E, 0, 5), 0);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&upstream_endpoint);
+  test_endpoint_deinit(&downstream_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+/* # of times a bus was taken, and released */
+int bus_taken;
+int bus_released;
+
+void count_tx_enable(kz_endpoint_t * K, int enable) {
+  if(enable) {
+    ck_assert_int_eq(bus_taken, bus_released);
+    bus_taken ++;
+  } else {
+    ck_assert_int_eq(bus_taken, bus_released + 1);
+    bus_released ++;
+  }
+}
+
+/* restart an endpoint on a bus with the given address */
+kz_endpoint_t * test_endpoint_attach(test_endpoint_t * endpoint, kz_byte_t address) {
+  endpoint->def.address = address;
+  endpoint->def.tx = capture_tx;
+  endpoint->def.tx_enable = count_tx_enable;
+
+  kz_init_static(&endpoint->endpoint, &endpoint->def);
+
+  /* the first tick is when an endpoint would query the peer's credit */
+  kz_tick(&endpoint->endpoint);
+
+  return &endpoint->endpoint;
+}
+
+START_TEST(multidrop_bus) {
+  test_endpoint_t endpoints[4];
+  kz_endpoint_t * C1;
+  kz_endpoint_t * C2;
+  kz_endpoint_t * N1;
+  kz_endpoint_t * N2;
+  kz_endpoint_t * bus[4];
+  reply_result_t result1;
+  reply_result_t result2;
+  int count;
+  int i;
+
+  for(i = 0 ; i < 4 ; i ++) {
+    bus[i] = test_endpoint_init(endpoints + i, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  }
+
+  bus_taken = 0;
+  bus_released = 0;
+
+  /* nodes start without a word */
+  count = tx_capture_count;
+  N1 = test_endpoint_attach(endpoints + 2, KZ_NODE_ADDRESS(1));
+  N2 = test_endpoint_attach(endpoints + 3, KZ_NODE_ADDRESS(2));
+  ck_assert_int_eq(tx_capture_count, count);
+  ck_assert_int_eq(bus_taken, 0);
+
+  /* the controller asks each for its credit */
+  C1 = test_endpoint_attach(endpoints + 0, KZ_CONTROLLER_ADDRESS(1));
+  ck_assert_uint_eq(tx_capture[1 + 3], 1);
+  C2 = test_endpoint_attach(endpoints + 1, KZ_CONTROLLER_ADDRESS(2));
+  ck_assert_uint_eq(tx_capture[1 + 3], 2);
+  ck_assert_int_eq(tx_capture_count, count + 2);
+  ck_assert_int_eq(bus_taken, 2);
+  ck_assert_int_eq(bus_released, 2);
+
+  ck_assert_int_eq(kz_handle(N1, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(N2, 1, double_handler, NULL), 1);
+  memset(&result1, 0, sizeof(result1));
+  memset(&result2, 0, sizeof(result2));
+
+  ck_assert_int_eq(kz_putint(C2, 0x7F), 1);
+  ck_assert_int_eq(kz_call(C2, 1, record_reply, &result2, 10), 1);
+
+  /* everyone on the bus hears the request, including its sender */
+  count = tx_capture_count;
+  deliver_capture(C1);
+  deliver_capture(C2);
+  deliver_capture(N1);
+  ck_assert_int_eq(tx_capture_count, count);
+
+  /* the others stopped decoding once they had read the header */
+  for(i = 0 ; i < 3 ; i ++) {
+    ck_assert_ptr_eq(bus[i]->rx_buffer_pos, bus[i]->rx_buffer + 4);
+  }
+
+  /* only the node it is for answers */
+  deliver_capture(N2);
+  ck_assert_int_eq(tx_capture_count, count + 1);
+  ck_assert_uint_eq(tx_capture[1 + 3], 0x82);
+
+  deliver_capture(N1);
+  deliver_capture(N2);
+  deliver_capture(C1);
+  ck_assert_int_eq(result1.count, 0);
+  deliver_capture(C2);
+  ck_assert_int_eq(result2.count, 1);
+  ck_assert_int_eq(result2.value, 0xFE);
+
+  /* the bus is released after every frame */
+  ck_assert_int_eq(bus_taken, 4);
+  ck_assert_int_eq(bus_released, 4);
+
+  for(i = 0 ; i < 4 ; i ++) {
+    test_endpoint_deinit(endpoints + i);
+  }
+}
+END_TEST
+
+/* last frame sent by each endpoint using mailbox_tx, which is given by its userdata */
+typedef struct mailbox {
+  kz_byte_t bytes[KZ_MAX_BUFFER_SIZE + 2];
+  size_t size;
+} mailbox_t;
+
+void mailbox_tx(const kz_byte_t * bytes, size_t size) {
+  mailbox_t * box = kz_userdata();
+
+  assert(size <= sizeof(box->bytes));
+
+  memcpy(box->bytes, bytes, size);
+  box->size = size;
+}
+
+/* feed the frame in a mailbox to the given endpoint, as if received over the wire */
+void deliver_mailbox(kz_endpoint_t * K, mailbox_t * box) {
+  ck_assert_uint_ne(box->size, 0);
+
+  kz_receive(K, box->bytes, box->size);
+  box->size = 0;
+}
+
+typedef struct fanout_result {
+  int replies;
+  kz_int_t sum;
+  int done;
+} fanout_result_t;
+
+void sum_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  fanout_result_t * result = userdata;
+  kz_int_t value;
+
+  result->replies ++;
+  if(status == KZ_OK && kz_getint(K, &value)) {
+    result->sum += value;
+  }
+}
+
+void record_fanout(kz_fanout_t * F, void * userdata) {
+  fanout_result_t * result = userdata;
+
+  result->done ++;
+}
+
+START_TEST(fanout_calls) {
+  test_endpoint_t host_endpoints[3];
+  test_endpoint_t device_endpoints[3];
+  mailbox_t mailboxes[3];
+  kz_endpoint_t * hosts[3];
+  kz_endpoint_t * devices[3];
+  kz_fanout_t F;
+  fanout_result_t result;
+  int i;
+
+  for(i = 0 ; i < 3 ; i ++) {
+    hosts[i] = test_endpoint_init(host_endpoints + i, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+    devices[i] = test_endpoint_init(device_endpoints + i, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+    hosts[i]->tx = mailbox_tx;
+    hosts[i]->userdata = mailboxes + i;
+    devices[i]->tx = capture_tx;
+  }
+
+  /* the last device never answers */
+  ck_assert_int_eq(kz_handle(devices[0], 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(devices[1], 1, double_handler, NULL), 1);
+
+  memset(&result, 0, sizeof(result));
+  memset(mailboxes, 0, sizeof(mailboxes));
+  kz_fanoutinit(&F, hosts, 3, sum_reply, record_fanout, &result);
+
+  ck_assert_int_eq(kz_putint(hosts[0], 21), 1);
+  ck_assert_int_eq(kz_fanoutcall(&F, 1, 5), 3);
+  ck_assert_uint_eq(F.pending, 3);
+
+  /* the same request went to each */
+  ck_assert_uint_eq(mailboxes[0].size, mailboxes[2].size);
+  ck_assert_mem_eq(mailboxes[0].bytes, mailboxes[2].bytes, mailboxes[0].size);
+
+  /* another can't be made through F until this one is done */
+  ck_assert_int_eq(kz_putint(hosts[0], 1), 1);
+  ck_assert_int_eq(kz_fanoutcall(&F, 1, 5), 0);
+
+  for(i = 0 ; i < 3 ; i ++) {
+    deliver_mailbox(devices[i], mailboxes + i);
+
+    if(i < 2) {
+      deliver_capture(hosts[i]);
+    }
+  }
+
+  ck_assert_int_eq(result.replies, 2);
+  ck_assert_int_eq(result.sum, 84);
+  ck_assert_int_eq(result.done, 0);
+
+  /* done once the last one has timed out */
+  for(i = 0 ; i < 5 ; i ++) {
+    kz_tick(hosts[2]);
+  }
+
+  ck_assert_int_eq(result.replies, 3);
+  ck_assert_int_eq(result.done, 1);
+  ck_assert_uint_eq(F.pending, 0);
+  ck_assert_uint_eq(F.replied, 2);
+  ck_assert_uint_eq(F.failed, 1);
+
+  /* an endpoint with a frame of its own being built isn't called, nor is its frame lost */
+  ck_assert_int_eq(kz_putint(hosts[1], 0x33), 1);
+  ck_assert_int_eq(kz_putint(hosts[0], 10), 1);
+  ck_assert_int_eq(kz_fanoutcall(&F, 1, 5), 2);
+  ck_assert_uint_eq(F.pending, 2);
+  ck_assert_uint_eq(F.failed, 1);
+  ck_assert_ptr_eq(hosts[1]->putptr, hosts[1]->tx_buffer + KZ_TX_PAYLOAD_START + 1);
+  ck_assert_uint_eq(hosts[1]->tx_buffer[KZ_TX_PAYLOAD_START], 0x33);
+  kz_putclear(hosts[1]);
+
+  deliver_mailbox(devices[0], mailboxes + 0);
+  deliver_capture(hosts[0]);
+
+  for(i = 0 ; i < 5 ; i ++) {
+    kz_tick(hosts[2]);
+  }
+
+  ck_assert_int_eq(result.done, 2);
+  ck_assert_uint_eq(F.replied, 1);
+  ck_assert_uint_eq(F.failed, 2);
+
+  /* and may be made again */
+  ck_assert_int_eq(kz_putint(hosts[0], 1), 1);
+  ck_assert_int_eq(kz_fanoutcall(&F, 1, 5), 3);
+
+  for(i = 0 ; i < 3 ; i ++) {
+    test_endpoint_deinit(host_endpoints + i);
+    test_endpoint_deinit(device_endpoints + i);
+  }
+}
+END_TEST
+
+kz_request_status_t tag_handler(kz_endpoint_t * K, void * userdata) {
+  kz_putint(K, *(int *)userdata);
+
+  return KZ_OK;
+}
+
+START_TEST(handler_userdata) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int tags[KZ_MAX_HANDLER_USERDATA + 1];
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+  D->tx = capture_tx;
+
+  for(i = 0 ; i <= KZ_MAX_HANDLER_USERDATA ; i ++) {
+    tags[i] = 100 + i;
+  }
+
+  /* as many distinct userdata as there is room for, one of them on two channels */
+  for(i = 0 ; i < KZ_MAX_HANDLER_USERDATA ; i ++) {
+    ck_assert_int_eq(kz_handle(D, i, tag_handler, tags + i), 1);
+  }
+  ck_assert_int_eq(kz_handle(D, 10, tag_handler, tags + 0), 1);
+  ck_assert_int_eq(kz_handle(D, 11, double_handler, NULL), 1);
+
+  /* one more is only refused by the compact layout */
+  ck_assert_int_eq(kz_handle(D, 12, tag_handler, tags + KZ_MAX_HANDLER_USERDATA), !KZ_COMPACT);
+
+  /* until one channel lets go of its own */
+  ck_assert_int_eq(kz_handle(D, 1, NULL, NULL), 1);
+  ck_assert_int_eq(kz_handle(D, 12, tag_handler, tags + KZ_MAX_HANDLER_USERDATA), 1);
+
+  /* each handler is given its own */
+  for(i = 0 ; i <= 12 ; i ++) {
+    memset(&result, 0, sizeof(result));
+
+    ck_assert_int_eq(kz_putint(H, 1), 1);
+    ck_assert_int_eq(kz_call(H, i, record_reply, &result, 10), 1);
+    deliver_capture(D);
+
+    if(i == 1 || (i >= KZ_MAX_HANDLER_USERDATA && i < 10)) {
+      /* unhandled */
+      kz_tick(H);
+      continue;
+    }
+
+    deliver_capture(H);
+    ck_assert_int_eq(result.count, 1);
+    ck_assert_int_eq(result.status, KZ_OK);
+
+    if(i == 10) {
+      ck_assert_int_eq(result.value, tags[0]);
+    } else if(i == 11) {
+      ck_assert_int_eq(result.value, 2);
+    } else if(i == 12) {
+      ck_assert_int_eq(result.value, tags[KZ_MAX_HANDLER_USERDATA]);
+    } else {
+      ck_assert_int_eq(result.value, tags[i]);
+    }
+  }
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+kz_task_status_t long_sleep_task(kz_endpoint_t * K, kz_task_t * T) {
+  KZ_TASK_BEGIN(T);
+  KZ_TASK_SLEEP(T, 40000L);
+  KZ_TASK_END(T);
+}
+
+START_TEST(long_timeouts) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  kz_task_t * T;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  memset(&result, 0, sizeof(result));
+
+  /* too long for the compact layout's 16-bit ticks, which would have wrapped around to
+   * KZ_NO_TIMEOUT, or to a timeout already over */
+  ck_assert_int_eq(kz_putint(H, 1), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 65535), !KZ_COMPACT);
+  ck_assert_ptr_eq(H->putptr, H->tx_buffer + KZ_TX_PAYLOAD_START);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 40000), !KZ_COMPACT);
+  ck_assert_int_eq(kz_subscribe(H, 1, KZ_SUBSCRIBE_PERIODIC, 10, record_reply, &result, 40000) >= 0, !KZ_COMPACT);
+  ck_assert_int_eq(kz_cache(H, 2, 40000), !KZ_COMPACT);
+  ck_assert_int_eq(kz_route(D, 1, 1, H, 1, 40000), !KZ_COMPACT);
+  ck_assert_int_eq(kz_subscribe(H, 1, KZ_SUBSCRIBE_PERIODIC, 40000, record_reply, &result, 10) >= 0, !KZ_COMPACT);
+
+  /* nor is such a period taken from the peer */
+  H->tx = capture_tx;
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_putint(H, KZ_SUBSCRIBE_PERIODIC), 1);
+  ck_assert_int_eq(kz_putint(H, 40000), 1);
+  ck_assert_int_eq(send_request(H, KZ_HEADER_SUBSCRIBE, 0x10, 1, KZ_PRIORITY_DEFAULT), 1);
+  deliver_capture(D);
+  ck_assert_int_eq(D->subscriptions[0].mode != 0, !KZ_COMPACT);
+  ck_assert_int_eq(D->subscriptions[0].period_ticks, KZ_COMPACT ? 0 : 40000);
+
+  /* and a task sleeps as long as it can */
+  T = kz_spawn(H, long_sleep_task, NULL);
+  kz_tick(H);
+  ck_assert_int_eq(T->wait_ticks, KZ_COMPACT ? KZ_MAX_TICKS : 40000);
+  kz_tick(H);
+  ck_assert_ptr_eq(T->fn, long_sleep_task);
+
+  /* the longest there is */
+  ck_assert_int_eq(kz_cache(H, 2, KZ_MAX_TICKS), 1);
+  ck_assert_int_eq(kz_call(H, 3, record_reply, &result, KZ_MAX_TICKS), 1);
+
+  /* and nothing expires early */
+  kz_tick(H);
+  kz_tick(H);
+  ck_assert_int_eq(result.count, 0);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(sized_tables) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+  int i;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  /* a host which only calls, three at once, and a device which only handles two channels */
+  host_endpoint.def.channels            = NULL;
+  host_endpoint.def.channel_count       = 0;
+  host_endpoint.def.local_request_count = 3;
+  host_endpoint.def.tx = capture_tx;
+  kz_init_static(H, &host_endpoint.def);
+
+  device_endpoint.def.channel_count       = 2;
+  device_endpoint.def.local_requests      = NULL;
+  device_endpoint.def.local_request_count = 0;
+  device_endpoint.def.tx = capture_tx;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(D, 2, double_handler, NULL), 0);
+  ck_assert_int_eq(kz_priority(D, 2, 0), 0);
+  ck_assert_int_eq(kz_cache(D, 2, 10), 0);
+  ck_assert_int_eq(kz_handle(H, 0, double_handler, NULL), 0);
+
+  ck_assert_int_eq(kz_putint(D, 1), 1);
+  ck_assert_int_eq(kz_call(D, 1, record_reply, &result, 10), 0);
+
+  /* the host's first request object is used again and again, its id wrapping at a multiple of 3 */
+  for(i = 0 ; i < 200 ; i ++) {
+    memset(&result, 0, sizeof(result));
+
+    ck_assert_int_eq(kz_putint(H, i), 1);
+    ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+    ck_assert_uint_lt(H->local_requests[0].reqid, 0xFF);
+    ck_assert_uint_eq(H->local_requests[0].reqid % 3, 0);
+
+    deliver_capture(D);
+    deliver_capture(H);
+    ck_assert_int_eq(result.count, 1);
+    ck_assert_int_eq(result.status, KZ_OK);
+    ck_assert_int_eq(result.value, 2*i);
+  }
+
+  /* no more than three in flight */
+  for(i = 0 ; i < 3 ; i ++) {
+    ck_assert_int_eq(kz_putint(H, i), 1);
+    ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  }
+  ck_assert_int_eq(kz_putint(H, i), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 0);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+/* bytes last given to held_tx, which holds on to them until released by the test */
+const kz_byte_t * held_bytes;
+
+void held_tx(const kz_byte_t * bytes, size_t size) {
+  held_bytes = bytes;
+  capture_tx(bytes, size);
+}
+
+START_TEST(async_tx_buffers) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  kz_byte_t * pool;
+  kz_byte_t queue[64];
+  reply_result_t result;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, 2*KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D->tx = capture_tx;
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+
+  /* restart the host with two buffers, sent in the background */
+  pool = host_endpoint.def.tx_buffer;
+  host_endpoint.def.tx = held_tx;
+  host_endpoint.def.tx_buffer_count = 2;
+  host_endpoint.def.tx_async = 1;
+  host_endpoint.def.queue_buffer = queue;
+  host_endpoint.def.queue_buffer_size = sizeof(queue);
+  kz_init_static(H, &host_endpoint.def);
+  kz_tick(H);
+
+  /* the credit query is still being sent, the next frame is built in the other buffer */
+  ck_assert_ptr_eq(held_bytes, pool);
+  ck_assert_int_eq(H->tx_held[0], 1);
+  ck_assert_ptr_eq(H->tx_buffer, pool + KZ_MAX_BUFFER_SIZE);
+  ck_assert_ptr_eq(H->tx_buffer_end, pool + 2*KZ_MAX_BUFFER_SIZE);
+
+  kz_txdone(H, held_bytes);
+  ck_assert_int_eq(H->tx_held[0], 0);
+
+  ck_assert_int_eq(kz_putint(H, 21), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_ptr_eq(held_bytes, pool + KZ_MAX_BUFFER_SIZE);
+  ck_assert_int_eq(H->tx_held[1], 1);
+  ck_assert_ptr_eq(H->tx_buffer, pool);
+
+  /* the reply may arrive before the request has been released */
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 42);
+
+  kz_txdone(H, held_bytes);
+  ck_assert_int_eq(H->tx_held[1], 0);
+
+  /* with only one buffer, a frame can't be set aside */
+  ck_assert_int_eq(kz_putaside(D), 0);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+/* sends straight to the endpoint given as userdata */
+void direct_tx(const kz_byte_t * bytes, size_t size) {
+  kz_receive(kz_userdata(), bytes, size);
+}
+
+kz_request_status_t notify_handler(kz_endpoint_t * K, void * userdata) {
+  kz_putint(K, 7);
+
+  /* tell the caller something before replying */
+  if(!kz_putaside(K)) {
+    return KZ_BUSY;
+  }
+
+  kz_putint(K, 5);
+  kz_send(K, 9);
+
+  kz_putint(K, 8);
+
+  return KZ_OK;
+}
+
+kz_request_status_t abandon_handler(kz_endpoint_t * K, void * userdata) {
+  kz_putint(K, 7);
+
+  /* sets its reply aside, but makes no call after all */
+  if(!kz_putaside(K)) {
+    return KZ_BUSY;
+  }
+
+  kz_putint(K, 5);
+
+  return KZ_OK;
+}
+
+kz_request_status_t record_handler(kz_endpoint_t * K, void * userdata) {
+  kz_getint(K, userdata);
+
+  return KZ_OK;
+}
+
+void record_two(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_int_t * values = userdata;
+
+  if(status != KZ_OK || !kz_getint(K, values) || !kz_getint(K, values + 1)) {
+    values[0] = -1;
+  }
+}
+
+START_TEST(stalled_tx_buffers) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  kz_byte_t queue[64];
+  kz_byte_t * queue_pos;
+  reply_result_t result;
+  reply_result_t device_result;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, 2*KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D->tx = capture_tx;
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+  memset(&device_result, 0, sizeof(device_result));
+
+  /* two buffers, sent in the background by a transport which is slow to release them */
+  host_endpoint.def.tx = held_tx;
+  host_endpoint.def.tx_buffer_count = 2;
+  host_endpoint.def.tx_async = 1;
+  host_endpoint.def.queue_buffer = queue;
+  host_endpoint.def.queue_buffer_size = sizeof(queue);
+  kz_init_static(H, &host_endpoint.def);
+  ck_assert_int_eq(kz_handle(H, 2, double_handler, NULL), 1);
+  kz_tick(H);
+  ck_assert_int_eq(H->tx_held[0], 1);
+
+  /* the credit query left one buffer, which can't be given away too: the call waits in the queue */
+  ck_assert_int_eq(kz_putint(H, 21), 1);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+  ck_assert_ptr_eq(H->putptr, H->tx_buffer + KZ_TX_PAYLOAD_START);
+  ck_assert_int_eq(H->tx_held[1], 0);
+  ck_assert_ptr_ne(H->queue_pos, H->queue_buffer);
+
+  /* nor can a frame be set aside */
+  ck_assert_int_eq(kz_putaside(H), 0);
+
+  /* as does a reply */
+  ck_assert_int_eq(kz_putint(D, 4), 1);
+  ck_assert_int_eq(kz_call(D, 2, record_reply, &device_result, 10), 1);
+  deliver_capture(H);
+  ck_assert_int_eq(H->tx_held[1], 0);
+  ck_assert_uint_eq(H->tx_dropped, 0);
+
+  /* each goes out on a tick once the transport has let go of a buffer */
+  kz_txdone(H, held_bytes);
+  kz_tick(H);
+  ck_assert_int_eq(H->tx_held[1], 1);
+  ck_assert_int_eq(H->tx_held[0], 0);
+
+  deliver_capture(D);
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 42);
+
+  kz_txdone(H, held_bytes);
+  kz_tick(H);
+  ck_assert_int_eq(H->tx_held[0], 1);
+  ck_assert_ptr_eq(H->queue_pos, H->queue_buffer);
+
+  deliver_capture(D);
+  ck_assert_int_eq(device_result.count, 1);
+  ck_assert_int_eq(device_result.value, 8);
+
+  /* only once the queue is full is a reply dropped, and counted */
+  do {
+    queue_pos = H->queue_pos;
+    ck_assert_int_eq(kz_putint(H, 1), 1);
+    kz_send(H, 1);
+  } while(H->queue_pos != queue_pos);
+
+  ck_assert_int_eq(kz_putint(D, 4), 1);
+  ck_assert_int_eq(kz_call(D, 2, record_reply, &device_result, 10), 1);
+  deliver_capture(H);
+  ck_assert_uint_eq(H->tx_dropped, 1);
+  ck_assert_ptr_eq(H->queue_pos, queue_pos);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+START_TEST(call_from_handler) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  kz_int_t notified = 0;
+  kz_int_t values[2] = { 0, 0 };
+  reply_result_t result;
+  kz_byte_t * putptr;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, 2*KZ_MAX_BUFFER_SIZE);
+  H->tx = capture_tx;
+
+  device_endpoint.def.tx = direct_tx;
+  device_endpoint.def.userdata = H;
+  device_endpoint.def.tx_buffer_count = 2;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 2, notify_handler, NULL), 1);
+  ck_assert_int_eq(kz_handle(H, 9, record_handler, &notified), 1);
+
+  ck_assert_int_eq(kz_call(H, 2, record_two, values, 10), 1);
+  deliver_capture(D);
+
+  /* the call was made, and the reply built around it arrived whole */
+  ck_assert_int_eq(notified, 5);
+  ck_assert_int_eq(values[0], 7);
+  ck_assert_int_eq(values[1], 8);
+  ck_assert_ptr_eq(D->aside_putptr, NULL);
+
+  /* a frame set aside and then abandoned is the reply all the same */
+  ck_assert_int_eq(kz_handle(D, 3, abandon_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+  ck_assert_int_eq(kz_call(H, 3, record_reply, &result, 10), 1);
+  deliver_capture(D);
+
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 7);
+  ck_assert_ptr_eq(D->aside_putptr, NULL);
+
+  /* and can be gone back to by hand */
+  ck_assert_int_eq(kz_putint(D, 1), 1);
+  putptr = D->putptr;
+  ck_assert_int_eq(kz_putaside(D), 1);
+  ck_assert_int_eq(kz_putint(D, 2), 1);
+  kz_putrestore(D);
+  ck_assert_ptr_eq(D->putptr, putptr);
+  ck_assert_ptr_eq(D->aside_putptr, NULL);
+  kz_putclear(D);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
+/* userdata seen by nested_tx before and after passing its frame on, and by recording_tx */
+void * seen_userdata[3];
+
+void nested_tx(const kz_byte_t * bytes, size_t size) {
+  seen_userdata[0] = kz_userdata();
+  direct_tx(bytes, size);
+  seen_userdata[1] = kz_userdata();
+}
+
+void recording_tx(const kz_byte_t * bytes, size_t size) {
+  seen_userdata[2] = kz_userdata();
+  capture_tx(bytes, size);
+}
+
+START_TEST(callback_userdata) {
+  test_endpoint_t host_endpoint;
+  test_endpoint_t device_endpoint;
+  kz_endpoint_t * H;
+  kz_endpoint_t * D;
+  reply_result_t result;
+
+  H = test_endpoint_init(&host_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+  D = test_endpoint_init(&device_endpoint, KZ_MAX_BUFFER_SIZE, KZ_MAX_BUFFER_SIZE);
+
+  host_endpoint.def.tx = nested_tx;
+  host_endpoint.def.userdata = D;
+  kz_init_static(H, &host_endpoint.def);
+
+  device_endpoint.def.tx = recording_tx;
+  device_endpoint.def.userdata = &result;
+  kz_init_static(D, &device_endpoint.def);
+
+  ck_assert_int_eq(kz_handle(D, 1, double_handler, NULL), 1);
+  memset(&result, 0, sizeof(result));
+  memset(seen_userdata, 0, sizeof(seen_userdata));
+  ck_assert_ptr_eq(kz_userdata(), NULL);
+
+  /* the device replies from within the host's tx callback, each seeing its own userdata */
+  kz_putint(H, 21);
+  ck_assert_int_eq(kz_call(H, 1, record_reply, &result, 10), 1);
+
+  ck_assert_ptr_eq(seen_userdata[0], D);
+  ck_assert_ptr_eq(seen_userdata[1], D);
+  ck_assert_ptr_eq(seen_userdata[2], &result);
+  ck_assert_ptr_eq(kz_userdata(), NULL);
+
+  deliver_capture(H);
+  ck_assert_int_eq(result.count, 1);
+  ck_assert_int_eq(result.value, 42);
+
+  test_endpoint_deinit(&host_endpoint);
+  test_endpoint_deinit(&device_endpoint);
+}
+END_TEST
+
 /*
 START_TEST(putget_misc) {
   test_endpoint_t test_endpoint;
@@ -444,6 +2522,31 @@ Suite * kazhal_suite(void) {
 
   tcase_add_test(tc_core, putget_ints);
   tcase_add_test(tc_core, putget_floats);
+
+  tcase_add_test(tc_core, deferred_reply);
+  tcase_add_test(tc_core, task_scheduling);
+  tcase_add_test(tc_core, flow_control);
+  tcase_add_test(tc_core, credit_after_loss);
+  tcase_add_test(tc_core, priorities);
+  tcase_add_test(tc_core, streamed_reply);
+  tcase_add_test(tc_core, batched_calls);
+  tcase_add_test(tc_core, subscriptions);
+  tcase_add_test(tc_core, retransmission);
+  tcase_add_test(tc_core, cached_replies);
+  tcase_add_test(tc_core, coalesced_calls);
+  tcase_add_test(tc_core, call_context);
+  tcase_add_test(tc_core, datagram_frames);
+  tcase_add_test(tc_core, datagram_credit);
+  tcase_add_test(tc_core, routed_calls);
+  tcase_add_test(tc_core, multidrop_bus);
+  tcase_add_test(tc_core, fanout_calls);
+  tcase_add_test(tc_core, handler_userdata);
+  tcase_add_test(tc_core, sized_tables);
+  tcase_add_test(tc_core, long_timeouts);
+  tcase_add_test(tc_core, async_tx_buffers);
+  tcase_add_test(tc_core, stalled_tx_buffers);
+  tcase_add_test(tc_core, call_from_handler);
+  tcase_add_test(tc_core, callback_userdata);
   /*
   tcase_add_test(tc_core, putget_misc);
   tcase_add_test(tc_core, putget_overrun);
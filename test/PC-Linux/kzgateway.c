@@ -0,0 +1,1046 @@
+
+// Serves many devices to many local clients from a single thread
+//
+// usage: kzgateway [-e] <device> <socket> [<device> <socket> ...]
+//
+// Each device is made available on a Unix-domain socket of its own. Clients connect to the
+// socket and speak kinzhal over it, as they would over the device's serial port. Their requests
+// are passed on to the device, and the device's replies are routed back to the client which
+// made the request. Requests made by devices aren't served.
+//
+// I/O is done through io_uring where the kernel supports it: every descriptor keeps a multishot
+// read armed, drawing from a ring of provided buffers, and whatever the endpoints transmit while
+// completions are handled is written in one batch of submissions. Otherwise, or with -e, the
+// gateway falls back to epoll and plain read()/write().
+//
+// Nothing ever waits for a descriptor to take its output. Bytes it has no room for wait in its
+// output buffer, which is written as epoll reports room, or by io_uring. A frame which doesn't fit
+// in the buffer is dropped, and a client which has stopped reading is disconnected, so that it
+// can't hold up the devices and the other clients.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+
+#include "kinzhal.h"
+
+#define MAX_DEVICES      64
+#define MAX_CLIENTS      256
+#define MAX_FORWARDS     (MAX_DEVICES * KZ_MAX_LOCAL_REQUESTS)
+#define TICK_MS          10
+#define CALL_TIMEOUT     100  // ticks
+
+#define OUTPUT_SIZE      16384  // bytes waiting to be written to each descriptor
+#define RING_ENTRIES     256
+#define RING_BUFFERS     256    // provided for reads, a power of two
+#define RING_BUFFER_SIZE 4096
+
+// multishot reads are newer than some kernel headers
+#define URING_OP_READ_MULTISHOT  49
+
+// what an epoll event, or an io_uring completion, refers to
+typedef enum {
+  WATCH_TIMER,
+  WATCH_DEVICE,
+  WATCH_LISTENER,
+  WATCH_CLIENT
+} watch_kind_t;
+
+// bytes on their way out, which the descriptor had no room for (epoll), or which io_uring writes
+// while more are added behind them
+typedef struct {
+  kz_byte_t bytes[OUTPUT_SIZE];
+  size_t size;     // # waiting, including those being written
+  size_t writing;  // # at the front which the kernel is writing, io_uring only
+  char dirty;      // listed to be written at the next submission, io_uring only
+} output_t;
+
+typedef struct {
+  watch_kind_t kind;
+  void * object;
+  int fd;
+  output_t * output;  // NULL for descriptors which are only read
+  int ops;            // # of io_uring operations which have yet to complete
+} watch_t;
+
+typedef struct {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  // hold calls here while the device is busy
+  kz_byte_t queue_buffer[1024];
+  // only calls, on behalf of the clients
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+  output_t output;
+
+  int fd;
+  int listen_fd;
+  const char * path;
+  const char * socket_path;
+
+  watch_t device_watch;
+  watch_t listener_watch;
+} device_t;
+
+typedef struct {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  // only handles, every channel is forwarded to the device
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+
+  int fd;  // -1 if unused
+  device_t * device;
+  output_t output;
+
+  watch_t watch;
+} client_t;
+
+// a client's request, on its way to a device
+typedef struct {
+  client_t * client;  // NULL if unused, or if the client has gone
+  kz_request_t * request;
+  char used;
+} forward_t;
+
+
+static device_t devices[MAX_DEVICES];
+static int      device_count;
+
+static client_t clients[MAX_CLIENTS];
+
+static forward_t forwards[MAX_FORWARDS];
+
+// handler userdata, the channel each is registered for
+static unsigned int channel_ids[KZ_MAX_CHANNELS];
+
+static int epoll_fd;
+
+// shared with the kernel
+typedef struct {
+  int fd;
+
+  unsigned int * sq_head;
+  unsigned int * sq_tail;
+  unsigned int * sq_mask;
+  unsigned int * sq_entries;
+  unsigned int * sq_array;
+  struct io_uring_sqe * sqes;
+  unsigned int sq_local_tail;  // published when submitting
+
+  unsigned int * cq_head;
+  unsigned int * cq_tail;
+  unsigned int * cq_mask;
+  struct io_uring_cqe * cqes;
+
+  struct io_uring_buf_ring * buffers;
+  kz_byte_t * buffer_memory;
+  unsigned short buffers_tail;
+} ring_t;
+
+static ring_t ring = { -1 };
+
+// descriptors with output to be submitted
+static watch_t * dirty[MAX_DEVICES + MAX_CLIENTS];
+static int       dirty_count;
+
+static volatile sig_atomic_t running = 1;
+
+
+static void stop(int sig) {
+  running = 0;
+}
+
+static int open_device(const char * path) {
+  struct termios tty;
+  int fd;
+
+  fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+  if(fd < 0) {
+    fprintf(stderr, "error opening %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if(isatty(fd)) {
+    if(tcgetattr(fd, &tty) != 0) {
+      fprintf(stderr, "error %d from tcgetattr\n", errno);
+      close(fd);
+      return -1;
+    }
+
+    // frames are binary, nothing may be translated
+    cfmakeraw(&tty);
+    cfsetospeed(&tty, B115200);
+    cfsetispeed(&tty, B115200);
+    tty.c_cflag |= CLOCAL | CREAD;
+
+    if(tcsetattr(fd, TCSANOW, &tty) != 0) {
+      fprintf(stderr, "error %d from tcsetattr\n", errno);
+      close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+static int open_listener(const char * path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if(fd < 0) {
+    fprintf(stderr, "error creating socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  unlink(path);
+
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "error listening on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+static struct io_uring_sqe * get_sqe(void) {
+  struct io_uring_sqe * sqe;
+  unsigned int index;
+
+  if(ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= *ring.sq_entries) {
+    // full, make room
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    syscall(__NR_io_uring_enter, ring.fd, *ring.sq_entries, 0, 0, NULL, 0);
+  }
+
+  index = ring.sq_local_tail & *ring.sq_mask;
+  sqe = ring.sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+
+  ring.sq_array[index] = index;
+  ring.sq_local_tail ++;
+
+  return sqe;
+}
+
+// submits everything prepared, and waits for a completion
+static void submit_and_wait(void) {
+  unsigned int count = ring.sq_local_tail - *ring.sq_tail;
+
+  __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+  // interrupted by a signal, the caller will see whether it is time to stop
+  syscall(__NR_io_uring_enter, ring.fd, count, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static void provide_buffer(unsigned short id) {
+  struct io_uring_buf * buf = ring.buffers->bufs + (ring.buffers_tail & (RING_BUFFERS - 1));
+
+  buf->addr = (uintptr_t)(ring.buffer_memory + (size_t)id * RING_BUFFER_SIZE);
+  buf->len  = RING_BUFFER_SIZE;
+  buf->bid  = id;
+
+  ring.buffers_tail ++;
+  __atomic_store_n(&ring.buffers->tail, ring.buffers_tail, __ATOMIC_RELEASE);
+}
+
+// returns 1 if io_uring can be used, 0 to fall back to epoll
+static int ring_init(void) {
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  struct io_uring_probe * probe;
+  size_t probe_size;
+  size_t size;
+  kz_byte_t * rings;
+  int supported;
+  int i;
+
+  memset(&params, 0, sizeof(params));
+
+  ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+  if(ring.fd < 0) {
+    return 0;
+  }
+
+  // multishot reads, and the buffer rings they draw from, arrived in 6.7
+  probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  probe = calloc(1, probe_size);
+  supported = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+    probe->ops_len > URING_OP_READ_MULTISHOT && (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED) &&
+    (params.features & IORING_FEAT_SINGLE_MMAP);
+  free(probe);
+
+  if(!supported) {
+    close(ring.fd);
+    ring.fd = -1;
+    return 0;
+  }
+
+  size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  if(size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)) {
+    size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  }
+
+  rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+  // the buffer ring must be page aligned
+  ring.buffers = mmap(NULL, RING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring.buffer_memory = malloc((size_t)RING_BUFFERS * RING_BUFFER_SIZE);
+
+  if(rings == MAP_FAILED || ring.sqes == MAP_FAILED || ring.buffers == MAP_FAILED || !ring.buffer_memory) {
+    close(ring.fd);
+    ring.fd = -1;
+    return 0;
+  }
+
+  ring.sq_head    = (unsigned int *)(rings + params.sq_off.head);
+  ring.sq_tail    = (unsigned int *)(rings + params.sq_off.tail);
+  ring.sq_mask    = (unsigned int *)(rings + params.sq_off.ring_mask);
+  ring.sq_entries = (unsigned int *)(rings + params.sq_off.ring_entries);
+  ring.sq_array   = (unsigned int *)(rings + params.sq_off.array);
+  ring.sq_local_tail = *ring.sq_tail;
+
+  ring.cq_head = (unsigned int *)(rings + params.cq_off.head);
+  ring.cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+  ring.cq_mask = (unsigned int *)(rings + params.cq_off.ring_mask);
+  ring.cqes    = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uintptr_t)ring.buffers;
+  reg.ring_entries = RING_BUFFERS;
+  reg.bgid         = 0;
+
+  if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    close(ring.fd);
+    ring.fd = -1;
+    return 0;
+  }
+
+  ring.buffers_tail = 0;
+  for(i = 0 ; i < RING_BUFFERS ; i ++) {
+    provide_buffer(i);
+  }
+
+  return 1;
+}
+
+// reads into provided buffers until the descriptor ends, or buffers run out
+static void arm_read(watch_t * w) {
+  struct io_uring_sqe * sqe = get_sqe();
+
+  sqe->opcode    = URING_OP_READ_MULTISHOT;
+  sqe->fd        = w->fd;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = (uintptr_t)w;
+
+  w->ops ++;
+}
+
+static void arm_accept(watch_t * w) {
+  struct io_uring_sqe * sqe = get_sqe();
+
+  sqe->opcode       = IORING_OP_ACCEPT;
+  sqe->fd           = w->fd;
+  sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data    = (uintptr_t)w;
+
+  w->ops ++;
+}
+
+// writes are told apart from reads by the low bit of their user_data
+static void submit_write(watch_t * w) {
+  struct io_uring_sqe * sqe = get_sqe();
+
+  w->output->writing = w->output->size;
+
+  sqe->opcode    = IORING_OP_WRITE;
+  sqe->fd        = w->fd;
+  sqe->addr      = (uintptr_t)w->output->bytes;
+  sqe->len       = w->output->writing;
+  sqe->off       = (uint64_t)-1;
+  sqe->user_data = (uintptr_t)w | 1;
+
+  w->ops ++;
+}
+
+static void cancel_write(watch_t * w) {
+  struct io_uring_sqe * sqe = get_sqe();
+
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->addr      = (uintptr_t)w | 1;
+  sqe->user_data = 0;
+}
+
+static void mark_dirty(watch_t * w) {
+  if(!w->output->dirty) {
+    w->output->dirty = 1;
+    dirty[dirty_count ++] = w;
+  }
+}
+
+// one write per descriptor, behind any already under way
+static void flush_outputs(void) {
+  int i;
+
+  for(i = 0 ; i < dirty_count ; i ++) {
+    dirty[i]->output->dirty = 0;
+
+    if(dirty[i]->output->writing == 0 && dirty[i]->output->size > 0) {
+      submit_write(dirty[i]);
+    }
+  }
+
+  dirty_count = 0;
+}
+
+static void watch(watch_t * w) {
+  struct epoll_event ev;
+
+  if(ring.fd >= 0) {
+    if(w->kind == WATCH_LISTENER) {
+      arm_accept(w);
+    } else {
+      arm_read(w);
+    }
+    return;
+  }
+
+  ev.events   = EPOLLIN;
+  ev.data.ptr = w;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev);
+}
+
+// writes as much as a non-blocking descriptor takes, returns the # written, or -1 if it can't be
+// written to any more
+static ssize_t write_some(int fd, const kz_byte_t * bytes, size_t size) {
+  size_t written = 0;
+  ssize_t ret;
+
+  while(written < size) {
+    ret = send(fd, bytes + written, size - written, MSG_NOSIGNAL);
+
+    if(ret < 0 && errno == ENOTSOCK) {
+      ret = write(fd, bytes + written, size - written);
+    }
+
+    if(ret > 0) {
+      written += ret;
+    } else if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if(ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return -1;
+    }
+  }
+
+  return written;
+}
+
+// asks epoll to report room to write, while output is waiting
+static void watch_writable(watch_t * w, int writable) {
+  struct epoll_event ev;
+
+  ev.events   = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = w;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev);
+}
+
+// writes waiting output once epoll has reported room
+static void drain_output(watch_t * w) {
+  output_t * out = w->output;
+  ssize_t ret;
+
+  ret = write_some(w->fd, out->bytes, out->size);
+
+  if(ret < 0) {
+    // the descriptor has gone, its read will end too
+    out->size = 0;
+  } else {
+    memmove(out->bytes, out->bytes + ret, out->size - ret);
+    out->size -= ret;
+  }
+
+  if(out->size == 0) {
+    watch_writable(w, 0);
+  }
+}
+
+// written now if there is room and nothing ahead of it (epoll), or at the next submission
+// (io_uring), and otherwise once there is room
+static void output(watch_t * w, const kz_byte_t * bytes, size_t size) {
+  ssize_t ret;
+
+  if(ring.fd < 0 && w->output->size == 0) {
+    ret = write_some(w->fd, bytes, size);
+
+    if(ret < 0 || (size_t)ret == size) {
+      // a descriptor which has gone is noticed when it is next read from
+      return;
+    }
+
+    // the rest waits for room
+    bytes += ret;
+    size  -= ret;
+    watch_writable(w, 1);
+  }
+
+  if(w->output->size + size > sizeof(w->output->bytes)) {
+    // frames are dropped whole, as if lost on the line
+    fprintf(stderr, "output overflow, dropped %zu bytes\n", size);
+
+    if(w->kind == WATCH_CLIENT) {
+      // a client which doesn't read its replies is let go, it is closed once its read ends
+      shutdown(w->fd, SHUT_RDWR);
+    }
+    return;
+  }
+
+  memcpy(w->output->bytes + w->output->size, bytes, size);
+  w->output->size += size;
+
+  if(ring.fd >= 0) {
+    mark_dirty(w);
+  }
+}
+
+static void device_tx(const kz_byte_t * bytes, size_t size) {
+  device_t * device = kz_userdata();
+
+  output(&device->device_watch, bytes, size);
+}
+
+static void client_tx(const kz_byte_t * bytes, size_t size) {
+  client_t * client = kz_userdata();
+
+  // a client which can't be written to is noticed when it is next read from
+  output(&client->watch, bytes, size);
+}
+
+
+static forward_t * alloc_forward(void) {
+  int i;
+
+  for(i = 0 ; i < MAX_FORWARDS ; i ++) {
+    if(!forwards[i].used) {
+      forwards[i].used = 1;
+      return forwards + i;
+    }
+  }
+
+  return NULL;
+}
+
+// passes the device's reply back to the client
+static void forward_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  forward_t * forward = userdata;
+  client_t * client = forward->client;
+  const kz_byte_t * results;
+  kz_size_t results_size;
+
+  if(client) {
+    results = kz_getdata(K, &results_size);
+    kz_putraw(&client->endpoint, results, results_size);
+
+    if(status == KZ_MORE) {
+      kz_replypart(&client->endpoint, forward->request);
+    } else {
+      // the client times out on its own if the device didn't answer
+      kz_reply(&client->endpoint, forward->request, status);
+    }
+  }
+
+  if(status != KZ_MORE) {
+    forward->client = NULL;
+    forward->used   = 0;
+  }
+}
+
+// handles every channel of a client's endpoint, by calling the device
+static kz_request_status_t forward_request(kz_endpoint_t * K, void * userdata) {
+  const unsigned int channelid = *(unsigned int *)userdata;
+
+  client_t * client = K->userdata;
+  kz_endpoint_t * device = &client->device->endpoint;
+  forward_t * forward;
+  const kz_byte_t * args;
+  kz_size_t args_size;
+
+  forward = alloc_forward();
+
+  if(!forward) {
+    return KZ_BUSY;
+  }
+
+  forward->client  = client;
+  forward->request = kz_defer(K);
+
+  if(!forward->request) {
+    forward->used = 0;
+    return KZ_BUSY;
+  }
+
+  args = kz_getdata(K, &args_size);
+  kz_putraw(device, args, args_size);
+
+  if(!kz_call(device, channelid, forward_reply, forward, CALL_TIMEOUT)) {
+    // too many calls waiting for this device
+    forward->client = NULL;
+    forward->used   = 0;
+    return KZ_BUSY;
+  }
+
+  return KZ_DEFER;
+}
+
+
+static void add_client(device_t * device, int fd);
+
+static void accept_client(device_t * device) {
+  int fd;
+
+  fd = accept4(device->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if(fd < 0) {
+    return;
+  }
+
+  add_client(device, fd);
+}
+
+static void add_client(device_t * device, int fd) {
+  client_t * client = NULL;
+  unsigned int c;
+  int i;
+
+  for(i = 0 ; i < MAX_CLIENTS ; i ++) {
+    // not until io_uring is done with its last use
+    if(clients[i].fd < 0 && clients[i].watch.ops == 0) {
+      client = clients + i;
+      break;
+    }
+  }
+
+  if(!client) {
+    fprintf(stderr, "too many clients\n");
+    close(fd);
+    return;
+  }
+
+  client->fd     = fd;
+  client->device = device;
+
+  client->output.size    = 0;
+  client->output.writing = 0;
+  client->output.dirty   = 0;
+
+  // the endpoint may transmit as soon as it is initialised
+  client->watch.kind   = WATCH_CLIENT;
+  client->watch.object = client;
+  client->watch.fd     = fd;
+  client->watch.output = &client->output;
+
+  client->def.rx_buffer      = client->rx_buffer;
+  client->def.rx_buffer_size = sizeof(client->rx_buffer);
+  client->def.tx_buffer      = client->tx_buffer;
+  client->def.tx_buffer_size = sizeof(client->tx_buffer);
+  client->def.channels            = client->channels;
+  client->def.channel_count       = KZ_MAX_CHANNELS;
+  client->def.local_requests      = NULL;
+  client->def.local_request_count = 0;
+  client->def.rx_window = 0;
+  client->def.tx_budget = 0;
+  client->def.queue_buffer = NULL;
+  client->def.queue_buffer_size = 0;
+  client->def.retransmit_ticks = 0;
+  client->def.datagram = 0;
+  client->def.address = 0;
+  client->def.tx_enable = NULL;
+  client->def.tx_buffer_count = 0;
+  client->def.tx_async = 0;
+  client->def.rx = NULL;
+  client->def.tx = client_tx;
+  client->def.userdata = client;
+
+  kz_init_static(&client->endpoint, &client->def);
+
+  for(c = 0 ; c < KZ_MAX_CHANNELS ; c ++) {
+    kz_handle(&client->endpoint, c, forward_request, &channel_ids[c]);
+  }
+
+  watch(&client->watch);
+}
+
+static void close_client(client_t * client) {
+  int i;
+
+  // replies still on their way are dropped
+  for(i = 0 ; i < MAX_FORWARDS ; i ++) {
+    if(forwards[i].client == client) {
+      forwards[i].client = NULL;
+    }
+  }
+
+  if(ring.fd >= 0) {
+    // its read has already ended, a write may be stuck behind a client which doesn't read
+    if(client->output.writing) {
+      cancel_write(&client->watch);
+    }
+  } else {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  }
+
+  client->output.size = 0;
+
+  close(client->fd);
+
+  client->fd = -1;
+  client->device = NULL;
+}
+
+// returns 0 once the descriptor has nothing more to give
+static int receive(int fd, kz_endpoint_t * K) {
+  kz_byte_t bytes[4096];
+  ssize_t ret;
+
+  for(;;) {
+    ret = read(fd, bytes, sizeof(bytes));
+
+    if(ret > 0) {
+      kz_receive(K, bytes, ret);
+    } else if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    } else if(ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return 0;
+    }
+  }
+}
+
+static void tick(void) {
+  int i;
+
+  for(i = 0 ; i < device_count ; i ++) {
+    kz_tick(&devices[i].endpoint);
+  }
+
+  for(i = 0 ; i < MAX_CLIENTS ; i ++) {
+    if(clients[i].fd >= 0) {
+      kz_tick(&clients[i].endpoint);
+    }
+  }
+}
+
+static int add_device(const char * path, const char * socket_path) {
+  device_t * device = devices + device_count;
+
+  device->path        = path;
+  device->socket_path = socket_path;
+
+  device->fd = open_device(path);
+  if(device->fd < 0) {
+    return 0;
+  }
+
+  device->listen_fd = open_listener(socket_path);
+  if(device->listen_fd < 0) {
+    close(device->fd);
+    return 0;
+  }
+
+  if(ring.fd >= 0) {
+    // io_uring waits on the descriptors itself, and would give up on non-blocking ones
+    fcntl(device->fd, F_SETFL, fcntl(device->fd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(device->listen_fd, F_SETFL, fcntl(device->listen_fd, F_GETFL) & ~O_NONBLOCK);
+  }
+
+  // the endpoint may transmit as soon as it is initialised
+  device->device_watch.kind     = WATCH_DEVICE;
+  device->device_watch.object   = device;
+  device->device_watch.fd       = device->fd;
+  device->device_watch.output   = &device->output;
+  device->listener_watch.kind   = WATCH_LISTENER;
+  device->listener_watch.object = device;
+  device->listener_watch.fd     = device->listen_fd;
+  device->listener_watch.output = NULL;
+
+  device->def.rx_buffer = device->rx_buffer;
+  device->def.rx_buffer_size = sizeof(device->rx_buffer);
+  device->def.tx_buffer = device->tx_buffer;
+  device->def.tx_buffer_size = sizeof(device->tx_buffer);
+  device->def.channels = NULL;
+  device->def.channel_count = 0;
+  device->def.local_requests = device->local_requests;
+  device->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  device->def.rx_window = 0;
+  device->def.tx_budget = 0;
+  device->def.queue_buffer = device->queue_buffer;
+  device->def.queue_buffer_size = sizeof(device->queue_buffer);
+  device->def.retransmit_ticks = 0;
+  device->def.datagram = 0;
+  device->def.address = 0;
+  device->def.tx_enable = NULL;
+  device->def.tx_buffer_count = 0;
+  device->def.tx_async = 0;
+  device->def.rx = NULL;
+  device->def.tx = device_tx;
+  device->def.userdata = device;
+
+  kz_init_static(&device->endpoint, &device->def);
+
+  watch(&device->device_watch);
+  watch(&device->listener_watch);
+
+  device_count ++;
+
+  return 1;
+}
+
+static void run_epoll(void) {
+  struct epoll_event events[64];
+  uint64_t expirations;
+  watch_t * w;
+  int count;
+  int i;
+
+  while(running) {
+    count = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), -1);
+
+    for(i = 0 ; i < count ; i ++) {
+      w = events[i].data.ptr;
+
+      switch(w->kind) {
+        case WATCH_TIMER:
+          if(read(w->fd, &expirations, sizeof(expirations)) > 0) {
+            tick();
+          }
+          break;
+        case WATCH_DEVICE:
+          if(events[i].events & EPOLLOUT) {
+            drain_output(w);
+          }
+          if((events[i].events & ~EPOLLOUT) && !receive(w->fd, &((device_t *)w->object)->endpoint)) {
+            fprintf(stderr, "lost device %s\n", ((device_t *)w->object)->path);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+          }
+          break;
+        case WATCH_LISTENER:
+          accept_client(w->object);
+          break;
+        case WATCH_CLIENT:
+          if(events[i].events & EPOLLOUT) {
+            drain_output(w);
+          }
+          if((events[i].events & ~EPOLLOUT) && !receive(w->fd, &((client_t *)w->object)->endpoint)) {
+            close_client(w->object);
+          }
+          break;
+      }
+    }
+  }
+}
+
+static void write_completed(watch_t * w, int res) {
+  output_t * out = w->output;
+
+  w->ops --;
+
+  if(res > 0) {
+    memmove(out->bytes, out->bytes + res, out->size - res);
+    out->size -= res;
+  } else if(res != -EAGAIN && res != -EINTR) {
+    // the descriptor has gone, its read will end too
+    out->size = 0;
+  }
+
+  out->writing = 0;
+
+  if(out->size > 0) {
+    mark_dirty(w);
+  }
+}
+
+// returns 0 once the descriptor has nothing more to give
+static int read_completed(watch_t * w, const struct io_uring_cqe * cqe) {
+  unsigned short id;
+
+  if(cqe->res > 0) {
+    id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    switch(w->kind) {
+      case WATCH_TIMER:
+        tick();
+        break;
+      case WATCH_DEVICE:
+        kz_receive(&((device_t *)w->object)->endpoint, ring.buffer_memory + (size_t)id * RING_BUFFER_SIZE, cqe->res);
+        break;
+      case WATCH_CLIENT:
+        kz_receive(&((client_t *)w->object)->endpoint, ring.buffer_memory + (size_t)id * RING_BUFFER_SIZE, cqe->res);
+        break;
+      default:
+        break;
+    }
+
+    provide_buffer(id);
+  }
+
+  if(cqe->flags & IORING_CQE_F_MORE) {
+    return 1;
+  }
+
+  w->ops --;
+
+  // multishot reads also end when the buffers run out, and are then armed again
+  if(cqe->res > 0 || cqe->res == -ENOBUFS) {
+    arm_read(w);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void run_uring(void) {
+  struct io_uring_cqe * cqe;
+  unsigned int head;
+  watch_t * w;
+
+  while(running) {
+    flush_outputs();
+    submit_and_wait();
+
+    head = *ring.cq_head;
+
+    while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = ring.cqes + (head & *ring.cq_mask);
+      w = (watch_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)1);
+
+      if(!w) {
+        // cancellations
+      } else if(cqe->user_data & 1) {
+        write_completed(w, cqe->res);
+      } else if(w->kind == WATCH_LISTENER) {
+        if(cqe->res >= 0) {
+          add_client(w->object, cqe->res);
+        }
+        if(!(cqe->flags & IORING_CQE_F_MORE)) {
+          w->ops --;
+          arm_accept(w);
+        }
+      } else if(!read_completed(w, cqe)) {
+        if(w->kind == WATCH_DEVICE) {
+          fprintf(stderr, "lost device %s\n", ((device_t *)w->object)->path);
+        } else if(w->kind == WATCH_CLIENT) {
+          close_client(w->object);
+        }
+      }
+
+      head ++;
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+int main(int argc, char ** argv) {
+  struct itimerspec interval;
+  watch_t timer_watch;
+  int use_epoll = 0;
+  int timer_fd;
+  int first;
+  int i;
+
+  first = 1;
+  if(argc > 1 && strcmp(argv[1], "-e") == 0) {
+    use_epoll = 1;
+    first = 2;
+  }
+
+  if(argc - first < 2 || (argc - first) % 2 != 0 || (argc - first) / 2 > MAX_DEVICES) {
+    fprintf(stderr, "usage: %s [-e] <device> <socket> [<device> <socket> ...]\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  // writes through io_uring may find a client gone
+  signal(SIGPIPE, SIG_IGN);
+
+  if(use_epoll || !ring_init()) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  }
+
+  for(i = 0 ; i < KZ_MAX_CHANNELS ; i ++) {
+    channel_ids[i] = i;
+  }
+
+  for(i = 0 ; i < MAX_CLIENTS ; i ++) {
+    clients[i].fd = -1;
+  }
+
+  for(i = first ; i + 1 < argc ; i += 2) {
+    if(!add_device(argv[i], argv[i + 1])) {
+      return 1;
+    }
+  }
+
+  // all endpoints are ticked together
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, (ring.fd >= 0 ? 0 : TFD_NONBLOCK) | TFD_CLOEXEC);
+  interval.it_interval.tv_sec  = 0;
+  interval.it_interval.tv_nsec = TICK_MS * 1000000L;
+  interval.it_value = interval.it_interval;
+  timerfd_settime(timer_fd, 0, &interval, NULL);
+
+  timer_watch.kind   = WATCH_TIMER;
+  timer_watch.object = NULL;
+  timer_watch.fd     = timer_fd;
+  timer_watch.output = NULL;
+  timer_watch.ops    = 0;
+  watch(&timer_watch);
+
+  printf("Serving %d device(s) with %s\n", device_count, ring.fd >= 0 ? "io_uring" : "epoll");
+  fflush(stdout);
+
+  if(ring.fd >= 0) {
+    run_uring();
+  } else {
+    run_epoll();
+  }
+
+  for(i = 0 ; i < device_count ; i ++) {
+    unlink(devices[i].socket_path);
+  }
+
+  return 0;
+}
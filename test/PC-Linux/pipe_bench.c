@@ -0,0 +1,168 @@
+
+// Measures the library on its own, with two endpoints connected by an in-memory pipe
+//
+// usage: pipe_bench [calls] [calls in flight]
+//
+// Every call is encoded, framed, decoded and handled by the other endpoint, and its reply makes
+// the same trip back, without any system calls. Latency is measured one call at a time, then
+// throughput with the given number of calls in flight. Both are measured with COBS framing, then
+// again with datagram endpoints, which send their frames as they are.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kinzhal_pipe.h"
+
+#define CALL_TIMEOUT  100  // ticks
+
+static kz_pipe_t wire;
+static kz_endpoint_t host;
+static kz_endpoint_t device;
+static kz_endpointdef_t host_def;
+static kz_endpointdef_t device_def;
+static kz_byte_t host_rx_buffer[KZ_MAX_BUFFER_SIZE];
+static kz_byte_t host_tx_buffer[KZ_MAX_BUFFER_SIZE];
+static kz_byte_t device_rx_buffer[KZ_MAX_BUFFER_SIZE];
+static kz_byte_t device_tx_buffer[KZ_MAX_BUFFER_SIZE];
+static kz_channel_t host_channels[KZ_MAX_CHANNELS];
+static kz_channel_t device_channels[KZ_MAX_CHANNELS];
+static kz_local_request_t host_local_requests[KZ_MAX_LOCAL_REQUESTS];
+static kz_local_request_t device_local_requests[KZ_MAX_LOCAL_REQUESTS];
+
+static long replies;
+static long failed;
+
+static void init_def(kz_endpointdef_t * def, kz_byte_t * rx_buffer, kz_byte_t * tx_buffer,
+                     kz_channel_t * channels, kz_local_request_t * local_requests) {
+  memset(def, 0, sizeof(*def));
+
+  def->rx_buffer = rx_buffer;
+  def->rx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->tx_buffer = tx_buffer;
+  def->tx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->channels = channels;
+  def->channel_count = KZ_MAX_CHANNELS;
+  def->local_requests = local_requests;
+  def->local_request_count = KZ_MAX_LOCAL_REQUESTS;
+}
+
+static kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+static void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  const kz_int_t arg = *(kz_int_t *)userdata;
+  kz_int_t result;
+
+  if(status == KZ_OK && kz_getint(K, &result) && result == 2*arg) {
+    replies ++;
+  } else {
+    failed ++;
+  }
+}
+
+static int call(kz_int_t arg) {
+  kz_putint(&host, arg);
+
+  return kz_callcopy(&host, 1, record_reply, &arg, sizeof(arg), CALL_TIMEOUT, 0);
+}
+
+static double now_s(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * framing, const char * name, long calls, double elapsed) {
+  const unsigned long frames = wire.ends[0].frames + wire.ends[1].frames;
+  const unsigned long bytes = wire.ends[0].bytes_sent + wire.ends[1].bytes_sent;
+
+  printf("%-8s %-10s %9ld calls in %6.3f s: %10.0f calls/s, %7.1f ns/call, %10.0f frames/s, %6.1f MB/s, %ld failed\n",
+         framing, name, calls, elapsed, calls / elapsed, elapsed * 1e9 / calls,
+         frames / elapsed, bytes / elapsed / 1e6, failed);
+}
+
+static void reset(void) {
+  replies = 0;
+  failed = 0;
+
+  wire.ends[0].frames = 0;
+  wire.ends[1].frames = 0;
+  wire.ends[0].bytes_sent = 0;
+  wire.ends[1].bytes_sent = 0;
+}
+
+// returns 0 if any call failed
+static int run(const char * framing, char datagram, long calls, int window) {
+  double started;
+  long sent;
+  int i;
+
+  init_def(&host_def, host_rx_buffer, host_tx_buffer, host_channels, host_local_requests);
+  init_def(&device_def, device_rx_buffer, device_tx_buffer, device_channels, device_local_requests);
+  host_def.datagram = datagram;
+  device_def.datagram = datagram;
+
+  kz_pipe_connect(&wire, &host, &host_def, &device, &device_def);
+  kz_handle(&device, 1, double_handler, NULL);
+  kz_pipe_pump(&wire);
+
+  // one call at a time: the whole round trip
+  reset();
+  started = now_s();
+
+  for(sent = 0 ; sent < calls ; sent ++) {
+    call(sent);
+    kz_pipe_pump(&wire);
+  }
+
+  report(framing, "latency", calls, now_s() - started);
+
+  // many at a time: requests are delivered together, and so are their replies
+  reset();
+  started = now_s();
+
+  for(sent = 0 ; sent < calls ; ) {
+    for(i = 0 ; i < window && sent < calls ; i ++, sent ++) {
+      if(!call(sent)) {
+        failed ++;
+      }
+    }
+
+    kz_pipe_pump(&wire);
+  }
+
+  report(framing, "throughput", calls, now_s() - started);
+
+  return replies == calls;
+}
+
+int main(int argc, char ** argv) {
+  const long calls = argc > 1 ? atol(argv[1]) : 1000000;
+  const int window = argc > 2 ? atoi(argv[2]) : 8;
+
+  if(calls <= 0 || window <= 0 || window > KZ_MAX_LOCAL_REQUESTS) {
+    fprintf(stderr, "usage: %s [calls] [calls in flight, at most %d]\n", argv[0], KZ_MAX_LOCAL_REQUESTS);
+    return 1;
+  }
+
+  if(!run("cobs", 0, calls, window) || !run("datagram", 1, calls, window)) {
+    return 1;
+  }
+
+  return 0;
+}
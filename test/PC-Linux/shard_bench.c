@@ -0,0 +1,269 @@
+
+// Measures how the shard runtime scales with the number of cores
+//
+// usage: shard_bench [pairs] [seconds] [calls in flight per pair] [most shards]
+//
+// Every pair is a caller and a server on either end of a socket pair, both run by the shards. The
+// callers call their servers as fast as they can. The same load is run on 1, 2, 4, ... shards,
+// each pinned to a core, up to the number of cores (or the number given), and the frames carried
+// each second are reported for each.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "kinzhal_shard.h"
+
+#define CALL_TIMEOUT  100  // ticks
+#define TICK_MS       10
+
+typedef struct {
+  kz_endpoint_t caller;
+  kz_endpoint_t server;
+  kz_endpointdef_t caller_def;
+  kz_endpointdef_t server_def;
+  kz_byte_t caller_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t caller_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t server_rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t server_tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t caller_channels[KZ_MAX_CHANNELS];
+  kz_channel_t server_channels[KZ_MAX_CHANNELS];
+  kz_local_request_t caller_local_requests[KZ_MAX_LOCAL_REQUESTS];
+  kz_local_request_t server_local_requests[KZ_MAX_LOCAL_REQUESTS];
+  int fds[2];
+
+  kz_shard_endpoint_t caller_shard;
+  kz_shard_endpoint_t server_shard;
+
+  // owned by whichever shard owns the caller
+  int window;
+  int in_flight;
+  kz_int_t next_arg;
+
+  atomic_long replies;
+  atomic_long failed;
+} pair_t;
+
+
+static void write_all(int fd, const kz_byte_t * bytes, size_t size) {
+  ssize_t ret;
+
+  while(size > 0) {
+    ret = write(fd, bytes, size);
+
+    if(ret > 0) {
+      bytes += ret;
+      size -= ret;
+    } else if(ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return;
+    }
+  }
+}
+
+static void caller_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((pair_t *)kz_userdata())->fds[0], bytes, size);
+}
+
+static void server_tx(const kz_byte_t * bytes, size_t size) {
+  write_all(((pair_t *)kz_userdata())->fds[1], bytes, size);
+}
+
+static kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+static void fill_window(pair_t * pair);
+
+static void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  pair_t * pair = K->userdata;
+  kz_int_t arg = (intptr_t)userdata;
+  kz_int_t result;
+
+  pair->in_flight --;
+
+  if(status == KZ_OK && kz_getint(K, &result) && result == 2*arg) {
+    atomic_fetch_add_explicit(&pair->replies, 1, memory_order_relaxed);
+  } else {
+    atomic_fetch_add_explicit(&pair->failed, 1, memory_order_relaxed);
+  }
+
+  fill_window(pair);
+}
+
+static void fill_window(pair_t * pair) {
+  while(pair->in_flight < pair->window) {
+    kz_putint(&pair->caller, pair->next_arg);
+
+    if(!kz_call(&pair->caller, 1, record_reply, (void *)(intptr_t)pair->next_arg, CALL_TIMEOUT)) {
+      break;
+    }
+
+    pair->in_flight ++;
+    pair->next_arg ++;
+  }
+}
+
+static void caller_tick(kz_shard_endpoint_t * E, void * userdata) {
+  fill_window(userdata);
+}
+
+static void init_endpoint(kz_endpoint_t * K, kz_endpointdef_t * def, kz_byte_t * rx_buffer, kz_byte_t * tx_buffer,
+                          kz_channel_t * channels, kz_local_request_t * local_requests, pair_t * pair) {
+  def->rx_buffer = rx_buffer;
+  def->rx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->tx_buffer = tx_buffer;
+  def->tx_buffer_size = KZ_MAX_BUFFER_SIZE;
+  def->channels = channels;
+  def->channel_count = KZ_MAX_CHANNELS;
+  def->local_requests = local_requests;
+  def->local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  def->rx_window = 0;
+  def->tx_budget = 0;
+  def->queue_buffer = NULL;
+  def->queue_buffer_size = 0;
+  def->retransmit_ticks = 0;
+  def->datagram = 0;
+  def->address = 0;
+  def->tx_enable = NULL;
+  def->tx_buffer_count = 0;
+  def->tx_async = 0;
+  def->rx = NULL;
+  def->tx = K == &pair->caller ? caller_tx : server_tx;
+  def->userdata = pair;
+
+  kz_init_static(K, def);
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// returns 0 if the runtime couldn't be started
+static int run(int shard_count, int pair_count, int seconds, int window) {
+  kz_shard_runtime_t * R;
+  pair_t * pairs;
+  long started;
+  long elapsed;
+  long replies = 0;
+  long failed = 0;
+  int i;
+
+  R = malloc(sizeof(*R));
+  pairs = calloc(pair_count, sizeof(*pairs));
+
+  if(!R || !pairs || !kz_shard_init(R, shard_count, TICK_MS, 1)) {
+    fprintf(stderr, "error creating %d shard(s)\n", shard_count);
+    return 0;
+  }
+
+  kz_shard_set_balancer(R, kz_shard_balance, NULL, 100);
+
+  for(i = 0 ; i < pair_count ; i ++) {
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pairs[i].fds) != 0) {
+      fprintf(stderr, "error creating socket pair: %s\n", strerror(errno));
+      return 0;
+    }
+
+    pairs[i].window = window;
+    atomic_init(&pairs[i].replies, 0);
+    atomic_init(&pairs[i].failed, 0);
+
+    init_endpoint(&pairs[i].caller, &pairs[i].caller_def, pairs[i].caller_rx_buffer, pairs[i].caller_tx_buffer,
+                  pairs[i].caller_channels, pairs[i].caller_local_requests, pairs + i);
+    init_endpoint(&pairs[i].server, &pairs[i].server_def, pairs[i].server_rx_buffer, pairs[i].server_tx_buffer,
+                  pairs[i].server_channels, pairs[i].server_local_requests, pairs + i);
+    kz_handle(&pairs[i].server, 1, double_handler, NULL);
+
+    pairs[i].caller_shard.on_tick  = caller_tick;
+    pairs[i].caller_shard.userdata = pairs + i;
+    pairs[i].server_shard.on_tick  = NULL;
+    pairs[i].server_shard.userdata = NULL;
+
+    // spread evenly, so that most frames cross from one shard to another
+    kz_shard_add(R, &pairs[i].caller_shard, &pairs[i].caller, pairs[i].fds[0], -1);
+    kz_shard_add(R, &pairs[i].server_shard, &pairs[i].server, pairs[i].fds[1], -1);
+  }
+
+  started = now_ms();
+
+  if(!kz_shard_start(R)) {
+    fprintf(stderr, "error starting %d shard(s)\n", shard_count);
+    return 0;
+  }
+
+  sleep(seconds);
+
+  kz_shard_stop(R);
+
+  elapsed = now_ms() - started;
+
+  for(i = 0 ; i < pair_count ; i ++) {
+    replies += atomic_load(&pairs[i].replies);
+    failed += atomic_load(&pairs[i].failed);
+    close(pairs[i].fds[0]);
+    close(pairs[i].fds[1]);
+  }
+
+  // a request and its reply for every call
+  printf("%2d shard(s): %9.0f frames/s, %ld failed, %u move(s)\n",
+         shard_count, replies * 2 * 1000.0 / elapsed, failed, atomic_load(&R->moves));
+
+  free(pairs);
+  free(R);
+
+  return 1;
+}
+
+int main(int argc, char ** argv) {
+  const int pair_count = argc > 1 ? atoi(argv[1]) : 256;
+  const int seconds = argc > 2 ? atoi(argv[2]) : 2;
+  const int window = argc > 3 ? atoi(argv[3]) : 4;
+
+  cpu_set_t cpus;
+  int most_shards;
+  int shard_count;
+
+  sched_getaffinity(0, sizeof(cpus), &cpus);
+  most_shards = argc > 4 ? atoi(argv[4]) : CPU_COUNT(&cpus);
+
+  if(pair_count <= 0 || seconds <= 0 || window <= 0 || most_shards <= 0 || most_shards > KZ_SHARD_MAX_SHARDS) {
+    fprintf(stderr, "usage: %s [pairs] [seconds] [calls in flight per pair] [most shards]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d endpoint(s), %d call(s) in flight per caller, %d core(s)\n", pair_count * 2, window, CPU_COUNT(&cpus));
+
+  for(shard_count = 1 ; shard_count < most_shards ; shard_count *= 2) {
+    if(!run(shard_count, pair_count, seconds, window)) {
+      return 1;
+    }
+  }
+
+  if(!run(most_shards, pair_count, seconds, window)) {
+    return 1;
+  }
+
+  return 0;
+}
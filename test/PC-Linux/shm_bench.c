@@ -0,0 +1,280 @@
+
+// Measures calls between two processes, over a socket pair and over shared memory
+//
+// usage: shm_bench [calls] [calls in flight]
+//
+// A child process answers calls on channel 1 by doubling its argument, and the parent calls it
+// as fast as it can, one call at a time and then with the given number in flight. This is done
+// once over a Unix stream socket pair, with COBS framing, as a stand-in for a pty, then again
+// over a shared-memory segment.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "kinzhal_shm.h"
+
+#define CALL_TIMEOUT  1000  // ticks, which are never counted
+
+typedef struct {
+  kz_endpoint_t endpoint;
+  kz_endpointdef_t def;
+  kz_byte_t rx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_byte_t tx_buffer[KZ_MAX_BUFFER_SIZE];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
+  int fd;
+} socket_endpoint_t;
+
+static long replies;
+static long failed;
+static int in_flight;
+
+static kz_request_status_t double_handler(kz_endpoint_t * K, void * userdata) {
+  kz_int_t i;
+
+  if(!kz_getint(K, &i)) {
+    return KZ_INVALID;
+  }
+
+  kz_putint(K, 2*i);
+
+  return KZ_OK;
+}
+
+static kz_request_status_t stop_handler(kz_endpoint_t * K, void * userdata) {
+  *(int *)userdata = 1;
+
+  return KZ_OK;
+}
+
+static void record_reply(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  const kz_int_t arg = *(kz_int_t *)userdata;
+  kz_int_t result;
+
+  in_flight --;
+
+  if(status == KZ_OK && kz_getint(K, &result) && result == 2*arg) {
+    replies ++;
+  } else {
+    failed ++;
+  }
+}
+
+static void record_stop(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  in_flight --;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// socket pair
+
+static void socket_tx(const kz_byte_t * bytes, size_t size) {
+  socket_endpoint_t * S = kz_userdata();
+  ssize_t ret;
+
+  while(size > 0) {
+    ret = write(S->fd, bytes, size);
+
+    if(ret > 0) {
+      bytes += ret;
+      size -= ret;
+    } else if(ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return;
+    }
+  }
+}
+
+static void socket_init(socket_endpoint_t * S, int fd) {
+  memset(&S->def, 0, sizeof(S->def));
+
+  S->fd = fd;
+
+  S->def.rx_buffer = S->rx_buffer;
+  S->def.rx_buffer_size = sizeof(S->rx_buffer);
+  S->def.tx_buffer = S->tx_buffer;
+  S->def.tx_buffer_size = sizeof(S->tx_buffer);
+  S->def.channels = S->channels;
+  S->def.channel_count = KZ_MAX_CHANNELS;
+  S->def.local_requests = S->local_requests;
+  S->def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  S->def.tx = socket_tx;
+  S->def.userdata = S;
+
+  kz_init_static(&S->endpoint, &S->def);
+}
+
+// blocks until something has been received, returns 0 once the other end has gone
+static int socket_poll(socket_endpoint_t * S) {
+  kz_byte_t bytes[4096];
+  ssize_t ret;
+
+  ret = read(S->fd, bytes, sizeof(bytes));
+
+  if(ret > 0) {
+    kz_receive(&S->endpoint, bytes, ret);
+  }
+
+  return ret > 0 || (ret < 0 && errno == EINTR);
+}
+
+// the calls made over either transport
+
+static void calls(kz_endpoint_t * K, void (* wait)(void *), void * transport, const char * name, long count, int window) {
+  kz_int_t arg;
+  double started;
+  long sent;
+  int w;
+
+  for(w = 1 ; ; w = window) {
+    replies = 0;
+    failed = 0;
+    started = now_s();
+
+    for(sent = 0 ; replies + failed < count ; ) {
+      while(sent < count && in_flight < w) {
+        arg = sent;
+        kz_putint(K, arg);
+
+        if(!kz_callcopy(K, 1, record_reply, &arg, sizeof(arg), CALL_TIMEOUT, 0)) {
+          break;
+        }
+
+        in_flight ++;
+        sent ++;
+      }
+
+      wait(transport);
+    }
+
+    printf("%-10s %2d in flight: %9.0f calls/s, %8.1f us/call, %ld failed\n",
+           name, w, count / (now_s() - started), (now_s() - started) * 1e6 / count, failed);
+
+    if(w == window) {
+      break;
+    }
+  }
+
+  // tell the child to finish
+  kz_call(K, 2, record_stop, NULL, CALL_TIMEOUT);
+  in_flight ++;
+
+  while(in_flight) {
+    wait(transport);
+  }
+}
+
+static void socket_poll_parent(void * transport) {
+  socket_poll(transport);
+}
+
+static void shm_poll_parent(void * transport) {
+  kz_shm_poll(transport, -1);
+}
+
+static int wait_child(pid_t child) {
+  int status;
+
+  return waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int run_socket(long count, int window) {
+  static socket_endpoint_t S;
+  int fds[2];
+  int stop = 0;
+  pid_t child;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    fprintf(stderr, "error creating socket pair: %s\n", strerror(errno));
+    return 0;
+  }
+
+  child = fork();
+
+  if(child == 0) {
+    close(fds[0]);
+    socket_init(&S, fds[1]);
+    kz_handle(&S.endpoint, 1, double_handler, NULL);
+    kz_handle(&S.endpoint, 2, stop_handler, &stop);
+
+    while(!stop && socket_poll(&S)) {
+    }
+
+    _exit(0);
+  }
+
+  close(fds[1]);
+  socket_init(&S, fds[0]);
+
+  calls(&S.endpoint, socket_poll_parent, &S, "socket", count, window);
+
+  close(fds[0]);
+
+  return wait_child(child);
+}
+
+static int run_shm(long count, int window) {
+  static kz_shm_t S;
+  static kz_shm_t child_S;
+  int stop = 0;
+  pid_t child;
+
+  if(!kz_shm_create(&S, NULL, 0)) {
+    fprintf(stderr, "error creating shared memory: %s\n", strerror(errno));
+    return 0;
+  }
+
+  child = fork();
+
+  if(child == 0) {
+    if(!kz_shm_attach(&child_S, S.fd, 0)) {
+      _exit(1);
+    }
+
+    kz_handle(&child_S.endpoint, 1, double_handler, NULL);
+    kz_handle(&child_S.endpoint, 2, stop_handler, &stop);
+
+    while(!stop) {
+      kz_shm_poll(&child_S, -1);
+    }
+
+    _exit(0);
+  }
+
+  calls(&S.endpoint, shm_poll_parent, &S, "shm", count, window);
+
+  kz_shm_close(&S);
+
+  return wait_child(child);
+}
+
+int main(int argc, char ** argv) {
+  const long count = argc > 1 ? atol(argv[1]) : 200000;
+  const int window = argc > 2 ? atoi(argv[2]) : 8;
+
+  if(count <= 0 || window <= 0 || window > KZ_MAX_LOCAL_REQUESTS - 1) {
+    fprintf(stderr, "usage: %s [calls] [calls in flight, at most %d]\n", argv[0], KZ_MAX_LOCAL_REQUESTS - 1);
+    return 1;
+  }
+
+  if(!run_socket(count, window) || !run_shm(count, window)) {
+    return 1;
+  }
+
+  return 0;
+}
@@ -71,6 +71,9 @@ typedef struct {
   int fd;
   kz_byte_t rx_buffer[256];
   kz_byte_t tx_buffer[256];
+  kz_byte_t queue_buffer[1024];
+  kz_channel_t channels[KZ_MAX_CHANNELS];
+  kz_local_request_t local_requests[KZ_MAX_LOCAL_REQUESTS];
 } tty_port;
 
 
@@ -107,8 +110,55 @@ void loopcount_handler(kz_endpoint_t * K, void * userdata, kz_request_status_t s
       printf("Error reading loop count. (request id: %d)\n", *request_id);
     }
   }
+}
+
+
+void info_handler(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  if(status == KZ_MORE) {
+    // one part per channel
+    kz_int_t channel, num_args, num_results;
+    if(kz_getint(K, &channel) && kz_getint(K, &num_args) && kz_getint(K, &num_results)) {
+      printf("Arduino channel %ld: %ld argument(s), %ld result(s)\n", channel, num_args, num_results);
+    }
+  } else if(status == KZ_IGNORE) {
+    printf("Arduino ignored our request for info!\n");
+  } else {
+    printf("End of Arduino channel info.\n");
+  }
+}
+
+
+void constants_handler(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  static const char * const names[] = { "pi", "Euler's number" };
+  kz_request_status_t entry_status;
+  kz_float_t value;
+  unsigned int i = 0;
+
+  if(status == KZ_IGNORE) {
+    printf("Arduino ignored our request for constants!\n");
+    return;
+  }
 
-  free(userdata);
+  // one entry per batched call
+  while(i < sizeof(names)/sizeof(names[0]) && kz_getbatchentry(K, &entry_status)) {
+    if(entry_status == KZ_OK && kz_getfloat(K, &value)) {
+      printf("Arduino's %s: %f\n", names[i], value);
+    } else {
+      printf("Error reading Arduino's %s.\n", names[i]);
+    }
+    i ++;
+  }
+}
+
+
+void pushed_loopcount_handler(kz_endpoint_t * K, void * userdata, kz_request_status_t status) {
+  kz_int_t loop_count;
+
+  if(status == KZ_MORE && kz_getint(K, &loop_count)) {
+    printf("Arduino loop count: %ld (pushed)\n", loop_count);
+  } else if(status != KZ_MORE) {
+    printf("Arduino loop count subscription has ended.\n");
+  }
 }
 
 
@@ -123,11 +173,40 @@ static void mainloop() {
   def.rx_buffer_size = sizeof(port.rx_buffer);
   def.tx_buffer = port.tx_buffer;
   def.tx_buffer_size = sizeof(port.tx_buffer);
+  def.channels = port.channels;
+  def.channel_count = KZ_MAX_CHANNELS;
+  def.local_requests = port.local_requests;
+  def.local_request_count = KZ_MAX_LOCAL_REQUESTS;
+  def.rx_window = 0;
+  def.tx_budget = 0;
+  // hold calls here while the arduino is busy
+  def.queue_buffer = port.queue_buffer;
+  def.queue_buffer_size = sizeof(port.queue_buffer);
+  // resend idempotent calls after 100ms without a reply
+  def.retransmit_ticks = 5;
+  def.datagram = 0;
+  def.address = 0;
+  def.tx_enable = NULL;
+  def.tx_buffer_count = 0;
+  def.tx_async = 0;
   def.rx = port_rx;
   def.tx = port_tx;
+  def.userdata = NULL;
 
   kz_init_static(&endpoint, &def);
 
+  // ask what the arduino has to offer
+  kz_call(&endpoint, 6, info_handler, NULL, 100);
+
+  // fetch both constants at once
+  kz_batchbegin(&endpoint);
+  kz_batchadd(&endpoint, 1);
+  kz_batchadd(&endpoint, 2);
+  kz_batchcall(&endpoint, constants_handler, NULL, 100);
+
+  // have the arduino push its loop count about once a second
+  kz_subscribe(&endpoint, 4, KZ_SUBSCRIBE_PERIODIC, 100, pushed_loopcount_handler, NULL, KZ_NO_TIMEOUT);
+
   // request the arduino's loop count... constantly
   int request_id = 0;
 
@@ -136,12 +215,10 @@ static void mainloop() {
 
     //kz_send(&endpoint, 1);
 
-    // allocate call data containing this particular request id
-    int * call_data = malloc(sizeof(*call_data));
-    *call_data = request_id;
-
-    // make request
-    kz_call(&endpoint, 4, loopcount_handler, call_data, 100);
+    // make request, carrying this particular request id, reading the loop count twice does no harm
+    if(!kz_callcopy(&endpoint, 4, loopcount_handler, &request_id, sizeof(request_id), 100, KZ_CALL_IDEMPOTENT)) {
+      printf("Too many requests pending! (request id: %d)\n", request_id);
+    }
 
     request_id ++;
 